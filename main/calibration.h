@@ -0,0 +1,201 @@
+#pragma once
+
+#include <M5Unified.h>
+#include <math.h>
+#include <stdint.h>
+
+#include "constants.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "gps_data.h"
+
+/** Result of the wheel size calibration, read by the display. */
+struct WheelCalibrationResult {
+    bool isActive;
+    uint16_t segments;      // Segments used for the estimation
+    float segmentDistance;  // m of GPS distance in the current segment
+    float circumference;    // mm, mean of the segments, 0 if none
+    float confidence;       // mm, half-width of the confidence interval, 0 if not enough segments
+    bool hasSuggestion;     // Whether enough segments have been measured to apply the circumference
+};
+
+/**
+ * Calibration of the wheel size against the GPS distance. The wheel revolutions and the GPS distance are accumulated
+ * over segments of CALIBRATION_SEGMENT_DISTANCE, each segment gives a circumference sample. A segment is dropped when
+ * the fix is poor (HDOP above CALIBRATION_MAX_HDOP, fix lost), the course changes by more than
+ * CALIBRATION_MAX_HEADING_CHANGE (the GPS distance cuts corners) or the speed is too low for a reliable course.
+ *
+ * The samples are combined with Welford's online algorithm: mean and variance are updated with each sample, in
+ * constant memory. The confidence is the half-width of the confidence interval of the mean, i.e. it shrinks with the
+ * square root of the number of segments. Revolutions come from the magnetic process and fixes from the GPS process,
+ * the calibration is protected by its own mutex.
+ */
+class WheelCalibration {
+    SemaphoreHandle_t mutex;
+    bool active{false};
+
+    // Current segment
+    bool isSegmentStarted{false};
+    float segmentRevolutions{0.0f};
+    float segmentDistance{0.0f};  // m
+    float segmentCourse{0.0f};    // deg, course at the start of the segment
+    uint64_t lastFixTime{0};      // us
+    bool isHdopGood{false};
+
+    // Welford's accumulators of the circumference samples, in mm
+    uint16_t count{0};
+    float mean{0.0f};
+    float m2{0.0f};  // Sum of the squared differences from the mean
+
+    /** Drop the current segment, a new one starts at the next valid fix. */
+    void dropSegment() {
+        isSegmentStarted = false;
+        segmentRevolutions = segmentDistance = 0.0f;
+    }
+
+    /** Start a segment at a fix, from the current course. */
+    void startSegment(float course) {
+        isSegmentStarted = true;
+        segmentRevolutions = segmentDistance = 0.0f;
+        segmentCourse = course;
+    }
+
+    /** Add the circumference of the completed segment to the estimation. */
+    void addSample() {
+        float circumference = segmentRevolutions > 0.0f ? segmentDistance * 1000.0f / segmentRevolutions : 0.0f;
+        if (circumference < CALIBRATION_MIN_WHEEL_SIZE || circumference > CALIBRATION_MAX_WHEEL_SIZE) {
+            M5_LOGW("Calibration: segment rejected (%f mm)", circumference);
+            return;
+        }
+
+        count++;
+        float delta = circumference - mean;
+        mean += delta / count;
+        m2 += delta * (circumference - mean);
+        M5_LOGI("Calibration: segment %u, %f mm (mean %f mm)", count, circumference, mean);
+    }
+
+    /** Absolute difference between two courses, in deg. */
+    static float courseDifference(float a, float b) {
+        float difference = fabsf(a - b);
+        return difference > 180.0f ? 360.0f - difference : difference;
+    }
+
+   public:
+    WheelCalibration() {
+        mutex = xSemaphoreCreateMutex();
+        if (mutex == NULL) {
+            M5_LOGE("Failed to create calibration mutex");
+            abort();
+        }
+    }
+
+    /** Start a new calibration, forgetting the previous one. */
+    void start() {
+        if (xSemaphoreTake(mutex, STATE_SEMAPHORE_TIMEOUT)) {
+            dropSegment();
+            count = 0;
+            mean = m2 = 0.0f;
+            lastFixTime = 0;
+            isHdopGood = false;
+            active = true;
+            xSemaphoreGive(mutex);
+        }
+    }
+
+    /** Stop the calibration, keeping the result. */
+    void stop() {
+        if (xSemaphoreTake(mutex, STATE_SEMAPHORE_TIMEOUT)) {
+            active = false;
+            dropSegment();
+            xSemaphoreGive(mutex);
+        }
+    }
+
+    bool isActive() {
+        bool isActive{false};
+        if (xSemaphoreTake(mutex, STATE_SEMAPHORE_TIMEOUT)) {
+            isActive = active;
+            xSemaphoreGive(mutex);
+        }
+        return isActive;
+    }
+
+    /**
+     * Add wheel sensor pulses to the current segment.
+     * @param pulses Pulses since the last call.
+     * @param magnets Number of magnets on the wheel.
+     */
+    void addPulses(uint32_t pulses, uint8_t magnets) {
+        if (pulses == 0 || !xSemaphoreTake(mutex, STATE_SEMAPHORE_TIMEOUT)) {
+            return;
+        }
+        if (active && isSegmentStarted) {
+            segmentRevolutions += static_cast<float>(pulses) / magnets;
+        }
+        xSemaphoreGive(mutex);
+    }
+
+    /**
+     * Update with the values received from the GPS.
+     * @param data Updated values.
+     * @param distance GPS distance since the last update in m.
+     * @param now Current time in us.
+     */
+    void updateGps(const GpsData& data, float distance, uint64_t now) {
+        if (!xSemaphoreTake(mutex, STATE_SEMAPHORE_TIMEOUT)) {
+            return;
+        }
+        if (!active) {
+            xSemaphoreGive(mutex);
+            return;
+        }
+
+        // Fix quality, given by another sentence than the course with NMEA
+        if (data.hasHdop) {
+            isHdopGood = data.hdop <= CALIBRATION_MAX_HDOP;
+        }
+        if (data.hasLocation) {
+            if (lastFixTime != 0 && now - lastFixTime > CALIBRATION_MAX_FIX_INTERVAL_US) {
+                dropSegment();  // Fix lost, the pulses during the loss have no GPS distance
+            }
+            lastFixTime = now;
+        }
+        if (!isHdopGood || (data.hasSpeed && data.speed < CALIBRATION_MIN_SPEED)) {
+            dropSegment();
+            xSemaphoreGive(mutex);
+            return;
+        }
+
+        if (isSegmentStarted) {
+            segmentDistance += distance;
+        }
+        if (data.hasCourse && data.hasSpeed) {
+            if (!isSegmentStarted || courseDifference(data.course, segmentCourse) > CALIBRATION_MAX_HEADING_CHANGE) {
+                startSegment(data.course);  // Not straight: restart from the new course
+            } else if (segmentDistance >= CALIBRATION_SEGMENT_DISTANCE) {
+                addSample();
+                startSegment(data.course);
+            }
+        }
+        xSemaphoreGive(mutex);
+    }
+
+    WheelCalibrationResult getResult() {
+        WheelCalibrationResult result{};
+        if (xSemaphoreTake(mutex, STATE_SEMAPHORE_TIMEOUT)) {
+            result.isActive = active;
+            result.segments = count;
+            result.segmentDistance = segmentDistance;
+            result.circumference = mean;
+            result.hasSuggestion = count >= CALIBRATION_MIN_SEGMENTS;
+            if (count >= 2) {
+                result.confidence = CALIBRATION_CONFIDENCE_Z * sqrtf(m2 / (count - 1) / count);
+            }
+            xSemaphoreGive(mutex);
+        }
+        return result;
+    }
+};
+
+WheelCalibration wheelCalibration;
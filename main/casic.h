@@ -0,0 +1,231 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+// CASIC binary protocol of the ATGM336H receiver. A frame is made of: header (0xBA 0xCE), payload length (U2), class
+// (U1), id (U1), payload and checksum (U4). Values are little endian and the payload length is a multiple of 4.
+#define CASIC_HEADER_1 0xBA
+#define CASIC_HEADER_2 0xCE
+#define CASIC_FRAME_OVERHEAD 10  // Header, length, class, id and checksum
+#define CASIC_MAX_PAYLOAD_SIZE 128
+
+#define CASIC_CLASS_NAV 0x01
+#define CASIC_ID_NAV_PV 0x03       // Position and velocity
+#define CASIC_ID_NAV_TIMEUTC 0x10  // UTC time
+#define CASIC_CLASS_CFG 0x06
+#define CASIC_ID_CFG_MSG 0x01  // Message output rate
+
+// NAV-PV payload
+#define CASIC_NAV_PV_SIZE 80
+#define CASIC_NAV_PV_RUN_TIME 0
+#define CASIC_NAV_PV_POS_VALID 4
+#define CASIC_NAV_PV_VEL_VALID 5
+#define CASIC_NAV_PV_NUM_SV 7
+#define CASIC_NAV_PV_PDOP 12
+#define CASIC_NAV_PV_LON 16
+#define CASIC_NAV_PV_LAT 24
+#define CASIC_NAV_PV_HEIGHT 32
+#define CASIC_NAV_PV_SPEED_2D 64
+#define CASIC_NAV_PV_HEADING 68
+#define CASIC_NAV_PV_MIN_VALID 6  // 2D fix or better
+
+// NAV-TIMEUTC payload
+#define CASIC_NAV_TIMEUTC_SIZE 24
+#define CASIC_NAV_TIMEUTC_MS 12
+#define CASIC_NAV_TIMEUTC_HOUR 18
+#define CASIC_NAV_TIMEUTC_MINUTE 19
+#define CASIC_NAV_TIMEUTC_SECOND 20
+#define CASIC_NAV_TIMEUTC_VALID 21
+
+/** Navigation values decoded from CASIC messages. */
+struct CasicNavigation {
+    uint32_t runTime{0};  // ms since the receiver started
+    bool positionValid{false};
+    bool velocityValid{false};
+    uint8_t satellites{0};
+    float dop{0.0f};        // Position dilution of precision
+    double latitude{0.0};   // deg
+    double longitude{0.0};  // deg
+    float altitude{0.0f};   // m
+    float speed{0.0f};      // m/s, horizontal
+    float heading{0.0f};    // deg
+
+    bool timeValid{false};
+    uint8_t hour{0};
+    uint8_t minute{0};
+    uint8_t second{0};
+    uint16_t millisecond{0};
+};
+
+/** Decoder for CASIC binary frames, fed one byte at a time. The values are read directly from the payload, without
+ * any text conversion. */
+class CasicDecoder {
+    enum class State : uint8_t {
+        HEADER_1,
+        HEADER_2,
+        LENGTH_1,
+        LENGTH_2,
+        CLASS,
+        ID,
+        PAYLOAD,
+        CHECKSUM,
+    };
+
+    State state{State::HEADER_1};
+    uint16_t length{0};
+    uint16_t offset{0};
+    uint8_t messageClass{0};
+    uint8_t messageId{0};
+    uint8_t payload[CASIC_MAX_PAYLOAD_SIZE];
+    uint32_t receivedChecksum{0};
+
+    CasicNavigation nav;
+    bool navigationUpdated{false};
+    bool timeUpdated{false};
+
+    uint32_t passedChecksumCount{0};
+    uint32_t failedChecksumCount{0};
+
+    template <typename T>
+    T read(uint16_t position) const {
+        T value;
+        memcpy(&value, &payload[position], sizeof(T));
+        return value;
+    }
+
+    /** Decode the payload of a complete frame. */
+    void decode() {
+        if (messageClass != CASIC_CLASS_NAV) {
+            return;
+        }
+
+        if (messageId == CASIC_ID_NAV_PV && length >= CASIC_NAV_PV_SIZE) {
+            nav.runTime = read<uint32_t>(CASIC_NAV_PV_RUN_TIME);
+            nav.positionValid = payload[CASIC_NAV_PV_POS_VALID] >= CASIC_NAV_PV_MIN_VALID;
+            nav.velocityValid = payload[CASIC_NAV_PV_VEL_VALID] >= CASIC_NAV_PV_MIN_VALID;
+            nav.satellites = payload[CASIC_NAV_PV_NUM_SV];
+            nav.dop = read<float>(CASIC_NAV_PV_PDOP);
+            nav.longitude = read<double>(CASIC_NAV_PV_LON);
+            nav.latitude = read<double>(CASIC_NAV_PV_LAT);
+            nav.altitude = read<float>(CASIC_NAV_PV_HEIGHT);
+            nav.speed = read<float>(CASIC_NAV_PV_SPEED_2D);
+            nav.heading = read<float>(CASIC_NAV_PV_HEADING);
+            navigationUpdated = true;
+        } else if (messageId == CASIC_ID_NAV_TIMEUTC && length >= CASIC_NAV_TIMEUTC_SIZE) {
+            nav.timeValid = payload[CASIC_NAV_TIMEUTC_VALID] != 0;
+            nav.millisecond = read<uint16_t>(CASIC_NAV_TIMEUTC_MS);
+            nav.hour = payload[CASIC_NAV_TIMEUTC_HOUR];
+            nav.minute = payload[CASIC_NAV_TIMEUTC_MINUTE];
+            nav.second = payload[CASIC_NAV_TIMEUTC_SECOND];
+            timeUpdated = true;
+        }
+    }
+
+   public:
+    /**
+     * Process one byte received from the receiver.
+     * @return Whether a complete frame with a valid checksum has just been decoded.
+     */
+    bool encode(uint8_t c) {
+        switch (state) {
+            case State::HEADER_1:
+                if (c == CASIC_HEADER_1) state = State::HEADER_2;
+                return false;
+            case State::HEADER_2:
+                state = c == CASIC_HEADER_2 ? State::LENGTH_1 : c == CASIC_HEADER_1 ? State::HEADER_2 : State::HEADER_1;
+                return false;
+            case State::LENGTH_1:
+                length = c;
+                state = State::LENGTH_2;
+                return false;
+            case State::LENGTH_2:
+                length |= c << 8;
+                // Frames too large for the buffer are not used, resynchronize on the next header
+                state = length <= CASIC_MAX_PAYLOAD_SIZE && length % 4 == 0 ? State::CLASS : State::HEADER_1;
+                return false;
+            case State::CLASS:
+                messageClass = c;
+                state = State::ID;
+                return false;
+            case State::ID:
+                messageId = c;
+                offset = 0;
+                receivedChecksum = 0;
+                state = length > 0 ? State::PAYLOAD : State::CHECKSUM;
+                return false;
+            case State::PAYLOAD:
+                payload[offset++] = c;
+                if (offset == length) {
+                    offset = 0;
+                    receivedChecksum = 0;
+                    state = State::CHECKSUM;
+                }
+                return false;
+            case State::CHECKSUM:
+                receivedChecksum |= static_cast<uint32_t>(c) << (8 * offset++);
+                if (offset < 4) {
+                    return false;
+                }
+                state = State::HEADER_1;
+                if (receivedChecksum != checksum(messageClass, messageId, payload, length)) {
+                    failedChecksumCount++;
+                    return false;
+                }
+                passedChecksumCount++;
+                decode();
+                return true;
+        }
+        return false;
+    }
+
+    /** Compute the checksum of a frame: header word followed by the sum of the payload words. */
+    static uint32_t checksum(uint8_t messageClass, uint8_t messageId, const uint8_t* payload, uint16_t length) {
+        uint32_t sum = (static_cast<uint32_t>(messageId) << 24) + (static_cast<uint32_t>(messageClass) << 16) + length;
+        for (uint16_t i = 0; i + 4 <= length; i += 4) {
+            uint32_t word;
+            memcpy(&word, &payload[i], sizeof(word));
+            sum += word;
+        }
+        return sum;
+    }
+
+    /**
+     * Build a complete frame, e.g. to send a configuration message to the receiver.
+     * @param frame Output buffer, at least `length + CASIC_FRAME_OVERHEAD` bytes.
+     * @return Size of the frame in bytes.
+     */
+    static size_t encodeFrame(uint8_t messageClass, uint8_t messageId, const uint8_t* payload, uint16_t length,
+                              uint8_t* frame) {
+        frame[0] = CASIC_HEADER_1;
+        frame[1] = CASIC_HEADER_2;
+        frame[2] = length & 0xFF;
+        frame[3] = length >> 8;
+        frame[4] = messageClass;
+        frame[5] = messageId;
+        memcpy(&frame[6], payload, length);
+        uint32_t sum = checksum(messageClass, messageId, payload, length);
+        memcpy(&frame[6 + length], &sum, sizeof(sum));
+        return length + CASIC_FRAME_OVERHEAD;
+    }
+
+    /** Whether a new position and velocity has been decoded since the last call. */
+    bool isNavigationUpdated() {
+        bool updated = navigationUpdated;
+        navigationUpdated = false;
+        return updated;
+    }
+
+    /** Whether a new time has been decoded since the last call. */
+    bool isTimeUpdated() {
+        bool updated = timeUpdated;
+        timeUpdated = false;
+        return updated;
+    }
+
+    const CasicNavigation& navigation() const { return nav; }
+
+    uint32_t passedChecksum() const { return passedChecksumCount; }
+    uint32_t failedChecksum() const { return failedChecksumCount; }
+};
@@ -5,7 +5,6 @@
 #define LOG_LEVEL ESP_LOG_INFO
 
 // ===== GPS =====
-#define GPS_LOOP_DELAY_MS 500
 #define GPS_PROCESS_CORE 0
 #define GPS_PROCESS_PRIORITY 3
 #define GPS_PROCESS_STACK_DEPTH 1024 * 8
@@ -14,13 +13,42 @@
 #define GPS_UART_RX_PIN 13
 #define GPS_UART_TX_PIN 14
 #define GPS_UART_BUFFER_SIZE 1024
+#define GPS_UART_EVENT_QUEUE_SIZE 20
+#define GPS_UART_PATTERN_CHAR '\n'  // End of NMEA sentence
+#define GPS_UART_PATTERN_QUEUE_SIZE 20
+#define GPS_NMEA_FRAMER_SIZE 1024         // Must be a power of 2
+#define GPS_NMEA_MAX_SENTENCE_LENGTH 128  // 82 per standard, with margin for proprietary sentences
+#define GPS_UART_READ_SIZE 256            // Chunk size for reading binary data
+#define GPS_EVENT_TIMEOUT_MS 1000         // Max wait for UART events, notifications are handled in between
 // #define GPS_UART_BAUD_RATE 9600  // Standard for ATGM336H-5N
 #define GPS_UART_BAUD_RATE 115200  // Standard for ATGM336H-6N
+// Protocol used to receive data from the GPS: NMEA sentences (text) or CASIC messages (binary, smaller and cheaper to
+// decode)
+#define GPS_PROTOCOL_NMEA 0
+#define GPS_PROTOCOL_CASIC 1
+#define GPS_PROTOCOL GPS_PROTOCOL_NMEA
+// Receiver configuration (CASIC commands of the ATGM336H), sent at startup
+#define GPS_UPDATE_RATE_MS 100  // 1000 (receiver default), 500, 250, 200 or 100 (10Hz, needs 115200 bauds)
+#define GPS_RECEIVER_OUTPUT_COMMAND "PCAS03,1,0,0,0,1,0,0,0,0,0,,,0,0,,,,0"  // Only output GGA and RMC sentences
+#define GPS_RECEIVER_NO_OUTPUT_COMMAND "PCAS03,0,0,0,0,0,0,0,0,0,0,,,0,0,,,,0"  // No NMEA sentence
 #define GPS_MAX_SPEED 150.0f
 #define GPS_UPDATE_MIN_DISTANCE 0.6f
-#define GPS_UPDATE_MIN_TIME (GPS_LOOP_DELAY_MS * 0.8) * 1000
-#define GPS_UPDATE_MAX_TIME 180'000'000  // 3min, account for loss of GPS signal
+#define GPS_UPDATE_MIN_TIME (GPS_UPDATE_RATE_MS * 500)  // Half of a fix period (us), skip GGA after RMC of same fix
+#define GPS_UPDATE_MAX_TIME 180'000'000                 // 3min, account for loss of GPS signal
 #define GPS_UPDATE_MAX_DISTANCE (GPS_MAX_SPEED / 3.6f * (GPS_UPDATE_MAX_TIME/1000000))
+// Method for distance calculation: sum of distances between positions, integration of the Doppler speed over time, or
+// Doppler integration blended with the positions. Doppler speed is not affected by position jitter at low speed, and
+// does not cut corners.
+#define GPS_DISTANCE_POSITION 0
+#define GPS_DISTANCE_DOPPLER 1
+#define GPS_DISTANCE_BLENDED 2
+#ifndef GPS_DISTANCE_METHOD  // Can be set by the build to opt into a Doppler method
+#define GPS_DISTANCE_METHOD GPS_DISTANCE_POSITION
+#endif
+#define GPS_DOPPLER_MIN_SPEED 1.0f          // km/h, below: stopped
+#define GPS_DOPPLER_MAX_INTERVAL_MS 2000    // Longer intervals between fixes use the distance between positions
+#define GPS_DISTANCE_BLEND_WEIGHT 0.8f      // Weight of the Doppler distance in blended method
+#define GPS_DISTANCE_BLEND_MIN_SPEED 10.0f  // km/h, below: only Doppler, position jitter is too large
 
 // ===== Buttons =====
 #define BUTTONS_LOOP_DELAY_MS 1000
@@ -31,26 +59,65 @@
 #define BUTTON_INCREMENT_DISTANCE_LONG_PRESS_TIME_MS 800
 #define BUTTON_INCREMENT_DISTANCE_SHORT_PRESS_TIME_MS CONFIG_BUTTON_SHORT_PRESS_TIME_MS  // Keep default value
 #define BUTTON_INCREMENT_DISTANCE_GPIO 33
-#define BUTTON_INCREMENT_DISTANCE_M 10.0f
+#define BUTTON_INCREMENT_DISTANCE_MM 10'000
 
 #define BUTTON_DECREMENT_DISTANCE_LONG_PRESS_TIME_MS 800
 #define BUTTON_DECREMENT_DISTANCE_SHORT_PRESS_TIME_MS CONFIG_BUTTON_SHORT_PRESS_TIME_MS  // Keep default value
 #define BUTTON_DECREMENT_DISTANCE_GPIO 27
-#define BUTTON_DECREMENT_DISTANCE_M -10.0f
+#define BUTTON_DECREMENT_DISTANCE_MM -10'000
 
 #define BUTTON_MENU_LONG_PRESS_TIME_MS 6000
 #define BUTTON_MENU_SHORT_PRESS_TIME_MS CONFIG_BUTTON_SHORT_PRESS_TIME_MS  // Keep default value
 #define BUTTON_MENU_GPIO 32
 
 // ===== Magnetic =====
-#define MAGNETIC_LOOP_DELAY_MS 1000
+#define MAGNETIC_LOOP_DELAY_MS 200
 #define MAGNETIC_PROCESS_CORE 0
 #define MAGNETIC_PROCESS_PRIORITY 3
 #define MAGNETIC_PROCESS_STACK_DEPTH 1024 * 8
-#define MAGNETIC_SPEED_CHECK_DELAY_MS 1000  // Must be a multiple of MAGNETIC_LOOP_DELAY_MS
+#define MAGNETIC_COALESCING_WINDOW_US 50'000  // Min time between two updates on pulses, pulses in between are grouped
+#define MAGNETIC_SPEED_PERIODS 5              // Periods between pulses used for the median speed
+#define MAGNETIC_SPEED_TIMEOUT_US 3'000'000   // Without pulse for longer: stopped
+#define MAGNETIC_PULSE_RING_SIZE 32           // Pulse times waiting for the magnetic process, must be a power of 2
 #define MAGNETIC_SENSOR_PIN GPIO_NUM_25
-#define MAGNETIC_MIN_ISR_DELAY_US 20'000  // 20ms
-#define MAGNETIC_UPDATE_MAX_REVOLUTIONS (MAGNETIC_LOOP_DELAY_MS / 10)  // Maximum number of revolutions per update
+// Backend counting the pulses of the wheel sensor: GPIO interrupt (debounced in software, exact pulse times) or PCNT
+// peripheral (hardware counter and glitch filter, no CPU cost per pulse)
+#define MAGNETIC_SENSOR_BACKEND_GPIO 0
+#define MAGNETIC_SENSOR_BACKEND_PCNT 1
+#define MAGNETIC_SENSOR_BACKEND MAGNETIC_SENSOR_BACKEND_GPIO
+#define MAGNETIC_PCNT_GLITCH_FILTER_NS 12'000  // Max 1023 APB cycles (~12.7us)
+#define MAGNETIC_PCNT_HIGH_LIMIT 10'000        // Hardware counter limit, accumulated in software
+#define MAGNETIC_DEBOUNCE_PERCENT 50           // Debounce window, in percent of the last period between pulses
+#define MAGNETIC_DEBOUNCE_MIN_US 2'000         // Shortest debounce window, i.e. max 500 pulses/s
+#define MAGNETIC_DEBOUNCE_MAX_US 150'000       // Longest debounce window, at low speed
+#define MAGNETIC_MAX_SPEED 150.0f              // km/h, more pulses than possible at this speed are rejected
+
+// ===== Fusion =====
+// Complementary filter combining the wheel sensor (low latency) with the GPS (long-run accuracy), in fused mode
+#define FUSION_LOOP_DELAY_MS 100             // Wheel pulses are consumed at this rate in fused mode
+#define FUSION_MIN_STEP 0.6f                 // m, distance is reported by steps, corrections are carried
+#define FUSION_DISTANCE_GAIN 0.05f           // Share of the GPS/fused distance error corrected at each fix
+#define FUSION_GPS_TIMEOUT_US 2'000'000      // Without fix for longer: GPS lost, wheel sensor only
+#define FUSION_WHEEL_TIMEOUT_US 3'000'000    // Without pulse for longer: wheel stopped
+#define FUSION_SLIP_MIN_SPEED 5.0f           // km/h, below: no slip detection, GPS speed is too noisy
+#define FUSION_SLIP_THRESHOLD 0.2f           // Relative difference of wheel and GPS speeds considered as slip
+#define FUSION_SLIP_GAIN 0.2f                // Low-pass gain of the slip estimate
+#define FUSION_SCALE_WINDOW_DISTANCE 200.0f  // m of GPS distance per tire circumference estimation
+#define FUSION_SCALE_MIN 0.9f                // Minimal circumference correction, outside: window rejected
+#define FUSION_SCALE_MAX 1.1f                // Maximal circumference correction, outside: window rejected
+#define FUSION_SCALE_GAIN 0.2f               // Low-pass gain of the circumference correction
+
+// ===== Calibration =====
+// Wheel size calibration against the GPS distance, over straight segments with a good fix
+#define CALIBRATION_SEGMENT_DISTANCE 200.0f        // m of GPS distance per circumference sample
+#define CALIBRATION_MAX_HDOP 2.0f                  // Fixes with a larger HDOP drop the segment
+#define CALIBRATION_MAX_HEADING_CHANGE 10.0f       // deg from the start of the segment, more: not straight
+#define CALIBRATION_MIN_SPEED 10.0f                // km/h, below: the course is unreliable, segment dropped
+#define CALIBRATION_MAX_FIX_INTERVAL_US 2'000'000  // Without fix for longer: segment dropped
+#define CALIBRATION_MIN_WHEEL_SIZE 1000            // mm, samples outside the limits are rejected
+#define CALIBRATION_MAX_WHEEL_SIZE 3000            // mm
+#define CALIBRATION_MIN_SEGMENTS 3                 // Segments needed before a circumference is suggested
+#define CALIBRATION_CONFIDENCE_Z 1.96f             // 95% confidence interval of the mean
 
 // ===== Temperature =====
 #define TEMPERATURE_LOOP_DELAY_MS 10000
@@ -69,17 +136,38 @@
 
 // ===== Storage =====
 #define STORAGE_NAMESPACE "storage"
+#define STORAGE_PROCESS_CORE 0
+#define STORAGE_PROCESS_PRIORITY 1  // Lowest of the processes, flash writes must not delay the sensors
+#define STORAGE_PROCESS_STACK_DEPTH 1024 * 4
+#define STORAGE_NOTIFY_SAVE_BIT (1 << 0)      // Task notification bit: save as soon as STATE_MIN_SAVE_DELAY_US allows
+#define STORAGE_NOTIFY_MODIFIED_BIT (1 << 1)  // Task notification bit: setting modified, save after a debounce delay
+
+// ===== Journal =====
+#define JOURNAL_PARTITION_NAME "journal"
+#define JOURNAL_PARTITION_SUBTYPE 0x40  // Custom data subtype, as in partitions.csv
+#define JOURNAL_PERIOD_US 1'000'000     // Distance appended to the journal every second
+#define JOURNAL_READ_RECORDS 16         // Records read at once when scanning the journal
 
 // ===== State =====
-#define STATE_DISTANCE_EPSILON 0.5f  // Comparison with epsilon good enough for our use case
 #define STATE_SPEED_EPSILON 0.5f
 #define STATE_RIDING_SPEED 15.0f
 #define STATE_SEMAPHORE_TIMEOUT pdMS_TO_TICKS(50)
+#define STATE_SNAPSHOT_MAX_RETRIES 8   // Lock-free snapshot attempts before taking the mutex
+#define STATE_MIRROR_MAGIC 0x4F524D31  // "ORM1", RTC memory mirror written
+#define STATE_RECORD_KEY "state"       // NVS entry of the saveable values
+#define STATE_CORRUPTED_KEY "stateBad"  // Copy of a corrupted record, kept for a manual recovery
+#define STATE_RECORD_VERSION 1         // To increment when fields are appended to the record
+#define STATE_RECORD_MAX_SIZE 128      // Bytes, larger records (from a future version) are ignored
 #define STATE_MAX_VALID_SPEED 150.0f
 #define STATE_MIN_SAVE_DELAY_US 10'000'000
 #define STATE_DEFAULT_WHEEL_SIZE 2000
+#define STATE_DEFAULT_MAGNETS_PER_WHEEL 1
+#define STATE_MAX_MAGNETS_PER_WHEEL 8
 #define STATE_DEFAULT_BRIGHTNESS 100
-#define STATE_MAX_OBSERVERS 2
+#define STATE_MAX_SUBSCRIBERS 8
+#define STATE_NOTIFY_MODE_BIT (1 << 0)        // Task notification bit: distance mode changed
+#define STATE_NOTIFY_WHEEL_SIZE_BIT (1 << 1)  // Task notification bit: wheel size changed
+#define STATE_NOTIFY_PULSE_BIT (1 << 2)       // Task notification bit: wheel sensor pulse (from the interrupt)
 #define STATE_SAVE_LOOP_DELAY_US 300'000'000  // 3min
 #define STATE_DEBOUNCE_DELAY_US 5'000'000     // 5s
 
@@ -0,0 +1,357 @@
+#pragma once
+
+#include <M5Unified.h>
+#include <stdint.h>
+
+#include "constants.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+
+/**
+ * Complementary filter fusing the wheel sensor with the GPS, for the fused distance mode. The wheel pulses give the
+ * distance and speed with a low latency, the GPS corrects them on the long run:
+ * - Tire circumference: the wheel distance is scaled by a correction estimated from the GPS distance over windows of
+ *   FUSION_SCALE_WINDOW_DISTANCE, so that a wrong wheel size setting is compensated.
+ * - Drift: at each fix, a share of the difference between the GPS distance and the fused distance is applied.
+ * - Slip: when the wheel speed differs too much from the GPS speed (wheel spin or lock), the GPS speed is integrated
+ *   instead of the wheel pulses until both agree again.
+ * Without GPS, the wheel sensor is used alone with the last estimated correction.
+ *
+ * Each update only takes a few floating point operations, without allocation. Updates come from the magnetic and the
+ * GPS processes, the filter is protected by its own mutex.
+ */
+class DistanceFusion {
+    SemaphoreHandle_t mutex;
+
+    // Wheel sensor
+    uint64_t lastPulseTime{0};  // us
+    float wheelSpeed{0.0f};     // km/h, scaled
+    float scale{1.0f};          // Correction of the wheel size
+
+    // GPS
+    uint64_t lastFixTime{0};  // us
+    float gpsSpeed{0.0f};     // km/h
+    bool slipping{false};
+    float slip{0.0f};  // Relative difference between the wheel and GPS speeds
+
+    // Distances since the GPS reference, to compute the correction
+    float gpsDistance{0.0f};
+    float fusedDistance{0.0f};
+
+    // Distances of the current circumference estimation window
+    float windowWheelDistance{0.0f};  // Not scaled
+    float windowGpsDistance{0.0f};
+
+    // Distance not yet reported, may be negative after a correction
+    float pendingDistance{0.0f};
+
+    /** Whether the GPS is available at a time, which may be before the last fix (e.g. time of a wheel pulse). */
+    bool isGpsAvailable(uint64_t now) const {
+        return lastFixTime != 0 && (now <= lastFixTime || now - lastFixTime < FUSION_GPS_TIMEOUT_US);
+    }
+
+    /** Add a distance to the fused distance, and return what must be reported. */
+    float report(float distance) {
+        fusedDistance += distance;
+        pendingDistance += distance;
+        if (pendingDistance < FUSION_MIN_STEP) {
+            return 0.0f;
+        }
+        distance = pendingDistance;
+        pendingDistance = 0.0f;
+        return distance;
+    }
+
+    /** Update the circumference correction at the end of a window. */
+    void updateScale() {
+        if (windowGpsDistance < FUSION_SCALE_WINDOW_DISTANCE) {
+            return;
+        }
+
+        float ratio = windowWheelDistance > 0.0f ? windowGpsDistance / windowWheelDistance : 0.0f;
+        if (ratio >= FUSION_SCALE_MIN && ratio <= FUSION_SCALE_MAX) {
+            scale += FUSION_SCALE_GAIN * (ratio - scale);
+            M5_LOGD("Fusion: wheel size correction %f (window %f)", scale, ratio);
+        }
+        windowWheelDistance = windowGpsDistance = 0.0f;
+    }
+
+   public:
+    DistanceFusion() {
+        mutex = xSemaphoreCreateMutex();
+        if (mutex == NULL) {
+            M5_LOGE("Failed to create fusion mutex");
+            abort();
+        }
+    }
+
+    /** Restart the filter, keeping the circumference correction. */
+    void reset() {
+        if (xSemaphoreTake(mutex, STATE_SEMAPHORE_TIMEOUT)) {
+            lastPulseTime = lastFixTime = 0;
+            wheelSpeed = gpsSpeed = slip = 0.0f;
+            slipping = false;
+            gpsDistance = fusedDistance = pendingDistance = 0.0f;
+            windowWheelDistance = windowGpsDistance = 0.0f;
+            xSemaphoreGive(mutex);
+        }
+    }
+
+    /**
+     * Update with new wheel sensor pulses.
+     * @param pulses Pulses since the last update.
+     * @param pulseTime Time of the last pulse in us.
+     * @param pulseDistance Distance between two pulses from the wheel size setting, in mm.
+     * @return Distance to add in meters, or 0.
+     */
+    float updateWheel(uint32_t pulses, uint64_t pulseTime, float pulseDistance) {
+        float distance{0.0f};
+        if (pulses == 0 || !xSemaphoreTake(mutex, STATE_SEMAPHORE_TIMEOUT)) {
+            return distance;
+        }
+
+        float wheelDistance = pulses * pulseDistance / 1000.0f;
+        uint64_t interval = pulseTime - lastPulseTime;
+        bool isMoving = lastPulseTime != 0 && interval < FUSION_WHEEL_TIMEOUT_US;
+        wheelSpeed = isMoving ? wheelDistance * scale / interval * 3.6e6f : 0.0f;
+
+        if (slipping && isMoving && isGpsAvailable(pulseTime)) {
+            // The wheel does not follow the ground, use the GPS speed since the last pulse
+            distance = gpsSpeed / 3.6f * interval / 1e6f;
+        } else {
+            distance = wheelDistance * scale;
+            if (isGpsAvailable(pulseTime)) {
+                windowWheelDistance += wheelDistance;
+            }
+        }
+
+        lastPulseTime = pulseTime;
+        distance = report(distance);
+        xSemaphoreGive(mutex);
+        return distance;
+    }
+
+    /**
+     * Update with a new GPS fix. Fixes without speed (e.g. GGA) still carry a distance, they only skip the slip
+     * detection.
+     * @param distance Distance computed from the GPS since the last update, in meters.
+     * @param hasSpeed Whether the fix has a speed.
+     * @param speed GPS speed in km/h, if any.
+     * @param now Current time in us.
+     * @return Distance to add in meters, or 0.
+     */
+    float updateGps(float distance, bool hasSpeed, float speed, uint64_t now) {
+        float correction{0.0f};
+        if (!xSemaphoreTake(mutex, STATE_SEMAPHORE_TIMEOUT)) {
+            return correction;
+        }
+
+        // First fix or GPS lost: restart the reference from the current distance
+        if (!isGpsAvailable(now)) {
+            gpsDistance = fusedDistance = 0.0f;
+            windowWheelDistance = windowGpsDistance = 0.0f;
+            distance = 0.0f;
+        }
+        lastFixTime = now;
+
+        // Slip detection, only when both sensors report a movement. Without speed, the last state is kept.
+        float currentWheelSpeed = now - lastPulseTime < FUSION_WHEEL_TIMEOUT_US ? wheelSpeed : 0.0f;
+        if (hasSpeed) {
+            gpsSpeed = speed;
+            if (speed >= FUSION_SLIP_MIN_SPEED && currentWheelSpeed > 0.0f) {
+                float currentSlip = (currentWheelSpeed - speed) / speed;
+                slip += FUSION_SLIP_GAIN * (currentSlip - slip);
+                slipping = currentSlip > FUSION_SLIP_THRESHOLD || currentSlip < -FUSION_SLIP_THRESHOLD;
+            } else {
+                slip = 0.0f;
+                slipping = false;
+            }
+        }
+
+        // Circumference estimation, windows with slip are not representative
+        if (slipping) {
+            windowWheelDistance = windowGpsDistance = 0.0f;
+        } else {
+            windowGpsDistance += distance;
+            updateScale();
+        }
+
+        // Pull the fused distance towards the GPS distance
+        gpsDistance += distance;
+        correction = report(FUSION_DISTANCE_GAIN * (gpsDistance - fusedDistance));
+        xSemaphoreGive(mutex);
+        return correction;
+    }
+
+    /**
+     * Fused speed: from the wheel sensor, or from the GPS while the wheel slips or when no pulse is received.
+     * @param now Current time in us.
+     * @return Speed in km/h.
+     */
+    float getSpeed(uint64_t now) {
+        float speed{0.0f};
+        if (xSemaphoreTake(mutex, STATE_SEMAPHORE_TIMEOUT)) {
+            bool isWheelMoving = lastPulseTime != 0 && now - lastPulseTime < FUSION_WHEEL_TIMEOUT_US;
+            if (isGpsAvailable(now) && (slipping || !isWheelMoving)) {
+                speed = gpsSpeed;
+            } else if (isWheelMoving) {
+                speed = wheelSpeed;
+            }
+            xSemaphoreGive(mutex);
+        }
+        return speed;
+    }
+
+    /** Estimated correction of the wheel size (ratio of the real distance to the wheel size setting). */
+    float getScale() {
+        float localCopy{1.0f};
+        if (xSemaphoreTake(mutex, STATE_SEMAPHORE_TIMEOUT)) {
+            localCopy = scale;
+            xSemaphoreGive(mutex);
+        }
+        return localCopy;
+    }
+
+    /** Estimated slip of the wheel (relative difference between the wheel and GPS speeds). */
+    float getSlip() {
+        float localCopy{0.0f};
+        if (xSemaphoreTake(mutex, STATE_SEMAPHORE_TIMEOUT)) {
+            localCopy = slip;
+            xSemaphoreGive(mutex);
+        }
+        return localCopy;
+    }
+} distanceFusion;
+
+/**
+ * Coordinator of the hybrid distance mode: the GPS distance is used while there is a fix, the wheel sensor (with the
+ * wheel size calibrated by the fusion filter) covers the periods without fix. Each wheel update covers a time
+ * interval, split in:
+ * - covered: between the first and the last fix of the current GPS coverage, the wheel distance is dropped;
+ * - undecided: after the last fix, the wheel distance is held until the next fix (covered) or the GPS timeout
+ *   (uncovered);
+ * - uncovered: without fix, the wheel distance is reported.
+ * The distance of an update is split proportionally to the time in each part, so the odometer has neither gap nor
+ * double counting when switching between the sensors.
+ */
+class HybridOdometer {
+    SemaphoreHandle_t mutex;
+
+    // Current GPS coverage, from the first to the last fix (us)
+    uint64_t coverageStart{0};
+    uint64_t lastFixTime{0};
+    uint64_t lastWheelTime{0};  // us
+
+    // Wheel distance after the last fix, not reported until the GPS is known to be lost
+    float heldDistance{0.0f};
+    // Distance not yet reported, below FUSION_MIN_STEP
+    float pendingDistance{0.0f};
+
+    /** Whether the GPS is available at a time, which may be just before the last fix (read before a concurrent fix). */
+    bool isGpsAvailable(uint64_t now) const {
+        return lastFixTime != 0 && (now <= lastFixTime || now - lastFixTime < FUSION_GPS_TIMEOUT_US);
+    }
+
+    /** Length of the intersection of two time intervals. */
+    static uint64_t overlap(uint64_t start, uint64_t end, uint64_t otherStart, uint64_t otherEnd) {
+        uint64_t from = start > otherStart ? start : otherStart;
+        uint64_t to = end < otherEnd ? end : otherEnd;
+        return to > from ? to - from : 0;
+    }
+
+   public:
+    HybridOdometer() {
+        mutex = xSemaphoreCreateMutex();
+        if (mutex == NULL) {
+            M5_LOGE("Failed to create hybrid mutex");
+            abort();
+        }
+    }
+
+    /** Restart without GPS coverage, e.g. when switching to hybrid mode. */
+    void reset() {
+        if (xSemaphoreTake(mutex, STATE_SEMAPHORE_TIMEOUT)) {
+            coverageStart = lastFixTime = lastWheelTime = 0;
+            heldDistance = pendingDistance = 0.0f;
+            xSemaphoreGive(mutex);
+        }
+    }
+
+    /**
+     * Update with the wheel distance since the last update.
+     * @param distance Calibrated wheel distance in meters.
+     * @param now Current time in us.
+     * @return Distance to add in meters, or 0.
+     */
+    float updateWheel(float distance, uint64_t now) {
+        float reported{0.0f};
+        if (!xSemaphoreTake(mutex, STATE_SEMAPHORE_TIMEOUT)) {
+            return reported;
+        }
+
+        uint64_t start = lastWheelTime != 0 ? lastWheelTime : now;
+        lastWheelTime = now;
+        if (lastFixTime == 0) {
+            pendingDistance += distance;  // No fix yet
+        } else if (now > start) {
+            // Split the distance of the interval between the parts
+            float perUs = distance / (now - start);
+            float covered = perUs * overlap(start, now, coverageStart, lastFixTime);
+            float undecided = perUs * overlap(start, now, lastFixTime, now);
+            heldDistance += undecided;
+            pendingDistance += distance - covered - undecided;
+        } else {
+            heldDistance += distance;  // Unknown interval, decided with the next fix
+        }
+
+        // GPS lost: the held distance was not covered
+        if (!isGpsAvailable(now)) {
+            pendingDistance += heldDistance;
+            heldDistance = 0.0f;
+        }
+
+        if (pendingDistance >= FUSION_MIN_STEP) {
+            reported = pendingDistance;
+            pendingDistance = 0.0f;
+        }
+        xSemaphoreGive(mutex);
+        return reported;
+    }
+
+    /**
+     * Update with a new GPS fix.
+     * @param now Current time in us.
+     * @return Whether the GPS distance continues the current coverage. If not, the GPS distance must restart from
+     * this fix: the time since the last coverage is counted by the wheel sensor.
+     */
+    bool updateGps(uint64_t now) {
+        bool isContinued{true};
+        if (xSemaphoreTake(mutex, STATE_SEMAPHORE_TIMEOUT)) {
+            if (isGpsAvailable(now)) {
+                heldDistance = 0.0f;  // Covered by the GPS
+            } else {
+                // Fix back after a loss: what was held is reported with the next wheel update
+                pendingDistance += heldDistance;
+                heldDistance = 0.0f;
+                coverageStart = now;
+                isContinued = false;
+            }
+            lastFixTime = now;
+            xSemaphoreGive(mutex);
+        }
+        return isContinued;
+    }
+
+    /**
+     * Whether the GPS covers the distance, i.e. the last fix is recent.
+     * @param now Current time in us.
+     */
+    bool isCovered(uint64_t now) {
+        bool localCopy{false};
+        if (xSemaphoreTake(mutex, STATE_SEMAPHORE_TIMEOUT)) {
+            localCopy = isGpsAvailable(now);
+            xSemaphoreGive(mutex);
+        }
+        return localCopy;
+    }
+} hybridOdometer;
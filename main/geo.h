@@ -0,0 +1,89 @@
+#pragma once
+
+#include <math.h>
+#include <stdint.h>
+
+#define GEO_NANODEGREES_PER_DEGREE 1'000'000'000LL
+#define GEO_EARTH_RADIUS 6371009.0f  // m, mean radius, same as TinyGPS++
+#define GEO_RADIANS_PER_NANODEGREE static_cast<float>(M_PI / 180.0 / 1e9)
+#define GEO_FAST_MAX_DISTANCE 1000.0f  // m, longer segments use the great-circle distance
+#define GEO_COSINE_REFRESH_NANODEGREES 5'000'000LL  // 0.005°, ~550 m north or south
+
+/** Position in fixed point, in nanodegrees (billionths of degrees) as received from the GPS. */
+struct Position {
+    int64_t latitude;
+    int64_t longitude;
+};
+
+/** Convert degrees split in integer part and billionths to nanodegrees. */
+int64_t toNanodegrees(uint16_t degrees, uint32_t billionths, bool negative) {
+    int64_t value = degrees * GEO_NANODEGREES_PER_DEGREE + billionths;
+    return negative ? -value : value;
+}
+
+/** Convert decimal degrees to nanodegrees. */
+int64_t toNanodegrees(double degrees) { return llround(degrees * GEO_NANODEGREES_PER_DEGREE); }
+
+/** Difference of longitudes in nanodegrees, wrapped around the antimeridian to [-180, 180] degrees. */
+int64_t longitudeDifference(int64_t from, int64_t to) {
+    int64_t difference = to - from;
+    if (difference > 180 * GEO_NANODEGREES_PER_DEGREE) {
+        difference -= 360 * GEO_NANODEGREES_PER_DEGREE;
+    } else if (difference < -180 * GEO_NANODEGREES_PER_DEGREE) {
+        difference += 360 * GEO_NANODEGREES_PER_DEGREE;
+    }
+    return difference;
+}
+
+/**
+ * Great-circle distance between two positions in meters, using the haversine formula. The differences of coordinates
+ * are computed exactly on integers before the conversion to radians, so single precision is enough even for
+ * distances of a few centimeters: no double precision operation (emulated in software on the ESP32) is needed.
+ */
+float distanceBetween(const Position& from, const Position& to) {
+    float deltaLatitude = (to.latitude - from.latitude) * GEO_RADIANS_PER_NANODEGREE;
+    float deltaLongitude = longitudeDifference(from.longitude, to.longitude) * GEO_RADIANS_PER_NANODEGREE;
+    float latitudeFrom = from.latitude * GEO_RADIANS_PER_NANODEGREE;
+    float latitudeTo = to.latitude * GEO_RADIANS_PER_NANODEGREE;
+
+    float sinLatitude = sinf(deltaLatitude / 2);
+    float sinLongitude = sinf(deltaLongitude / 2);
+    float a = sinLatitude * sinLatitude + cosf(latitudeFrom) * cosf(latitudeTo) * sinLongitude * sinLongitude;
+    return 2 * GEO_EARTH_RADIUS * asinf(sqrtf(a < 1.0f ? a : 1.0f));
+}
+
+/**
+ * Distance computation for successive GPS fixes. Short segments use a local equirectangular projection, with the
+ * cosine of the latitude cached and only refreshed when the latitude drifts more than
+ * GEO_COSINE_REFRESH_NANODEGREES away from it: a few multiplications and a square root per fix instead of the
+ * trigonometric functions of the great-circle formula. Long segments (e.g. after a loss of signal) fall back to the
+ * great-circle distance.
+ *
+ * Error of the fast path relative to the great-circle distance, for latitudes up to ±70° and segments up to
+ * GEO_FAST_MAX_DISTANCE: below 0.05%, i.e. 0.5 mm for a 1 m segment at 10 Hz. It is dominated by the drift of the
+ * latitude since the cached cosine (tan(latitude) * drift in radians), the projection itself is exact to better than
+ * 0.001% at this scale.
+ */
+class DistanceEngine {
+    int64_t cachedLatitude{0};
+    float cosLatitude{1.0f};
+    bool isCached{false};
+
+   public:
+    /** Distance between two positions in meters. */
+    float distance(const Position& from, const Position& to) {
+        int64_t latitudeDrift = to.latitude - cachedLatitude;
+        if (!isCached || latitudeDrift > GEO_COSINE_REFRESH_NANODEGREES ||
+            latitudeDrift < -GEO_COSINE_REFRESH_NANODEGREES) {
+            cachedLatitude = to.latitude;
+            cosLatitude = cosf(to.latitude * GEO_RADIANS_PER_NANODEGREE);
+            isCached = true;
+        }
+
+        float x = longitudeDifference(from.longitude, to.longitude) * GEO_RADIANS_PER_NANODEGREE * cosLatitude;
+        float y = (to.latitude - from.latitude) * GEO_RADIANS_PER_NANODEGREE;
+        float distance = GEO_EARTH_RADIUS * sqrtf(x * x + y * y);
+
+        return distance <= GEO_FAST_MAX_DISTANCE ? distance : distanceBetween(from, to);
+    }
+};
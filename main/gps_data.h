@@ -0,0 +1,34 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "geo.h"
+
+/** Values received from the GPS, independently of the protocol. Each value is only set if it has been updated. */
+struct GpsData {
+    bool hasTime{false};
+    uint8_t hour{0};
+    uint8_t minute{0};
+    uint8_t second{0};
+
+    bool hasSatellites{false};
+    uint8_t satellites{0};
+
+    bool hasAltitude{false};
+    float altitude{0.0f};  // m
+
+    bool hasLocation{false};
+    Position position{0, 0};
+
+    bool hasTimestamp{false};
+    uint32_t timestamp{0};  // ms, time of the fix given by the receiver
+
+    bool hasSpeed{false};
+    float speed{0.0f};  // km/h
+
+    bool hasCourse{false};
+    float course{0.0f};  // deg
+
+    bool hasHdop{false};
+    float hdop{0.0f};  // Horizontal dilution of precision, lower is better
+};
@@ -0,0 +1,126 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "constants.h"
+#include "geo.h"
+#include "gps_data.h"
+
+/**
+ * Distance traveled computed from successive GPS fixes, with the method selected by GPS_DISTANCE_METHOD:
+ * - Position (default): sum of the distances between positions. Position jitter adds phantom distance at low speed,
+ *   and corners are cut between fixes.
+ * - Doppler: integration of the Doppler speed of the receiver over the fix timestamps (trapezoidal rule).
+ * - Blended: Doppler distance blended with the distance between positions above GPS_DISTANCE_BLEND_MIN_SPEED.
+ */
+class GpsOdometer {
+    DistanceEngine engine;
+
+    // Last position used as a reference (position method), or last fix with a speed (Doppler methods)
+    Position lastPosition{0, 0};
+    uint64_t lastFixTime{0};    // us, local time
+    uint32_t lastTimestamp{0};  // ms, receiver time
+    float lastSpeed{0.0f};      // km/h
+    bool hasLastSpeed{false};
+
+    // Distance not yet reported, below GPS_UPDATE_MIN_DISTANCE
+    float pendingDistance{0.0f};
+
+    /** Distance from the position reference, which only moves once the distance is large enough. */
+    float updatePosition(const GpsData& data, uint64_t durationSinceLastFix) {
+        // Skip the second sentence of the same fix
+        if (durationSinceLastFix <= GPS_UPDATE_MIN_TIME) {
+            return 0.0f;
+        }
+
+        // Below the minimal distance, the reference is kept so that slow movements over several fixes are counted
+        float distance = engine.distance(lastPosition, data.position);
+        if (distance <= GPS_UPDATE_MIN_DISTANCE) {
+            return 0.0f;
+        }
+
+        lastPosition = data.position;
+        return distance < GPS_UPDATE_MAX_DISTANCE ? distance : 0.0f;
+    }
+
+    /** Distance from the Doppler speed since the last fix, optionally blended with the distance between positions. */
+    float updateDoppler(const GpsData& data) {
+        // Only fixes with a speed and timestamp are used (e.g. RMC but not GGA)
+        if (!data.hasSpeed || !data.hasTimestamp) {
+            return 0.0f;
+        }
+
+        float speed = data.speed < GPS_DOPPLER_MIN_SPEED ? 0.0f : data.speed;
+        uint32_t interval = data.timestamp - lastTimestamp;  // ms
+        if (hasLastSpeed && interval == 0) {
+            return 0.0f;  // Same fix
+        }
+
+        float distance{0.0f};
+        if (hasLastSpeed) {
+            float positionDistance = engine.distance(lastPosition, data.position);
+            if (positionDistance >= GPS_UPDATE_MAX_DISTANCE) {
+                distance = 0.0f;  // Jump of position
+            } else if (interval > GPS_DOPPLER_MAX_INTERVAL_MS) {
+                distance = positionDistance;  // Fixes missing, the speed is unknown in between
+            } else {
+                distance = (lastSpeed + speed) / 2 / 3.6f * interval / 1000.0f;
+                if (GPS_DISTANCE_METHOD == GPS_DISTANCE_BLENDED && speed >= GPS_DISTANCE_BLEND_MIN_SPEED) {
+                    distance =
+                        GPS_DISTANCE_BLEND_WEIGHT * distance + (1 - GPS_DISTANCE_BLEND_WEIGHT) * positionDistance;
+                }
+            }
+        }
+
+        lastPosition = data.position;
+        lastTimestamp = data.timestamp;
+        lastSpeed = speed;
+        hasLastSpeed = true;
+
+        // Report the distance by steps of at least GPS_UPDATE_MIN_DISTANCE
+        pendingDistance += distance;
+        if (pendingDistance < GPS_UPDATE_MIN_DISTANCE) {
+            return 0.0f;
+        }
+        distance = pendingDistance;
+        pendingDistance = 0.0f;
+        return distance;
+    }
+
+   public:
+    /** Restart from the next fix, e.g. when switching to GPS mode. */
+    void reset() {
+        lastFixTime = 0;
+        hasLastSpeed = false;
+        pendingDistance = 0.0f;
+    }
+
+    /**
+     * Update with the values of a new fix.
+     * @param data Values received from the GPS.
+     * @param now Current time in us.
+     * @return Distance traveled since the last update in meters, or 0.
+     */
+    float update(const GpsData& data, uint64_t now) {
+        if (!data.hasLocation) {
+            return 0.0f;
+        }
+
+        // First position or signal lost for too long: restart from the current position
+        uint64_t durationSinceLastFix = now - lastFixTime;
+        if (lastFixTime == 0 || durationSinceLastFix >= GPS_UPDATE_MAX_TIME) {
+            reset();
+            lastPosition = data.position;
+        }
+
+        float distance{0.0f};
+        if (GPS_DISTANCE_METHOD == GPS_DISTANCE_POSITION) {
+            distance = lastFixTime == 0 ? 0.0f : updatePosition(data, durationSinceLastFix);
+        } else {
+            distance = updateDoppler(data);
+        }
+
+        lastFixTime = now;
+        return distance;
+    }
+};
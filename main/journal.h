@@ -0,0 +1,219 @@
+#pragma once
+
+#include <M5Unified.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "constants.h"
+#include "esp_partition.h"
+#include "esp_rom_crc.h"
+
+/** Record of the journal: distance traveled since the previous record, or since the NVS checkpoint. */
+struct JournalRecord {
+    uint32_t sequence;   // Incremented with each record, 0xFFFFFFFF is an erased slot
+    int32_t stageDelta;  // mm
+    int32_t totalDelta;  // mm
+    uint32_t crc;        // CRC32 of the fields above
+};
+static_assert(sizeof(JournalRecord) == 16, "Journal records must not straddle flash write blocks");
+
+/**
+ * Append-only journal of the distance, in a dedicated flash partition. A record is appended every JOURNAL_PERIOD_US by
+ * the storage process, so that a power cut loses about one second of distance instead of the time since the last NVS
+ * save. Records are only written to erased slots, a record torn by a power cut fails its CRC and is skipped.
+ *
+ * The sectors are used as a ring: a sector is erased only when the writing reaches it, so that all the sectors wear
+ * evenly. The NVS checkpoint stores the sequence of the last record it includes: on boot, the newer records are
+ * replayed on top of it. The checkpoint must be saved before the ring reaches the records it doesn't include yet
+ * (`needsCheckpoint`).
+ */
+class DistanceJournal {
+    const esp_partition_t* partition{nullptr};
+    uint32_t sectors{0};
+    uint32_t recordsPerSector{0};
+
+    uint32_t writeSlot{0};           // Next slot to write, over all the sectors
+    uint32_t sequence{0};            // Sequence of the last record
+    uint32_t checkpointSequence{0};  // Sequence of the last record included in the NVS checkpoint
+
+    // Distances up to the last record, in mm
+    int64_t journaledStageDistance{0};
+    int64_t journaledTotalDistance{0};
+
+    static uint32_t crcOf(const JournalRecord& record) {
+        return esp_rom_crc32_le(0, reinterpret_cast<const uint8_t*>(&record), offsetof(JournalRecord, crc));
+    }
+
+    static bool isValid(const JournalRecord& record) {
+        return record.sequence != UINT32_MAX && record.crc == crcOf(record);
+    }
+
+    static bool isErased(const JournalRecord& record) {
+        const uint8_t* bytes = reinterpret_cast<const uint8_t*>(&record);
+        for (size_t i = 0; i < sizeof(JournalRecord); i++) {
+            if (bytes[i] != 0xFF) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    /**
+     * Read all the records of the journal.
+     * @param visit Function called with the slot and the record, for each slot.
+     */
+    template <typename F>
+    void forEachRecord(F visit) {
+        JournalRecord records[JOURNAL_READ_RECORDS];
+        uint32_t slots = sectors * recordsPerSector;
+        for (uint32_t slot = 0; slot < slots; slot += JOURNAL_READ_RECORDS) {
+            uint32_t count = slots - slot < JOURNAL_READ_RECORDS ? slots - slot : JOURNAL_READ_RECORDS;
+            if (esp_partition_read(partition, slot * sizeof(JournalRecord), records, count * sizeof(JournalRecord)) !=
+                ESP_OK) {
+                continue;
+            }
+            for (uint32_t i = 0; i < count; i++) {
+                visit(slot + i, records[i]);
+            }
+        }
+    }
+
+    /** Write one record at the write slot, erasing the sector first when entering it. */
+    bool write(int32_t stageDelta, int32_t totalDelta) {
+        size_t offset = writeSlot * sizeof(JournalRecord);
+        if (writeSlot % recordsPerSector == 0 &&
+            esp_partition_erase_range(partition, offset, partition->erase_size) != ESP_OK) {
+            M5_LOGE("Journal: failed to erase sector %lu", writeSlot / recordsPerSector);
+            return false;
+        }
+
+        JournalRecord record{sequence + 1, stageDelta, totalDelta, 0};
+        record.crc = crcOf(record);
+        esp_err_t err = esp_partition_write(partition, offset, &record, sizeof(JournalRecord));
+        writeSlot = (writeSlot + 1) % (sectors * recordsPerSector);  // Slot consumed even if the write failed
+        if (err != ESP_OK) {
+            M5_LOGE("Journal: write failed %s", esp_err_to_name(err));
+            return false;
+        }
+        sequence = record.sequence;
+        return true;
+    }
+
+   public:
+    /**
+     * Find the journal partition and the position of the next record. Without a journal partition (e.g. flashed with
+     * the previous partition table), the journal is disabled and the distance is only saved to NVS.
+     */
+    void begin() {
+        partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA,
+                                             static_cast<esp_partition_subtype_t>(JOURNAL_PARTITION_SUBTYPE),
+                                             JOURNAL_PARTITION_NAME);
+        if (partition == nullptr || partition->erase_size == 0) {
+            M5_LOGW("Journal: no partition, distance only saved to NVS");
+            partition = nullptr;
+            return;
+        }
+        sectors = partition->size / partition->erase_size;
+        recordsPerSector = partition->erase_size / sizeof(JournalRecord);
+
+        // Newest record
+        bool isFound{false};
+        uint32_t lastSlot{0};
+        forEachRecord([&](uint32_t slot, const JournalRecord& record) {
+            if (isValid(record) && (!isFound || record.sequence > sequence)) {
+                isFound = true;
+                sequence = record.sequence;
+                lastSlot = slot;
+            }
+        });
+
+        // Write after it, skipping the slots torn by a power cut: they can only be written again once erased
+        writeSlot = 0;
+        if (isFound) {
+            writeSlot = lastSlot + 1;
+            JournalRecord record;
+            while (writeSlot % recordsPerSector != 0 &&
+                   esp_partition_read(partition, writeSlot * sizeof(JournalRecord), &record, sizeof(record)) ==
+                       ESP_OK &&
+                   !isErased(record)) {
+                writeSlot++;
+            }
+            writeSlot %= sectors * recordsPerSector;
+        }
+        M5_LOGI("Journal: %lu sectors, last record %lu", sectors, sequence);
+    }
+
+    /**
+     * Sum the records newer than the NVS checkpoint.
+     * @param fromSequence Sequence of the last record included in the checkpoint.
+     * @param stageDelta Stage distance to add to the checkpoint, in mm.
+     * @param totalDelta Total distance to add to the checkpoint, in mm.
+     * @return Number of records replayed.
+     */
+    uint32_t replay(uint32_t fromSequence, int64_t& stageDelta, int64_t& totalDelta) {
+        stageDelta = totalDelta = 0;
+        checkpointSequence = fromSequence;
+        if (partition == nullptr) {
+            return 0;
+        }
+        if (sequence < fromSequence) {
+            sequence = fromSequence;  // Journal erased since the checkpoint: keep the sequences increasing
+        }
+
+        uint32_t count{0};
+        forEachRecord([&](uint32_t, const JournalRecord& record) {
+            if (isValid(record) && record.sequence > fromSequence) {
+                stageDelta += record.stageDelta;
+                totalDelta += record.totalDelta;
+                count++;
+            }
+        });
+        return count;
+    }
+
+    /**
+     * Append the distance traveled since the previous record, if any. Deltas above the range of a record are split.
+     * @param stageDistance Current stage distance in mm.
+     * @param totalDistance Current total distance in mm.
+     */
+    void append(int64_t stageDistance, int64_t totalDistance) {
+        if (partition == nullptr) {
+            return;
+        }
+        int64_t stageDelta = stageDistance - journaledStageDistance;
+        int64_t totalDelta = totalDistance - journaledTotalDistance;
+        while (stageDelta != 0 || totalDelta != 0) {
+            int32_t stage = stageDelta > INT32_MAX ? INT32_MAX : stageDelta < INT32_MIN ? INT32_MIN : stageDelta;
+            int32_t total = totalDelta > INT32_MAX ? INT32_MAX : totalDelta < INT32_MIN ? INT32_MIN : totalDelta;
+            if (!write(stage, total)) {
+                return;  // Retried with the next record
+            }
+            journaledStageDistance += stage;
+            journaledTotalDistance += total;
+            stageDelta -= stage;
+            totalDelta -= total;
+        }
+    }
+
+    /** Sequence of the last record, to store with the NVS checkpoint. */
+    uint32_t getSequence() const { return sequence; }
+
+    /**
+     * Set the saved NVS checkpoint, the next records are relative to it.
+     * @param checkpoint Sequence of the last record included in the checkpoint.
+     * @param stageDistance Stage distance of the checkpoint in mm.
+     * @param totalDistance Total distance of the checkpoint in mm.
+     */
+    void setCheckpoint(uint32_t checkpoint, int64_t stageDistance, int64_t totalDistance) {
+        checkpointSequence = checkpoint;
+        journaledStageDistance = stageDistance;
+        journaledTotalDistance = totalDistance;
+    }
+
+    /** Whether the ring is about to erase records not included in the NVS checkpoint yet. */
+    bool needsCheckpoint() const {
+        return partition != nullptr && sequence - checkpointSequence >= (sectors - 1) * recordsPerSector;
+    }
+};
+
+DistanceJournal distanceJournal;
@@ -3,10 +3,12 @@
 #include "constants.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#include "journal.h"
 #include "process_buttons.h"
 #include "process_display.h"
 #include "process_gps.h"
 #include "process_magnetic.h"
+#include "process_storage.h"
 #include "process_temperature.h"
 #include "state.h"
 #include "storage.h"
@@ -21,13 +23,20 @@ extern "C" void app_main() {
     M5.Log.setLogLevel(m5::log_target_serial, LOG_LEVEL);
 
     initStorage();
+    distanceJournal.begin();
     sharedState.loadData();
-    storageProcess();
+
+    // Start the storage process
+    BaseType_t result = xTaskCreatePinnedToCore(storageProcess, "StorageProcess", STORAGE_PROCESS_STACK_DEPTH, NULL,
+                                                STORAGE_PROCESS_PRIORITY, NULL, STORAGE_PROCESS_CORE);
+    if (result != pdPASS) {
+        M5_LOGE("Failed to create StorageProcess %s", esp_err_to_name(result));
+    }
 
     // Start the display process
     TaskHandle_t displayTaskHandle;
-    BaseType_t result = xTaskCreatePinnedToCore(displayProcess, "DisplayProcess", DISPLAY_PROCESS_STACK_DEPTH, NULL,
-                                                DISPLAY_PROCESS_PRIORITY, &displayTaskHandle, DISPLAY_PROCESS_CORE);
+    result = xTaskCreatePinnedToCore(displayProcess, "DisplayProcess", DISPLAY_PROCESS_STACK_DEPTH, NULL,
+                                     DISPLAY_PROCESS_PRIORITY, &displayTaskHandle, DISPLAY_PROCESS_CORE);
     if (result != pdPASS) {
         M5_LOGE("Failed to create DisplayProcess %s", esp_err_to_name(result));
     }
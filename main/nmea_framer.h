@@ -0,0 +1,175 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "constants.h"
+
+/** Complete NMEA sentence in the ring buffer of the framer. A sentence wrapping around the end of the buffer is split
+ * in two parts, the second part is empty otherwise. */
+struct NmeaSentence {
+    const char* first;
+    size_t firstLength;
+    const char* second;
+    size_t secondLength;
+};
+
+/**
+ * Sentence framer for NMEA data. Received bytes are written directly in a fixed ring buffer, complete sentences
+ * (`$...*hh\r\n`) are found and their checksum is verified before handing them to the parser by pointer, without
+ * copying. Garbage between sentences and sentences with a bad checksum are dropped.
+ * @tparam N Size of the ring buffer, must be a power of 2.
+ */
+template <size_t N>
+class NmeaFramer {
+    static_assert(N > 0 && (N & (N - 1)) == 0, "Ring buffer size must be a power of 2");
+    static constexpr size_t MASK = N - 1;
+
+    enum class ScanState : uint8_t {
+        START,     // Waiting for `$`
+        BODY,      // Between `$` and `*`, computing the checksum
+        CHECKSUM,  // After `*`, waiting for the two hex digits
+        END,       // Waiting for `\r\n`
+    };
+
+    char buffer[N];
+    // Free running indexes, wrapped with MASK when accessing the buffer
+    size_t head{0};  // Write position
+    size_t tail{0};  // Start of the current sentence
+    size_t scan{0};  // Next byte to scan
+
+    ScanState state{ScanState::START};
+    uint8_t parity{0};
+    uint8_t checksum{0};
+    uint8_t checksumDigits{0};
+
+    uint32_t failedChecksumCount{0};
+    uint32_t droppedSentenceCount{0};
+
+    /** Convert an hex digit to its value, or return -1 if not an hex digit. */
+    static int8_t fromHex(char c) {
+        if (c >= '0' && c <= '9') return c - '0';
+        if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+        if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+        return -1;
+    }
+
+    /** Drop the current sentence and look for the next start. */
+    void resync() {
+        tail = scan;
+        state = ScanState::START;
+    }
+
+   public:
+    /**
+     * Get the contiguous free space of the ring buffer, to write received bytes into.
+     * @param length Set to the number of bytes that can be written.
+     * @return Pointer to the free space.
+     */
+    char* writeBuffer(size_t& length) {
+        size_t free = N - (head - tail);
+        size_t untilEnd = N - (head & MASK);
+        length = free < untilEnd ? free : untilEnd;
+        return &buffer[head & MASK];
+    }
+
+    /** Mark bytes written with `writeBuffer` as received. */
+    void commit(size_t length) { head += length; }
+
+    /**
+     * Find the next complete sentence with a valid checksum. The sentence stays valid until the next `commit`.
+     * @param sentence Set to the parts of the sentence in the ring buffer.
+     * @return Whether a sentence was found.
+     */
+    bool next(NmeaSentence& sentence) {
+        while (scan != head) {
+            char c = buffer[scan & MASK];
+            scan++;
+
+            // Restart on `$`, wherever we are in the current sentence
+            if (c == '$') {
+                if (state != ScanState::START) {
+                    droppedSentenceCount++;
+                }
+                tail = scan - 1;
+                state = ScanState::BODY;
+                parity = 0;
+                checksum = 0;
+                checksumDigits = 0;
+                continue;
+            }
+
+            switch (state) {
+                case ScanState::START:
+                    tail = scan;  // Skip garbage before the sentence
+                    break;
+
+                case ScanState::BODY:
+                    if (c == '*') {
+                        state = ScanState::CHECKSUM;
+                    } else if (c == '\r' || c == '\n' || scan - tail > GPS_NMEA_MAX_SENTENCE_LENGTH) {
+                        droppedSentenceCount++;
+                        resync();
+                    } else {
+                        parity ^= c;
+                    }
+                    break;
+
+                case ScanState::CHECKSUM: {
+                    int8_t digit = fromHex(c);
+                    if (digit < 0) {
+                        droppedSentenceCount++;
+                        resync();
+                        break;
+                    }
+                    checksum = (checksum << 4) | digit;
+                    if (++checksumDigits == 2) {
+                        state = ScanState::END;
+                    }
+                    break;
+                }
+
+                case ScanState::END:
+                    // Wait for the line feed, the carriage return is optional
+                    if (c == '\r') {
+                        break;
+                    }
+                    if (c != '\n') {
+                        droppedSentenceCount++;
+                        resync();
+                        break;
+                    }
+
+                    if (checksum != parity) {
+                        failedChecksumCount++;
+                        resync();
+                        break;
+                    }
+
+                    // Complete sentence from tail to scan
+                    size_t start = tail & MASK;
+                    size_t length = scan - tail;
+                    sentence.first = &buffer[start];
+                    if (start + length <= N) {
+                        sentence.firstLength = length;
+                        sentence.second = nullptr;
+                        sentence.secondLength = 0;
+                    } else {
+                        sentence.firstLength = N - start;
+                        sentence.second = &buffer[0];
+                        sentence.secondLength = length - sentence.firstLength;
+                    }
+                    resync();
+                    return true;
+            }
+        }
+
+        return false;
+    }
+
+    /** Number of sentences dropped because of a bad checksum. */
+    uint32_t failedChecksum() const { return failedChecksumCount; }
+
+    /** Number of sentences dropped because they were truncated or malformed. */
+    uint32_t droppedSentences() const { return droppedSentenceCount; }
+};
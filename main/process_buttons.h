@@ -9,17 +9,17 @@
 #include "state.h"
 
 /**
- * Increment the waypoint distance by BUTTON_INCREMENT_DISTANCE_M.
+ * Increment the waypoint distance by BUTTON_INCREMENT_DISTANCE_MM.
  */
 static void incrementWaypointDistance(void *arg, void *usr_data) {
-    sharedState.addToStageDistance(BUTTON_INCREMENT_DISTANCE_M);
+    sharedState.addToStageDistance(BUTTON_INCREMENT_DISTANCE_MM);
 }
 
 /**
- * Decrement the waypoint distance by BUTTON_DECREMENT_DISTANCE_M.
+ * Decrement the waypoint distance by BUTTON_DECREMENT_DISTANCE_MM.
  */
 static void decrementWaypointDistance(void *arg, void *usr_data) {
-    sharedState.addToStageDistance(BUTTON_DECREMENT_DISTANCE_M);
+    sharedState.addToStageDistance(BUTTON_DECREMENT_DISTANCE_MM);
 }
 
 /**
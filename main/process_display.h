@@ -9,6 +9,7 @@
 #include <string>
 #include <vector>
 
+#include "calibration.h"
 #include "constants.h"
 #include "fonts/FreeSans40pt7b.h"
 #include "fonts/FreeSans48pt7b.h"
@@ -36,6 +37,7 @@ enum StateUiMainScreen : uint8_t {
 enum StateUiParameterScreen {
     PARAMETERS_PAGE_1,
     PARAMETERS_PAGE_2,
+    PARAMETERS_PAGE_3,
 };
 
 // Sizes for the distance display
@@ -54,6 +56,16 @@ M5GFX display;
 SwipeManager swipe;
 M5Canvas mainSprite;
 
+// Fields of the state shown on each main page: the page is only redrawn when one of them changed
+constexpr uint32_t MAIN_PAGE_1_FIELDS =
+    STATE_FIELD_STAGE_DISTANCE | STATE_FIELD_CAP | STATE_FIELD_SPEED | STATE_FIELD_NB_SATELLITES | STATE_FIELD_TIME;
+constexpr uint32_t MAIN_PAGE_2_FIELDS = STATE_FIELD_STAGE_DISTANCE | STATE_FIELD_CAP | STATE_FIELD_NB_SATELLITES;
+
+// Last main page pushed to the display, and generation of the state it shows
+bool isMainScreenDrawn{false};
+StateUiMainScreen drawnMainScreen{MAIN_PAGE_1};
+uint32_t drawnGeneration{0};
+
 /** Handle swipe gestures and change the UI state accordingly. */
 void swipeHandler(SwipeDirection direction) {
     if (stateUiScreen == MAIN && direction == SwipeDirection::UP) {
@@ -63,9 +75,10 @@ void swipeHandler(SwipeDirection direction) {
     } else if (stateUiScreen == MAIN && (direction == SwipeDirection::LEFT || direction == SwipeDirection::RIGHT)) {
         stateUiMainScreen = stateUiMainScreen == MAIN_PAGE_1 ? MAIN_PAGE_2 : MAIN_PAGE_1;
         sharedState.setPage(stateUiMainScreen);
-    } else if (stateUiScreen == PARAMETERS &&
-               (direction == SwipeDirection::RIGHT || direction == SwipeDirection::LEFT)) {
-        stateUiParametersScreen = stateUiParametersScreen == PARAMETERS_PAGE_1 ? PARAMETERS_PAGE_2 : PARAMETERS_PAGE_1;
+    } else if (stateUiScreen == PARAMETERS && direction == SwipeDirection::LEFT) {
+        stateUiParametersScreen = static_cast<StateUiParameterScreen>((stateUiParametersScreen + 1) % 3);
+    } else if (stateUiScreen == PARAMETERS && direction == SwipeDirection::RIGHT) {
+        stateUiParametersScreen = static_cast<StateUiParameterScreen>((stateUiParametersScreen + 2) % 3);
     }
 }
 
@@ -103,15 +116,18 @@ void drawDistanceBig(uint8_t distHundreds, uint8_t distTensUnits, uint8_t distDe
     mainSprite.drawString(formatString("%02d", distDecimal).c_str(), 308, 20);
 }
 
-/** Draw the distance on the screen */
-void drawDistance(UiDistanceSize size) {
-    // Get and convert distance for printing
-    float stageDistance = std::round(sharedState.getStageDistance() / 10) / 100;       // 123456.789 -> 123.45
-    uint8_t distInt = static_cast<uint8_t>(stageDistance);                             // 123
-    uint8_t distHundreds = distInt / 100;                                              // 1
-    uint8_t distTensUnits = distInt % 100;                                             // 23
-    float distDecimal = stageDistance - distInt;                                       // 0.45
-    uint8_t distDecimal2places = static_cast<uint8_t>(std::round(distDecimal * 100));  // 45
+/**
+ * Draw the distance on the screen
+ * @param size Size of the distance display.
+ * @param distance Stage distance in mm.
+ */
+void drawDistance(UiDistanceSize size, int64_t distance) {
+    // Convert distance for printing, in integers
+    int64_t stageDistance = (distance + 5'000) / 10'000;                     // 123456789 mm -> 12346 (123.46 km)
+    uint8_t distInt = static_cast<uint8_t>(stageDistance / 100);             // 123
+    uint8_t distHundreds = distInt / 100;                                    // 1
+    uint8_t distTensUnits = distInt % 100;                                   // 23
+    uint8_t distDecimal2places = static_cast<uint8_t>(stageDistance % 100);  // 46
 
     // Select the drawing function based on the size
     void (*drawDistanceFn)(uint8_t, uint8_t, uint8_t) =
@@ -120,11 +136,11 @@ void drawDistance(UiDistanceSize size) {
 }
 
 /** Draw the main screen with all the information */
-void drawCompleteScreen(const M5Canvas& sprite) {
-    drawDistance(DISTANCE_SIZE_SMALL);
+void drawCompleteScreen(const M5Canvas& sprite, const StateSnapshot& state) {
+    drawDistance(DISTANCE_SIZE_SMALL, state.stageDistance);
 
     // Draw cap
-    uint16_t cap = sharedState.getCap();
+    uint16_t cap = state.cap;
     mainSprite.setTextDatum(top_right);
     mainSprite.setFont(&FreeSans40pt7b);
     mainSprite.drawNumber(cap, 155, 155);
@@ -135,13 +151,13 @@ void drawCompleteScreen(const M5Canvas& sprite) {
     // Draw speed
     mainSprite.setTextDatum(top_right);
     mainSprite.setFont(&FreeSans40pt7b);
-    float speed = sharedState.getSpeed();
+    float speed = state.speed;
     mainSprite.drawNumber(speed, 310, 126);
     mainSprite.setFont(&DejaVu12);
     mainSprite.drawString("km/h", 306, 190);
 
     // Draw satellites
-    u_int8_t satellites = sharedState.getNbSatellites();
+    u_int8_t satellites = state.nbSatellites;
     mainSprite.setTextDatum(top_right);
     mainSprite.setTextColor(DARKGREY);
     mainSprite.setFont(&FreeSans9pt7b);
@@ -150,7 +166,7 @@ void drawCompleteScreen(const M5Canvas& sprite) {
     mainSprite.setTextDatum(top_left);
 
     // Draw time
-    Time time = sharedState.getTime();
+    Time time = state.time;
     mainSprite.setTextDatum(bottom_right);
     mainSprite.setTextColor(DARKGREY);
     mainSprite.setFont(&FreeSans9pt7b);
@@ -160,11 +176,11 @@ void drawCompleteScreen(const M5Canvas& sprite) {
 }
 
 /** Draw minimal screen with only the distance and cap */
-void drawMinimalScreen(const M5Canvas& sprite) {
-    drawDistance(DISTANCE_SIZE_LARGE);
+void drawMinimalScreen(const M5Canvas& sprite, const StateSnapshot& state) {
+    drawDistance(DISTANCE_SIZE_LARGE, state.stageDistance);
 
     // Draw cap
-    uint16_t cap = sharedState.getCap();
+    uint16_t cap = state.cap;
     mainSprite.setTextDatum(top_right);
     mainSprite.setFont(&FreeSans48pt7b);
     mainSprite.drawNumber(cap, 200, 140);
@@ -175,6 +191,19 @@ void drawMinimalScreen(const M5Canvas& sprite) {
 
 /** Draw the main screen */
 void drawMainScreen() {
+    // Skip the frame if nothing shown on the page changed, e.g. while stopped
+    uint32_t fields = stateUiMainScreen == MAIN_PAGE_1 ? MAIN_PAGE_1_FIELDS : MAIN_PAGE_2_FIELDS;
+    if (isMainScreenDrawn && drawnMainScreen == stateUiMainScreen &&
+        (sharedState.changedSince(drawnGeneration) & fields) == 0) {
+        return;
+    }
+
+    // All the values of the frame at once, without locking the writers
+    StateSnapshot state = sharedState.snapshot();
+    isMainScreenDrawn = true;
+    drawnMainScreen = stateUiMainScreen;
+    drawnGeneration = state.generation;
+
     display.beginTransaction();
     mainSprite.fillSprite(WHITE);
     mainSprite.setTextColor(BLACK);
@@ -187,13 +216,13 @@ void drawMainScreen() {
 
     // Draw custom info for each screen
     if (stateUiMainScreen == MAIN_PAGE_1) {
-        drawCompleteScreen(mainSprite);
+        drawCompleteScreen(mainSprite, state);
     } else if (stateUiMainScreen == MAIN_PAGE_2) {
-        drawMinimalScreen(mainSprite);
+        drawMinimalScreen(mainSprite, state);
     }
 
     // Errors and alerts
-    if (sharedState.getNbSatellites() <= 0) {
+    if (state.nbSatellites <= 0) {
         mainSprite.setFont(&FreeSans40pt7b);
         mainSprite.setTextColor(COLOR_ERROR);
         mainSprite.drawString("*", 155, 2);
@@ -213,14 +242,22 @@ RadioButton radioButtonDistanceMode;
 // Wheel size
 Button buttonWheelSizeIncrease;
 Button buttonWheelSizeDecrease;
+// Magnets per wheel
+Button buttonMagnetsIncrease;
+Button buttonMagnetsDecrease;
 // Timezone
 Button buttonTimezoneIncrease;
 Button buttonTimezoneDecrease;
 // Brightness
 Slider sliderBrightness;
+// Calibration
+Button buttonCalibrationStart;
+Button buttonCalibrationApply;
 
 /** Draw the parameter screen */
 void drawParametersScreen() {
+    StateSnapshot state = sharedState.snapshot();
+
     display.beginTransaction();
     mainSprite.fillSprite(WHITE);
     mainSprite.setTextColor(BLACK);
@@ -230,7 +267,7 @@ void drawParametersScreen() {
     mainSprite.setFont(&FreeSansBold9pt7b);
     mainSprite.drawString("Parameters", 10, 6);
     mainSprite.setFont(&FreeSans9pt7b);
-    mainSprite.drawString("1/2", 290, 6);
+    mainSprite.drawString("1/3", 290, 6);
     mainSprite.drawFastHLine(0, 27, 320, COLOR_LIGHTGREY);
 
     // Global parameters for all components
@@ -238,11 +275,11 @@ void drawParametersScreen() {
     mainSprite.setTextDatum(middle_left);
     uint16_t xLabels = 10;
     uint16_t xValues = 108;
-    constexpr uint16_t y[]{49, 91, 133, 175, 217};
+    constexpr uint16_t y[]{45, 81, 117, 153, 189, 225};
 
     // Draw stage distance
     mainSprite.drawString("Stage", xLabels, y[0]);
-    mainSprite.drawString(formatString("%.2f km", sharedState.getStageDistance() / 1000).c_str(), xValues - 30, y[0]);
+    mainSprite.drawString(formatString("%.2f km", state.stageDistance / 1e6).c_str(), xValues - 30, y[0]);
     mainSprite.setFont(&FreeMonoBold9pt7b);
     buttonStageDecrease.draw(&mainSprite, 170, y[0] - 15, 30, 30, UI_BUTTON_BORDER_COLOR, UI_BUTTON_BACKGROUND_COLOR,
                              UI_BUTTON_TEXT_COLOR, "-");
@@ -258,7 +295,7 @@ void drawParametersScreen() {
 
     // Draw wheel size
     mainSprite.drawString("Wheel size", xLabels, y[2]);
-    mainSprite.drawString(formatString("%d mm", sharedState.getWheelSize()).c_str(), xValues, y[2]);
+    mainSprite.drawString(formatString("%d mm", state.wheelSize).c_str(), xValues, y[2]);
     mainSprite.setFont(&FreeMonoBold9pt7b);
     buttonWheelSizeDecrease.draw(&mainSprite, 240, y[2] - 15, 30, 30, UI_BUTTON_BORDER_COLOR,
                                  UI_BUTTON_BACKGROUND_COLOR, UI_BUTTON_TEXT_COLOR, "-");
@@ -266,20 +303,30 @@ void drawParametersScreen() {
                                  UI_BUTTON_BACKGROUND_COLOR, UI_BUTTON_TEXT_COLOR, "+");
     mainSprite.setFont(&FreeSans9pt7b);
 
+    // Draw number of magnets per wheel
+    mainSprite.drawString("Magnets", xLabels, y[3]);
+    mainSprite.drawNumber(state.magnetsPerWheel, xValues, y[3]);
+    mainSprite.setFont(&FreeMonoBold9pt7b);
+    buttonMagnetsDecrease.draw(&mainSprite, 240, y[3] - 15, 30, 30, UI_BUTTON_BORDER_COLOR, UI_BUTTON_BACKGROUND_COLOR,
+                               UI_BUTTON_TEXT_COLOR, "-");
+    buttonMagnetsIncrease.draw(&mainSprite, 280, y[3] - 15, 30, 30, UI_BUTTON_BORDER_COLOR, UI_BUTTON_BACKGROUND_COLOR,
+                               UI_BUTTON_TEXT_COLOR, "+");
+    mainSprite.setFont(&FreeSans9pt7b);
+
     // Draw timezone
-    mainSprite.drawString("Timezone", xLabels, y[3]);
-    mainSprite.drawString(formatString("%+03d:00", sharedState.getTimezone()).c_str(), xValues - 10, y[3]);
+    mainSprite.drawString("Timezone", xLabels, y[4]);
+    mainSprite.drawString(formatString("%+03d:00", state.timezone).c_str(), xValues - 10, y[4]);
     mainSprite.setFont(&FreeMonoBold9pt7b);
-    buttonTimezoneDecrease.draw(&mainSprite, 240, y[3] - 15, 30, 30, UI_BUTTON_BORDER_COLOR, UI_BUTTON_BACKGROUND_COLOR,
+    buttonTimezoneDecrease.draw(&mainSprite, 240, y[4] - 15, 30, 30, UI_BUTTON_BORDER_COLOR, UI_BUTTON_BACKGROUND_COLOR,
                                 UI_BUTTON_TEXT_COLOR, "-");
-    buttonTimezoneIncrease.draw(&mainSprite, 280, y[3] - 15, 30, 30, UI_BUTTON_BORDER_COLOR, UI_BUTTON_BACKGROUND_COLOR,
+    buttonTimezoneIncrease.draw(&mainSprite, 280, y[4] - 15, 30, 30, UI_BUTTON_BORDER_COLOR, UI_BUTTON_BACKGROUND_COLOR,
                                 UI_BUTTON_TEXT_COLOR, "+");
     mainSprite.setFont(&FreeSans9pt7b);
 
     // Draw brightness
-    mainSprite.drawString("Brightness", xLabels, y[4]);
-    mainSprite.drawString(formatString("%d %%", sharedState.getBrightness()).c_str(), xValues, y[4]);
-    sliderBrightness.draw(&mainSprite, 170, y[4] - 5, 130, 10, UI_SLIDER_BORDER_COLOR, UI_SLIDER_BACKGROUND_COLOR,
+    mainSprite.drawString("Brightness", xLabels, y[5]);
+    mainSprite.drawString(formatString("%d %%", state.brightness).c_str(), xValues, y[5]);
+    sliderBrightness.draw(&mainSprite, 170, y[5] - 5, 130, 10, UI_SLIDER_BORDER_COLOR, UI_SLIDER_BACKGROUND_COLOR,
                           UI_SLIDER_THUMB_COLOR);
 
     mainSprite.pushSprite(&display, 0, 0);
@@ -288,6 +335,8 @@ void drawParametersScreen() {
 
 /** Draw the info screen, showing static values (satellites, total dist., ...) */
 void drawInfoScreen() {
+    StateSnapshot state = sharedState.snapshot();
+
     display.beginTransaction();
     mainSprite.fillSprite(WHITE);
     mainSprite.setTextColor(BLACK);
@@ -297,7 +346,7 @@ void drawInfoScreen() {
     mainSprite.setFont(&FreeSansBold9pt7b);
     mainSprite.drawString("Info", 10, 6);
     mainSprite.setFont(&FreeSans9pt7b);
-    mainSprite.drawString("2/2", 290, 6);
+    mainSprite.drawString("2/3", 290, 6);
     mainSprite.drawFastHLine(0, 27, 320, COLOR_LIGHTGREY);
 
     uint16_t xLabels = 140;
@@ -314,11 +363,66 @@ void drawInfoScreen() {
 
     // Draw the info values
     mainSprite.setTextDatum(top_left);
-    mainSprite.drawNumber(sharedState.getNbSatellites(), xValues, y[0]);
-    mainSprite.drawString(formatString("%.1f km", sharedState.getTotalDistance() / 1000).c_str(), xValues, y[1]);
-    mainSprite.drawString(formatString("%.1f km/h", sharedState.getMaxSpeed()).c_str(), xValues, y[2]);
-    mainSprite.drawString(formatString("%.1f *C", sharedState.getTemperature()).c_str(), xValues, y[3]);
-    mainSprite.drawString(formatString("%.1f m", sharedState.getAltitude()).c_str(), xValues, y[4]);
+    mainSprite.drawNumber(state.nbSatellites, xValues, y[0]);
+    mainSprite.drawString(formatString("%.1f km", state.totalDistance / 1e6).c_str(), xValues, y[1]);
+    mainSprite.drawString(formatString("%.1f km/h", state.maxSpeed).c_str(), xValues, y[2]);
+    mainSprite.drawString(formatString("%.1f *C", state.temperature).c_str(), xValues, y[3]);
+    mainSprite.drawString(formatString("%.1f m", state.altitude).c_str(), xValues, y[4]);
+
+    mainSprite.pushSprite(&display, 0, 0);
+    display.endTransaction();
+}
+
+/** Draw the calibration screen: wheel size suggested from the GPS distance */
+void drawCalibrationScreen() {
+    StateSnapshot state = sharedState.snapshot();
+    WheelCalibrationResult calibration = wheelCalibration.getResult();
+
+    display.beginTransaction();
+    mainSprite.fillSprite(WHITE);
+    mainSprite.setTextColor(BLACK);
+    mainSprite.setTextDatum(top_left);
+
+    // Screen title
+    mainSprite.setFont(&FreeSansBold9pt7b);
+    mainSprite.drawString("Calibration", 10, 6);
+    mainSprite.setFont(&FreeSans9pt7b);
+    mainSprite.drawString("3/3", 290, 6);
+    mainSprite.drawFastHLine(0, 27, 320, COLOR_LIGHTGREY);
+
+    uint16_t xLabels = 140;
+    uint16_t xValues = xLabels + 20;
+    constexpr uint16_t y[]{40, 75, 110, 145, 195};
+
+    // Draw the labels
+    mainSprite.setTextDatum(top_right);
+    mainSprite.drawString("Wheel size:", xLabels, y[0]);
+    mainSprite.drawString("Segments:", xLabels, y[1]);
+    mainSprite.drawString("Suggested:", xLabels, y[2]);
+    mainSprite.drawString("Confidence:", xLabels, y[3]);
+
+    // Draw the values, the suggestion once enough segments are measured
+    mainSprite.setTextDatum(top_left);
+    mainSprite.drawString(formatString("%d mm", state.wheelSize).c_str(), xValues, y[0]);
+    std::string segments = calibration.isActive
+                               ? formatString("%d (%.0f m)", calibration.segments, calibration.segmentDistance)
+                               : formatString("%d", calibration.segments);
+    mainSprite.drawString(segments.c_str(), xValues, y[1]);
+    if (calibration.hasSuggestion) {
+        mainSprite.drawString(formatString("%.0f mm", calibration.circumference).c_str(), xValues, y[2]);
+        mainSprite.drawString(formatString("+/- %.1f mm", calibration.confidence).c_str(), xValues, y[3]);
+    } else {
+        mainSprite.drawString("-", xValues, y[2]);
+        mainSprite.drawString("-", xValues, y[3]);
+    }
+
+    // Draw the buttons
+    buttonCalibrationStart.draw(&mainSprite, 40, y[4] - 15, 110, 30, UI_BUTTON_BORDER_COLOR,
+                                UI_BUTTON_BACKGROUND_COLOR, UI_BUTTON_TEXT_COLOR,
+                                calibration.isActive ? "Stop" : "Start");
+    buttonCalibrationApply.draw(&mainSprite, 170, y[4] - 15, 110, 30, UI_BUTTON_BORDER_COLOR,
+                                UI_BUTTON_BACKGROUND_COLOR,
+                                calibration.hasSuggestion ? UI_BUTTON_TEXT_COLOR : COLOR_GREY, "Apply");
 
     mainSprite.pushSprite(&display, 0, 0);
     display.endTransaction();
@@ -326,14 +430,16 @@ void drawInfoScreen() {
 
 void initParameterComponents(uint8_t brightness) {
     // Stage distance
-    buttonStageIncrease.setClickHandler([]() { sharedState.addToStageDistance(BUTTON_INCREMENT_DISTANCE_M); });
-    buttonStageDecrease.setClickHandler([]() { sharedState.addToStageDistance(-BUTTON_INCREMENT_DISTANCE_M); });
+    buttonStageIncrease.setClickHandler([]() { sharedState.addToStageDistance(BUTTON_INCREMENT_DISTANCE_MM); });
+    buttonStageDecrease.setClickHandler([]() { sharedState.addToStageDistance(-BUTTON_INCREMENT_DISTANCE_MM); });
     buttonStageReset.setHoldHandler([]() { sharedState.resetStageDistance(); });
 
     // Distance mode
     std::vector<RadioButtonOption> options = {
-        {WHEEL_SENSOR, "Wheel sensor"},
+        {WHEEL_SENSOR, "Wheel"},
         {GPS, "GPS"},
+        {FUSED, "Fused"},
+        {HYBRID, "Hybrid"},
     };
     radioButtonDistanceMode.setup(options, sharedState.getDistanceMode());
     radioButtonDistanceMode.setChangeHandler(
@@ -343,6 +449,10 @@ void initParameterComponents(uint8_t brightness) {
     buttonWheelSizeIncrease.setClickHandler([]() { sharedState.addToWheelSize(1); });
     buttonWheelSizeDecrease.setClickHandler([]() { sharedState.addToWheelSize(-1); });
 
+    // Magnets per wheel
+    buttonMagnetsIncrease.setClickHandler([]() { sharedState.addToMagnetsPerWheel(1); });
+    buttonMagnetsDecrease.setClickHandler([]() { sharedState.addToMagnetsPerWheel(-1); });
+
     // Timezone
     buttonTimezoneIncrease.setClickHandler([]() { sharedState.addToTimezone(1); });
     buttonTimezoneDecrease.setClickHandler([]() { sharedState.addToTimezone(-1); });
@@ -353,6 +463,21 @@ void initParameterComponents(uint8_t brightness) {
         sharedState.setBrightness(newValue);
         display.setBrightness(50 + newValue / 2);
     });
+
+    // Calibration
+    buttonCalibrationStart.setClickHandler([]() {
+        if (wheelCalibration.isActive()) {
+            wheelCalibration.stop();
+        } else {
+            wheelCalibration.start();
+        }
+    });
+    buttonCalibrationApply.setClickHandler([]() {
+        WheelCalibrationResult calibration = wheelCalibration.getResult();
+        if (calibration.hasSuggestion) {
+            sharedState.setWheelSize(static_cast<uint16_t>(lroundf(calibration.circumference)));
+        }
+    });
 }
 
 /**
@@ -401,6 +526,7 @@ void displayProcess(void* arg) {
         if (stateUiScreen == MAIN) {
             drawMainScreen();
         } else if (stateUiScreen == PARAMETERS) {
+            isMainScreenDrawn = false;  // Drawn over, every frame for the feedback of the touched components
             if (stateUiParametersScreen == PARAMETERS_PAGE_1) {
                 buttonStageIncrease.update();
                 buttonStageDecrease.update();
@@ -408,13 +534,20 @@ void displayProcess(void* arg) {
                 radioButtonDistanceMode.update();
                 buttonWheelSizeIncrease.update();
                 buttonWheelSizeDecrease.update();
+                buttonMagnetsIncrease.update();
+                buttonMagnetsDecrease.update();
                 buttonTimezoneIncrease.update();
                 buttonTimezoneDecrease.update();
                 sliderBrightness.update(&swipe);
 
                 drawParametersScreen();
-            } else {
+            } else if (stateUiParametersScreen == PARAMETERS_PAGE_2) {
                 drawInfoScreen();
+            } else {
+                buttonCalibrationStart.update();
+                buttonCalibrationApply.update();
+
+                drawCalibrationScreen();
             }
         }
 
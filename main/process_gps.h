@@ -2,125 +2,346 @@
 #include <M5Unified.h>
 #include <stdint.h>
 
+#include "casic.h"
+#include "calibration.h"
 #include "constants.h"
 #include "driver/uart.h"
 #include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
 #include "freertos/task.h"
+#include "fusion.h"
+#include "gps_data.h"
+#include "gps_odometer.h"
+#include "nmea_framer.h"
 #include "state.h"
 #include "tinygps++/TinyGPS++.cpp"
+#include "utils.h"
 
 TinyGPSPlus gps;
+NmeaFramer<GPS_NMEA_FRAMER_SIZE> nmeaFramer;
+CasicDecoder casic;
 
-struct Position {
-    float latitude;
-    float longitude;
-};
-
-Position oldPosition{0.0f, 0.0f};
-uint64_t timeOldPosition{0};  // us
+GpsOdometer gpsOdometer;
+// Fraction of millimeter not reported yet
+float gpsDistanceRemainder{0.0f};
 
 /**
- * Process for the GPS module. This process listens for GPS data on the UART port and updates the shared state.
- * @param arg Unused.
+ * Install the UART driver with an event queue. With NMEA, a pattern event is raised on every line feed, i.e. at the end
+ * of each sentence.
+ * @return The UART event queue.
  */
-void gpsProcess(void *arg) {
-    // Buffer for data read on UART
-    uint8_t data[GPS_UART_BUFFER_SIZE];
-
-    // Configure UART for GPS communication
+QueueHandle_t initGpsUart() {
     uart_config_t uart_config = {.baud_rate = GPS_UART_BAUD_RATE,
                                  .data_bits = UART_DATA_8_BITS,
                                  .parity = UART_PARITY_DISABLE,
                                  .stop_bits = UART_STOP_BITS_1,
                                  .flow_ctrl = UART_HW_FLOWCTRL_DISABLE,
                                  .source_clk = UART_SCLK_DEFAULT};
-    uart_driver_install(GPS_UART_PORT_NUM, GPS_UART_BUFFER_SIZE * 2, 0, 0, NULL, 0);
+    QueueHandle_t uartQueue{nullptr};
+    ESP_ERROR_CHECK(uart_driver_install(GPS_UART_PORT_NUM, GPS_UART_BUFFER_SIZE * 2, 0, GPS_UART_EVENT_QUEUE_SIZE,
+                                        &uartQueue, 0));
     uart_param_config(GPS_UART_PORT_NUM, &uart_config);
     uart_set_pin(GPS_UART_PORT_NUM, GPS_UART_TX_PIN, GPS_UART_RX_PIN, UART_PIN_NO_CHANGE, UART_PIN_NO_CHANGE);
 
-    // Mode for distance calculation (GPS or wheel sensor). We only change state if the mode is GPS.
+    // Detect the end of each sentence. Binary frames have no delimiter and are read on data events.
+    if (GPS_PROTOCOL == GPS_PROTOCOL_NMEA) {
+        uart_enable_pattern_det_baud_intr(GPS_UART_PORT_NUM, GPS_UART_PATTERN_CHAR, 1, 9, 0, 0);
+        uart_pattern_queue_reset(GPS_UART_PORT_NUM, GPS_UART_PATTERN_QUEUE_SIZE);
+    }
+
+    return uartQueue;
+}
+
+/**
+ * Send a configuration command to the receiver, wrapped in an NMEA sentence with its checksum.
+ * @param body Command between `$` and `*`, e.g. `PCAS02,100`.
+ */
+void sendGpsCommand(const char* body) {
+    uint8_t checksum{0};
+    for (const char* c = body; *c; c++) {
+        checksum ^= *c;
+    }
+    std::string command = formatString("$%s*%02X\r\n", body, checksum);
+    uart_write_bytes(GPS_UART_PORT_NUM, command.c_str(), command.size());
+}
+
+/**
+ * Enable the output of a binary CASIC message at every fix.
+ * @param messageClass Class of the message.
+ * @param messageId Id of the message.
+ */
+void enableCasicMessage(uint8_t messageClass, uint8_t messageId) {
+    const uint8_t payload[4]{messageClass, messageId, 1, 0};  // Class, id, rate (U2)
+    uint8_t frame[sizeof(payload) + CASIC_FRAME_OVERHEAD];
+    size_t size = CasicDecoder::encodeFrame(CASIC_CLASS_CFG, CASIC_ID_CFG_MSG, payload, sizeof(payload), frame);
+    uart_write_bytes(GPS_UART_PORT_NUM, frame, size);
+}
+
+/**
+ * Configure the receiver: select the output messages and set the update rate. Less data per fix keeps the parsing
+ * cost low at high update rates.
+ */
+void configureGpsReceiver() {
+    if (GPS_PROTOCOL == GPS_PROTOCOL_CASIC) {
+        // Replace the NMEA sentences with the binary position/velocity and time messages
+        sendGpsCommand(GPS_RECEIVER_NO_OUTPUT_COMMAND);
+        enableCasicMessage(CASIC_CLASS_NAV, CASIC_ID_NAV_PV);
+        enableCasicMessage(CASIC_CLASS_NAV, CASIC_ID_NAV_TIMEUTC);
+    } else {
+        sendGpsCommand(GPS_RECEIVER_OUTPUT_COMMAND);
+    }
+    sendGpsCommand(formatString("PCAS02,%d", GPS_UPDATE_RATE_MS).c_str());
+    uart_wait_tx_done(GPS_UART_PORT_NUM, pdMS_TO_TICKS(100));
+    M5_LOGI("GPS receiver configured with update rate of %d ms", GPS_UPDATE_RATE_MS);
+}
+
+/**
+ * Feed a complete sentence from the framer into the TinyGPS++ object, its checksum is not computed again.
+ * @param sentence Sentence with a valid checksum.
+ */
+void encodeSentence(const NmeaSentence& sentence) {
+    gps.encodeVerified(sentence.first, sentence.firstLength);
+    gps.encodeVerified(sentence.second, sentence.secondLength);
+}
+
+/**
+ * Read the values freshly parsed by TinyGPS++.
+ * @return The updated values.
+ */
+GpsData readNmeaData() {
+    GpsData data;
+    if (gps.time.isValid() && gps.time.isUpdated()) {
+        data.hasTime = true;
+        data.hour = gps.time.hour();
+        data.minute = gps.time.minute();
+        data.second = gps.time.second();
+    }
+    if (gps.satellites.isValid() && gps.satellites.isUpdated()) {
+        data.hasSatellites = true;
+        data.satellites = gps.satellites.value();
+    }
+    if (gps.altitude.isValid() && gps.altitude.isUpdated()) {
+        data.hasAltitude = true;
+        data.altitude = gps.altitude.meters();
+    }
+    if (gps.location.isValid() && gps.location.isUpdated()) {
+        data.hasLocation = true;
+        const RawDegrees& latitude = gps.location.rawLat();
+        const RawDegrees& longitude = gps.location.rawLng();
+        data.position = {toNanodegrees(latitude.deg, latitude.billionths, latitude.negative),
+                         toNanodegrees(longitude.deg, longitude.billionths, longitude.negative)};
+    }
+    if (gps.time.isValid()) {
+        // Time of day from hhmmsscc, wraps at midnight
+        uint32_t time = gps.time.value();
+        data.hasTimestamp = true;
+        data.timestamp = (((time / 1000000) * 60 + (time / 10000) % 100) * 60 + (time / 100) % 100) * 1000 +
+                         (time % 100) * 10;
+    }
+    if (gps.speed.isValid() && gps.speed.isUpdated()) {
+        data.hasSpeed = true;
+        data.speed = gps.speed.kmph();
+    }
+    if (gps.course.isValid() && gps.course.isUpdated()) {
+        data.hasCourse = true;
+        data.course = gps.course.deg();
+    }
+    if (gps.hdop.isValid() && gps.hdop.isUpdated()) {
+        data.hasHdop = true;
+        data.hdop = gps.hdop.hdop();
+    }
+    return data;
+}
+
+/**
+ * Read the values freshly decoded from CASIC binary messages.
+ * @return The updated values.
+ */
+GpsData readCasicData() {
+    GpsData data;
+    const CasicNavigation& nav = casic.navigation();
+    if (casic.isTimeUpdated() && nav.timeValid) {
+        data.hasTime = true;
+        data.hour = nav.hour;
+        data.minute = nav.minute;
+        data.second = nav.second;
+    }
+    if (casic.isNavigationUpdated()) {
+        data.hasSatellites = data.hasTimestamp = true;
+        data.satellites = nav.satellites;
+        data.timestamp = nav.runTime;
+        if (nav.positionValid) {
+            data.hasAltitude = data.hasLocation = true;
+            data.altitude = nav.altitude;
+            data.position = {toNanodegrees(nav.latitude), toNanodegrees(nav.longitude)};
+            data.hasHdop = true;
+            data.hdop = nav.dop;  // No HDOP in NAV-PV, the position DOP is larger, i.e. stricter
+        }
+        if (nav.velocityValid) {
+            data.hasSpeed = data.hasCourse = true;
+            data.speed = nav.speed * 3.6f;
+            data.course = nav.heading;
+        }
+    }
+    return data;
+}
+
+/**
+ * Update the shared state with the values received from the GPS.
+ * @param data Updated values.
+ * @param mode Current distance mode. Distance and speed are updated in GPS and hybrid modes (while there is a fix),
+ * distance is corrected in fused mode.
+ */
+void updateStateFromGps(const GpsData& data, DistanceMode mode) {
+    // Time
+    if (data.hasTime) {
+        sharedState.setTime(data.hour, data.minute, data.second);
+    }
+
+    // Connected satellites
+    if (data.hasSatellites) {
+        sharedState.setNbSatellites(data.satellites);
+    }
+
+    // Altitude
+    if (data.hasAltitude) {
+        sharedState.setAltitude(data.altitude);
+    }
+
+    // Distance
+    uint64_t now = esp_timer_get_time();
+    if (mode == HYBRID && data.hasLocation && !hybridOdometer.updateGps(now)) {
+        gpsOdometer.reset();  // Fix back, the wheel sensor counted the distance since the loss
+    }
+    float distance = gpsOdometer.update(data, now);
+    wheelCalibration.updateGps(data, distance, now);
+    if ((mode == FUSED || mode == HYBRID) && data.hasLocation) {
+        // Fixes without speed (GGA) go through the fusion too: in fused mode, the raw GPS distance is never added
+        float fusedDistance = distanceFusion.updateGps(distance, data.hasSpeed, data.speed, now);
+        distance = mode == FUSED ? fusedDistance : distance;  // Only used for calibration in hybrid mode
+    }
+    if (mode != WHEEL_SENSOR && distance > 0.0f) {
+        sharedState.addToStageDistance(toMillimeters(distance, gpsDistanceRemainder));
+    }
+
+    // Speed
+    if ((mode == GPS || mode == HYBRID) && data.hasSpeed) {
+        sharedState.setSpeed(data.speed);
+    }
+
+    // Cap
+    if (data.hasCourse) {
+        sharedState.setCap(data.course);
+    }
+}
+
+/**
+ * Read all the data available on the UART into the NMEA framer, and update the shared state with each complete
+ * sentence.
+ * @param mode Current distance mode.
+ */
+void readNmeaSentences(DistanceMode mode) {
+    size_t available{0};
+    uart_get_buffered_data_len(GPS_UART_PORT_NUM, &available);
+    while (available > 0) {
+        // Read directly into the framer
+        size_t space{0};
+        char* buffer = nmeaFramer.writeBuffer(space);
+        int len = uart_read_bytes(GPS_UART_PORT_NUM, buffer, available < space ? available : space, 0);
+        if (len <= 0) {
+            break;
+        }
+        nmeaFramer.commit(len);
+        available -= len;
+
+        // Parse complete sentences and update the state for each one
+        NmeaSentence sentence;
+        while (nmeaFramer.next(sentence)) {
+            encodeSentence(sentence);
+            updateStateFromGps(readNmeaData(), mode);
+        }
+    }
+}
+
+/**
+ * Read the binary data available on the UART, and update the shared state with each complete CASIC frame.
+ * @param mode Current distance mode.
+ */
+void readCasicFrames(DistanceMode mode) {
+    uint8_t data[GPS_UART_READ_SIZE];
+    int len = uart_read_bytes(GPS_UART_PORT_NUM, data, sizeof(data), 0);
+    for (int i = 0; i < len; i++) {
+        if (casic.encode(data[i])) {
+            updateStateFromGps(readCasicData(), mode);
+        }
+    }
+}
+
+/**
+ * Process for the GPS module. This process waits for complete NMEA sentences (or binary frames) on the UART port and
+ * updates the shared state as soon as each one is received.
+ * @param arg Unused.
+ */
+void gpsProcess(void *arg) {
+    // Configure UART for GPS communication
+    QueueHandle_t uartQueue = initGpsUart();
+    configureGpsReceiver();
+
+    // Mode for distance calculation (GPS, wheel sensor, fused or hybrid). We only change state if the mode is not
+    // WHEEL_SENSOR.
     DistanceMode mode = sharedState.getDistanceMode();
 
-    // Register as observer for mode changes
-    sharedState.registerModeObserver(xTaskGetCurrentTaskHandle());
+    // Subscribe to mode changes
+    sharedState.subscribe(xTaskGetCurrentTaskHandle(), STATE_FIELD_DISTANCE_MODE, STATE_NOTIFY_MODE_BIT);
 
     // Loop forever while processing GPS data
-    float latitude, longitude;
+    uart_event_t event;
     while (true) {
         // On notification, update the mode from the shared state
-        uint32_t receivedMode{0};
-        if (xTaskNotifyWait(0, 0, &receivedMode, 0) == pdPASS) {
+        uint32_t notification{0};
+        if (xTaskNotifyWait(0, UINT32_MAX, &notification, 0) == pdPASS && (notification & STATE_NOTIFY_MODE_BIT)) {
             M5_LOGD("Task `GPS` received a notification");
-            mode = static_cast<DistanceMode>(receivedMode);
+            mode = sharedState.getDistanceMode();
 
             if (mode == GPS) {
-                timeOldPosition = 0;  // Reset timeOldPosition when switching to GPS mode
+                gpsOdometer.reset();  // Restart from the next position when switching to GPS mode
+            } else if (mode == FUSED) {
+                distanceFusion.reset();
+            } else if (mode == HYBRID) {
+                gpsOdometer.reset();
+                distanceFusion.reset();
+                hybridOdometer.reset();
             }
         }
 
-        // Read data from UART
-        int len = uart_read_bytes(GPS_UART_PORT_NUM, data, (GPS_UART_BUFFER_SIZE - 1), 20 / portTICK_PERIOD_MS);
-
-        // Process received data
-        if (len > 0) {
-            data[len] = 0;  // Null-terminate the received data
-            M5_LOGD("GPS: Received data: %s", data);
-
-            // Feed data into the TinyGPS++ object
-            for (int i = 0; i < len; i++) {
-                gps.encode(data[i]);
-            }
-
-            // Time
-            if (gps.time.isValid() && gps.time.isUpdated()) {
-                sharedState.setTime(gps.time.hour(), gps.time.minute(), gps.time.second());
-            }
-
-            // Connected satellites
-            if (gps.satellites.isValid() && gps.satellites.isUpdated()) {
-                sharedState.setNbSatellites(gps.satellites.value());
-            }
+        // Wait for the next UART event
+        if (xQueueReceive(uartQueue, &event, pdMS_TO_TICKS(GPS_EVENT_TIMEOUT_MS)) != pdTRUE) {
+            continue;
+        }
 
-            // Altitude
-            if (gps.altitude.isValid() && gps.altitude.isUpdated()) {
-                sharedState.setAltitude(gps.altitude.meters());
-            }
+        switch (event.type) {
+            // At least one complete sentence has been received
+            case UART_PATTERN_DET:
+                readNmeaSentences(mode);
+                break;
 
-            // Latitude, longitude coordinates
-            if (gps.location.isValid() && gps.location.isUpdated()) {
-                latitude = gps.location.lat();
-                longitude = gps.location.lng();
-
-                // Get current time to compare with last position
-                uint64_t now = esp_timer_get_time();
-                uint64_t durationSinceLastCheck = now - timeOldPosition;
-                if (mode == GPS && timeOldPosition > 0 && durationSinceLastCheck > GPS_UPDATE_MIN_TIME &&
-                    durationSinceLastCheck < GPS_UPDATE_MAX_TIME) {
-                    // Compute distance in meters
-                    float distance =
-                        TinyGPSPlus::distanceBetween(oldPosition.latitude, oldPosition.longitude, latitude, longitude);
-
-                    // Update shared state if within reasonable bounds
-                    if (distance > GPS_UPDATE_MIN_DISTANCE && distance < GPS_UPDATE_MAX_DISTANCE) {
-                        sharedState.addToStageDistance(distance);
-                    }
+            // Binary data received
+            case UART_DATA:
+                if (GPS_PROTOCOL == GPS_PROTOCOL_CASIC) {
+                    readCasicFrames(mode);
                 }
+                break;
 
-                timeOldPosition = now;
-                oldPosition = {latitude, longitude};
-            }
-
-            // Speed
-            if (mode == GPS && gps.speed.isValid() && gps.speed.isUpdated()) {
-                sharedState.setSpeed(gps.speed.kmph());
-            }
+            // Data could not be processed fast enough, start again from a clean buffer
+            case UART_FIFO_OVF:
+            case UART_BUFFER_FULL:
+                M5_LOGW("GPS: UART overflow, flushing input");
+                uart_flush_input(GPS_UART_PORT_NUM);
+                xQueueReset(uartQueue);
+                break;
 
-            // Cap
-            if (gps.course.isValid() && gps.course.isUpdated()) {
-                sharedState.setCap(gps.course.deg());
-            }
+            default:
+                break;
         }
-
-        vTaskDelay(pdMS_TO_TICKS(GPS_LOOP_DELAY_MS));
     }
 }
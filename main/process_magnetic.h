@@ -2,120 +2,272 @@
 
 #include <M5Unified.h>
 
+#include "calibration.h"
 #include "constants.h"
-#include "driver/gpio.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#include "fusion.h"
 #include "state.h"
+#include "utils.h"
+#include "wheel_sensor.h"
+#include "wheel_speed.h"
 
-uint32_t lastRevolutionCount{0};
+#if MAGNETIC_SENSOR_BACKEND == MAGNETIC_SENSOR_BACKEND_PCNT
+PcntWheelSensor defaultWheelSensor;
+#else
+GpioWheelSensor defaultWheelSensor;
+#endif
 
-volatile uint32_t revolutionCount{0};
-volatile uint64_t lastPulseTime{0};
+// Wheel sensor used by the magnetic process, can be replaced before the process starts (e.g. by a fake counter)
+WheelSensor *wheelSensor{&defaultWheelSensor};
 
-uint64_t lastSpeedCheckTime{0};  // us
-uint32_t lastSpeedCheckRevolutionCount{0};
+// Called after the state is updated on a pulse, with the time since the pulse in us. Measures the latency of the
+// odometer readout, e.g. to log it while tuning MAGNETIC_COALESCING_WINDOW_US.
+void (*magneticLatencyHandler)(uint64_t){nullptr};
 
-static void IRAM_ATTR hall_sensor_isr_handler(void *arg) {
+uint32_t lastPulseCount{0};
+uint64_t lastPulseCheckTime{0};  // us
+// Pulses dropped by the plausibility check, e.g. electrical noise
+uint32_t rejectedPulseCount{0};
+// Distance of the pulses not reported yet, in um multiplied by the number of magnets: exact for any number of magnets,
+// the fractions of pulses are carried without rounding drift
+uint64_t pendingDistance{0};
+// Fraction of millimeter not reported yet, from the fused and hybrid distances
+float fusionDistanceRemainder{0.0f};
+
+WheelSpeedEstimator speedEstimator;
+uint32_t lastSpeedCheckPulseCount{0};
+
+/**
+ * Convert new pulses to a distance. Fractions of millimeter are carried to the next call.
+ * @param pulses Number of new pulses.
+ * @param wheel_size Wheel size in mm.
+ * @param magnets Number of magnets on the wheel.
+ * @return Distance in mm, or 0.
+ */
+uint32_t pulsesToDistance(uint32_t pulses, uint16_t wheel_size, uint8_t magnets) {
+    pendingDistance += static_cast<uint64_t>(pulses) * wheel_size * 1000;
+    uint64_t millimeters = pendingDistance / magnets / 1000;
+    pendingDistance -= millimeters * 1000 * magnets;
+    return millimeters;
+}
+
+/**
+ * Read the number of new pulses since the last update. The number of pulses is checked against the maximum distance
+ * that can be traveled at MAGNETIC_MAX_SPEED since the last read, so that bursts after a long time without update
+ * (e.g. task starved) are kept. Implausible pulses are counted and skipped, the next updates continue from them.
+ * Valid pulses are also given to the wheel size calibration.
+ * @param wheel_size Wheel size in mm.
+ * @param magnets Number of magnets on the wheel.
+ * @param pulseTime Set to the time of the last pulse in us.
+ * @return Number of new pulses, or 0 if none or implausible.
+ */
+uint32_t readNewPulses(uint16_t wheel_size, uint8_t magnets, uint64_t& pulseTime) {
+    // Read all variables at once to avoid concurrent access
+    WheelPulses pulses = wheelSensor->read();
+    pulseTime = pulses.lastPulseTime;
     uint64_t now = esp_timer_get_time();
-    if (now - lastPulseTime < MAGNETIC_MIN_ISR_DELAY_US) {
-        return;
+
+    // Unsigned difference, correct across a wraparound of the counter
+    uint32_t pulseDifference = pulses.count - lastPulseCount;
+    uint64_t elapsed = now - lastPulseCheckTime;
+    float maxPulses = elapsed / 3600.0f * MAGNETIC_MAX_SPEED * magnets / wheel_size + 1;
+    lastPulseCount = pulses.count;
+    lastPulseCheckTime = now;
+
+    if (pulseDifference > maxPulses) {
+        rejectedPulseCount += pulseDifference;
+        M5_LOGW("Magnetic: %lu pulses in %llu us rejected", pulseDifference, elapsed);
+        return 0;
     }
-    revolutionCount++;
-    lastPulseTime = now;
+    wheelCalibration.addPulses(pulseDifference, magnets);
+    return pulseDifference;
 }
 
-void updateDistance(uint16_t wheel_size) {
-    // Save all variables first to avoid concurrent access
-    uint32_t tmpRevolutionCount = revolutionCount;
-
-    uint32_t revolutionDifference = tmpRevolutionCount - lastRevolutionCount;
-    if (revolutionDifference > 0 && revolutionDifference < MAGNETIC_UPDATE_MAX_REVOLUTIONS) {
-        float incrementalDistance = revolutionDifference * wheel_size / 1000.0f;
+void updateDistance(uint16_t wheel_size, uint8_t magnets) {
+    uint64_t pulseTime{0};
+    uint32_t pulses = readNewPulses(wheel_size, magnets, pulseTime);
+    uint32_t incrementalDistance = pulsesToDistance(pulses, wheel_size, magnets);
+    if (incrementalDistance > 0) {
         sharedState.addToStageDistance(incrementalDistance);
-        lastRevolutionCount = tmpRevolutionCount;
     }
 }
 
-float calculateSpeed(uint16_t wheel_size) {
-    // Save all variables first to avoid concurrent access
-    uint32_t tmpRevolutionCount = revolutionCount;
-    int64_t tmpLastPulseTime = lastPulseTime;
+/**
+ * Feed the new pulses to the fusion filter, in fused mode.
+ * @param wheel_size Wheel size in mm.
+ * @param magnets Number of magnets on the wheel.
+ */
+void updateFusion(uint16_t wheel_size, uint8_t magnets) {
+    uint64_t pulseTime{0};
+    uint32_t pulses = readNewPulses(wheel_size, magnets, pulseTime);
+    if (pulses > 0) {
+        float distance = distanceFusion.updateWheel(pulses, pulseTime, static_cast<float>(wheel_size) / magnets);
+        if (distance > 0.0f) {
+            sharedState.addToStageDistance(toMillimeters(distance, fusionDistanceRemainder));
+        }
+    }
 
-    int64_t timeDifference = tmpLastPulseTime - lastSpeedCheckTime;
-    int32_t revolutionDifference = tmpRevolutionCount - lastSpeedCheckRevolutionCount;
-    lastSpeedCheckTime = tmpLastPulseTime;
-    lastSpeedCheckRevolutionCount = tmpRevolutionCount;
+    sharedState.setSpeed(distanceFusion.getSpeed(esp_timer_get_time()));
+}
+
+/**
+ * Report the distance of the new pulses when the GPS does not cover it, in hybrid mode. The pulses also calibrate the
+ * wheel size in the fusion filter.
+ * @param wheel_size Wheel size in mm.
+ * @param magnets Number of magnets on the wheel.
+ */
+void updateHybrid(uint16_t wheel_size, uint8_t magnets) {
+    uint64_t now = esp_timer_get_time();
+    uint64_t pulseTime{0};
+    uint32_t pulses = readNewPulses(wheel_size, magnets, pulseTime);
+    if (pulses > 0) {
+        distanceFusion.updateWheel(pulses, pulseTime, static_cast<float>(wheel_size) / magnets);
+    }
+    float incrementalDistance = pulsesToDistance(pulses, wheel_size, magnets) / 1000.0f * distanceFusion.getScale();
+
+    // Also called without new pulse, to report the distance held when the GPS is lost
+    float distance = hybridOdometer.updateWheel(incrementalDistance, now);
+    if (distance > 0.0f) {
+        sharedState.addToStageDistance(toMillimeters(distance, fusionDistanceRemainder));
+    }
 
-    if (lastSpeedCheckTime > 0 && timeDifference > 0 && revolutionDifference > 0 &&
-        revolutionDifference < MAGNETIC_UPDATE_MAX_REVOLUTIONS) {
-        // Calculate speed in km/h
-        return (wheel_size * revolutionDifference) / (timeDifference / 3600.0f);
+    // Speed from the GPS process while covered
+    if (!hybridOdometer.isCovered(now)) {
+        sharedState.setSpeed(distanceFusion.getSpeed(now));
+    }
+}
+
+/**
+ * Give the new pulses to the wheel size calibration, in GPS mode. While the calibration is not active, the last count
+ * and check time follow the sensor: when it starts, the pulses counted before are not taken as new pulses, and the
+ * plausibility check is made on the time since the last loop.
+ * @param wheel_size Wheel size in mm.
+ * @param magnets Number of magnets on the wheel.
+ */
+void updateCalibration(uint16_t wheel_size, uint8_t magnets) {
+    if (wheelCalibration.isActive()) {
+        uint64_t pulseTime{0};
+        readNewPulses(wheel_size, magnets, pulseTime);
+    } else {
+        lastPulseCount = wheelSensor->read().count;
+        lastPulseCheckTime = esp_timer_get_time();
+    }
+}
+
+/**
+ * Calculate the speed from the periods between pulses.
+ * @param wheel_size Wheel size in mm.
+ * @param magnets Number of magnets on the wheel.
+ * @return Speed in km/h.
+ */
+float calculateSpeed(uint16_t wheel_size, uint8_t magnets) {
+    if (wheelSensor->hasPulseTimes()) {
+        // Exact time of each pulse
+        uint64_t pulseTime{0};
+        while (wheelSensor->popPulseTime(pulseTime)) {
+            speedEstimator.addPulses(1, pulseTime);
+        }
     } else {
-        return 0.0f;
+        // Only the time of the last pulse, averaged over the pulses since the last check
+        WheelPulses pulses = wheelSensor->read();
+        speedEstimator.addPulses(pulses.count - lastSpeedCheckPulseCount, pulses.lastPulseTime);
+        lastSpeedCheckPulseCount = pulses.count;
     }
+
+    return speedEstimator.getSpeed(esp_timer_get_time(), static_cast<float>(wheel_size) / magnets);
 }
 
-void attachInterrupt() {
-    // Configure GPIO for hall sensor
-    gpio_config_t io_conf = {
-        .pin_bit_mask = 1ULL << MAGNETIC_SENSOR_PIN,
-        .mode = GPIO_MODE_INPUT,
-        .pull_up_en = GPIO_PULLUP_ENABLE,  // TODO: Check if this is correct
-        .pull_down_en = GPIO_PULLDOWN_DISABLE,
-        .intr_type = GPIO_INTR_NEGEDGE,  // Trigger on rising edge TODO: Check if this is correct
-    };
-    gpio_config(&io_conf);
-
-    // Hook isr handler for specific gpio pin
-    gpio_install_isr_service(ESP_INTR_FLAG_IRAM);  // TODO: check error
-    gpio_isr_handler_add(MAGNETIC_SENSOR_PIN, hall_sensor_isr_handler, (void *)MAGNETIC_SENSOR_PIN);
+/**
+ * Update the shared state from the new pulses, in the current mode, and report the latency to
+ * `magneticLatencyHandler` after a pulse.
+ * @param mode Distance mode, not GPS.
+ * @param wheel_size Wheel size in mm.
+ * @param magnets Number of magnets on the wheel.
+ * @param isPulse Whether the update is made on a pulse notification.
+ * @return Time of the update in us.
+ */
+uint64_t updateFromPulses(DistanceMode mode, uint16_t wheel_size, uint8_t magnets, bool isPulse) {
+    if (mode == WHEEL_SENSOR) {
+        updateDistance(wheel_size, magnets);
+        sharedState.setSpeed(calculateSpeed(wheel_size, magnets));
+    } else if (mode == FUSED) {
+        updateFusion(wheel_size, magnets);
+    } else if (mode == HYBRID) {
+        updateHybrid(wheel_size, magnets);
+    }
+    uint64_t now = esp_timer_get_time();
+
+    if (isPulse && magneticLatencyHandler != nullptr) {
+        magneticLatencyHandler(now - wheelSensor->read().lastPulseTime);
+    }
+    return now;
 }
 
 /**
- * Process for the magnetic sensor. This process listens for magnetic sensor data and updates the shared state.
+ * Process for the magnetic sensor. This process waits for pulses of the magnetic sensor and updates the shared state
+ * as soon as they are received. It also wakes up periodically to update the speed when no pulse comes.
  * @param arg Unused.
  */
 void magneticProcess(void *arg) {
-    // Create interrupt for magnetic sensor
-    attachInterrupt();
+    // Start counting the pulses of the magnetic sensor, and be notified on each one
+    wheelSensor->setNotifiedTask(xTaskGetCurrentTaskHandle());
+    wheelSensor->begin();
+    lastPulseCheckTime = esp_timer_get_time();
 
-    // Mode for distance calculation (GPS or wheel sensor). We only change state if the mode is WHEEL_SENSOR.
+    // Mode for distance calculation (GPS, wheel sensor, fused or hybrid). We only change state if the mode is not GPS.
     DistanceMode mode = sharedState.getDistanceMode();
 
-    // Wheel size in mm for distance calculation
+    // Wheel size in mm and number of magnets (pulses per revolution) for distance calculation
     uint16_t wheel_size = sharedState.getWheelSize();
+    uint8_t magnets = sharedState.getMagnetsPerWheel();
 
-    // Register as observer for mode and wheel size changes
-    sharedState.registerModeObserver(xTaskGetCurrentTaskHandle());
-    sharedState.registerWheelSizeObserver(xTaskGetCurrentTaskHandle());
+    // Subscribe to mode and wheel size changes
+    TaskHandle_t task = xTaskGetCurrentTaskHandle();
+    sharedState.subscribe(task, STATE_FIELD_DISTANCE_MODE, STATE_NOTIFY_MODE_BIT);
+    sharedState.subscribe(task, STATE_FIELD_WHEEL_SIZE | STATE_FIELD_MAGNETS_PER_WHEEL, STATE_NOTIFY_WHEEL_SIZE_BIT);
 
-    uint8_t countSpeedIterations{0};
+    uint64_t lastUpdateTime{0};  // us
 
     // Loop forever while
     while (true) {
+        // Wait for a pulse or a change of the state. Fused and hybrid modes also need regular updates without pulse.
+        bool isFusion = mode == FUSED || mode == HYBRID;
+        uint32_t notification{0};
+        xTaskNotifyWait(0, UINT32_MAX, &notification,
+                        pdMS_TO_TICKS(isFusion ? FUSION_LOOP_DELAY_MS : MAGNETIC_LOOP_DELAY_MS));
+
         // On notification, update the mode and wheel size from the shared state
-        if (xTaskNotifyWait(0, 0, NULL, 0) == pdPASS) {
+        if (notification & (STATE_NOTIFY_MODE_BIT | STATE_NOTIFY_WHEEL_SIZE_BIT)) {
             M5_LOGD("Task `magnetic` received a notification");
             mode = sharedState.getDistanceMode();
             wheel_size = sharedState.getWheelSize();
+            magnets = sharedState.getMagnetsPerWheel();
 
-            if (mode == WHEEL_SENSOR) {
-                // Reset the last revolution count and speed check variables
-                lastRevolutionCount = revolutionCount = lastSpeedCheckRevolutionCount = 0;
-                lastSpeedCheckTime = lastPulseTime = 0;
+            if (mode != GPS) {
+                // Reset the last pulse count and speed check variables
+                wheelSensor->reset();
+                speedEstimator.reset();
+                lastPulseCount = lastSpeedCheckPulseCount = 0;
+                lastPulseCheckTime = esp_timer_get_time();
+                pendingDistance = 0;
+                fusionDistanceRemainder = 0.0f;
             }
         }
 
-        if (mode == WHEEL_SENSOR) {
-            updateDistance(wheel_size);
+        // In GPS mode, the pulses are only read for the wheel size calibration
+        if (mode == GPS) {
+            updateCalibration(wheel_size, magnets);
+            continue;
+        }
 
-            if (countSpeedIterations++ % (MAGNETIC_SPEED_CHECK_DELAY_MS / MAGNETIC_LOOP_DELAY_MS) == 0) {
-                sharedState.setSpeed(calculateSpeed(wheel_size));
-                countSpeedIterations = 1;
-            }
+        // Group the pulses received shortly after the last update
+        bool isPulse = notification & STATE_NOTIFY_PULSE_BIT;
+        uint64_t sinceLastUpdate = esp_timer_get_time() - lastUpdateTime;
+        if (isPulse && sinceLastUpdate < MAGNETIC_COALESCING_WINDOW_US) {
+            vTaskDelay(pdMS_TO_TICKS((MAGNETIC_COALESCING_WINDOW_US - sinceLastUpdate) / 1000));
         }
 
-        vTaskDelay(pdMS_TO_TICKS(MAGNETIC_LOOP_DELAY_MS));
+        lastUpdateTime = updateFromPulses(mode, wheel_size, magnets, isPulse);
     }
 }
@@ -0,0 +1,96 @@
+#pragma once
+
+#include <M5Unified.h>
+#include <stdint.h>
+
+#include "constants.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "journal.h"
+#include "state.h"
+
+/**
+ * Ticks to wait until a time, rounded up: a wait rounded down to 0 ticks would return at once, and the process would
+ * spin until the time.
+ * @param time Time to wait for in us.
+ * @param now Current time in us.
+ * @return Ticks to wait, at least 1 if the time is in the future.
+ */
+TickType_t ticksUntil(uint64_t time, uint64_t now) {
+    if (time <= now) {
+        return 0;
+    }
+    TickType_t ticks = pdMS_TO_TICKS((time - now + 999) / 1000);
+    return ticks > 0 ? ticks : 1;
+}
+
+/**
+ * Process for the storage. This process is the only one writing to the flash: the other processes only send save
+ * requests, and never wait for a flash write. The distance is appended to the journal every JOURNAL_PERIOD_US, and the
+ * state is saved to NVS, as a checkpoint of the journal:
+ * - After STATE_DEBOUNCE_DELAY_US without new modification of a setting (STORAGE_NOTIFY_MODIFIED_BIT).
+ * - On request (STORAGE_NOTIFY_SAVE_BIT, e.g. when stopping after riding), at most every STATE_MIN_SAVE_DELAY_US.
+ * - Every STATE_SAVE_LOOP_DELAY_US, or before the journal ring overwrites records not saved yet.
+ * - At start, to include the distance replayed from the journal.
+ * Requests received before a save are grouped in this save.
+ * @param arg Unused.
+ */
+void storageProcess(void *arg) {
+    sharedState.registerStorageTask(xTaskGetCurrentTaskHandle());
+
+    // Save the checkpoint first, the journal records are then relative to it
+    auto checkpoint = []() {
+        StateRecord saved;
+        uint32_t journalSequence = distanceJournal.getSequence();
+        if (sharedState.saveData(journalSequence, saved)) {
+            distanceJournal.setCheckpoint(journalSequence, saved.stageDistance, saved.totalDistance);
+        }
+    };
+    checkpoint();
+
+    // Time of the last save, and times of the next saves and journal record in us (0 if none)
+    uint64_t lastSaveTime = esp_timer_get_time();
+    uint64_t periodicSaveTime = lastSaveTime + STATE_SAVE_LOOP_DELAY_US;
+    uint64_t debouncedSaveTime{0};
+    uint64_t requestedSaveTime{0};
+    uint64_t journalTime = lastSaveTime + JOURNAL_PERIOD_US;
+
+    // Loop forever while waiting for save requests
+    while (true) {
+        // Wait for a request, the next save or the next journal record
+        uint64_t now = esp_timer_get_time();
+        uint64_t nextSaveTime = journalTime < periodicSaveTime ? journalTime : periodicSaveTime;
+        nextSaveTime = debouncedSaveTime != 0 && debouncedSaveTime < nextSaveTime ? debouncedSaveTime : nextSaveTime;
+        nextSaveTime = requestedSaveTime != 0 && requestedSaveTime < nextSaveTime ? requestedSaveTime : nextSaveTime;
+        uint32_t notification{0};
+        xTaskNotifyWait(0, UINT32_MAX, &notification, ticksUntil(nextSaveTime, now));
+
+        now = esp_timer_get_time();
+        if (notification & STORAGE_NOTIFY_MODIFIED_BIT) {
+            debouncedSaveTime = now + STATE_DEBOUNCE_DELAY_US;  // Restarted at each modification
+        }
+        if (notification & STORAGE_NOTIFY_SAVE_BIT && requestedSaveTime == 0) {
+            uint64_t earliestSaveTime = lastSaveTime + STATE_MIN_SAVE_DELAY_US;
+            requestedSaveTime = now > earliestSaveTime ? now : earliestSaveTime;
+        }
+
+        if (now >= journalTime) {
+            StateSnapshot state = sharedState.snapshot();
+            distanceJournal.append(state.stageDistance, state.totalDistance);
+            journalTime = now + JOURNAL_PERIOD_US;
+            if (distanceJournal.needsCheckpoint()) {
+                requestedSaveTime = now;
+            }
+        }
+
+        bool isDebouncedSaveDue = debouncedSaveTime != 0 && now >= debouncedSaveTime;
+        bool isRequestedSaveDue = requestedSaveTime != 0 && now >= requestedSaveTime;
+        if (isDebouncedSaveDue || isRequestedSaveDue || now >= periodicSaveTime) {
+            checkpoint();
+            lastSaveTime = esp_timer_get_time();
+            periodicSaveTime = lastSaveTime + STATE_SAVE_LOOP_DELAY_US;
+            debouncedSaveTime = requestedSaveTime = 0;
+        }
+    }
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <stddef.h>
+
+#include <atomic>
+
+/**
+ * Lock-free ring buffer for a single producer and a single consumer, e.g. an interrupt handler and a task. The
+ * producer only writes the head and the consumer only writes the tail, so no lock nor critical section is needed.
+ * @tparam T Type of the items, copied in and out of the buffer.
+ * @tparam N Size of the ring buffer, must be a power of 2.
+ */
+template <typename T, size_t N>
+class SpscRing {
+    static_assert(N > 0 && (N & (N - 1)) == 0, "Ring buffer size must be a power of 2");
+    static constexpr size_t MASK = N - 1;
+
+    T buffer[N]{};
+    // Free running indexes, wrapped with MASK when accessing the buffer
+    std::atomic<size_t> head{0};  // Next write position, written by the producer
+    std::atomic<size_t> tail{0};  // Next read position, written by the consumer
+
+   public:
+    /**
+     * Add an item, from the producer. Inlined, so that it is in IRAM when called from an interrupt handler in IRAM.
+     * @return Whether the item was added, false if the buffer is full.
+     */
+    inline __attribute__((always_inline)) bool push(const T& item) {
+        size_t currentHead = head.load(std::memory_order_relaxed);
+        if (currentHead - tail.load(std::memory_order_acquire) == N) {
+            return false;
+        }
+        buffer[currentHead & MASK] = item;
+        head.store(currentHead + 1, std::memory_order_release);
+        return true;
+    }
+
+    /**
+     * Remove the oldest item, from the consumer.
+     * @return Whether an item was removed, false if the buffer is empty.
+     */
+    inline __attribute__((always_inline)) bool pop(T& item) {
+        size_t currentTail = tail.load(std::memory_order_relaxed);
+        if (currentTail == head.load(std::memory_order_acquire)) {
+            return false;
+        }
+        item = buffer[currentTail & MASK];
+        tail.store(currentTail + 1, std::memory_order_release);
+        return true;
+    }
+
+    /** Drop all items, from the consumer. */
+    void clear() { tail.store(head.load(std::memory_order_acquire), std::memory_order_release); }
+};
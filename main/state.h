@@ -1,21 +1,28 @@
 #pragma once
 
 #include <M5Unified.h>
+#include <math.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <string.h>
+
+#include <atomic>
+#include <type_traits>
 
 #include "constants.h"
-#include "esp_timer.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#include "journal.h"
 #include "nvs.h"
+#include "state_bus.h"
+#include "state_mirror.h"
+#include "state_record.h"
 
-/** Saveable value template, with key for storage, value, and whether it's dirty and must be saved to storage.  */
+/** Saveable value template, with value and key of its NVS entry before the state record (read to migrate). */
 template <typename T>
 struct SaveableValue {
     T value;
     const char* key;
-    bool isDirty = false;
 };
 
 struct Time {
@@ -27,13 +34,104 @@ struct Time {
 enum DistanceMode : uint8_t {
     WHEEL_SENSOR,  // Distance and speed calculated from wheel sensor
     GPS,           // Distance and speed calculated from GPS
+    FUSED,         // Distance and speed from wheel sensor, corrected with GPS
+    HYBRID,        // Distance and speed from GPS, from wheel sensor without GPS fix
+};
+
+/** Bits of the live values of the state, to know which ones changed with `SharedState::changedSince`. */
+enum StateField : uint32_t {
+    STATE_FIELD_STAGE_DISTANCE = 1 << 0,
+    STATE_FIELD_TOTAL_DISTANCE = 1 << 1,
+    STATE_FIELD_CAP = 1 << 2,
+    STATE_FIELD_SPEED = 1 << 3,
+    STATE_FIELD_MAX_SPEED = 1 << 4,
+    STATE_FIELD_ALTITUDE = 1 << 5,
+    STATE_FIELD_NB_SATELLITES = 1 << 6,
+    STATE_FIELD_TIME = 1 << 7,
+    STATE_FIELD_TIMEZONE = 1 << 8,
+    STATE_FIELD_TEMPERATURE = 1 << 9,
+    STATE_FIELD_DISTANCE_MODE = 1 << 10,
+    STATE_FIELD_WHEEL_SIZE = 1 << 11,
+    STATE_FIELD_MAGNETS_PER_WHEEL = 1 << 12,
+    STATE_FIELD_BRIGHTNESS = 1 << 13,
+    STATE_FIELD_PAGE = 1 << 14,
+};
+constexpr size_t STATE_FIELD_COUNT = 15;
+
+/** Copy of all the live values of the state, taken at once with `SharedState::snapshot`. */
+struct StateSnapshot {
+    uint32_t generation;  // Incremented each time a value changes
+    int64_t stageDistance;  // mm
+    int64_t totalDistance;  // mm
+    uint16_t cap;         // deg
+    float speed;          // km/h
+    float maxSpeed;       // km/h
+    float altitude;       // m
+    uint8_t nbSatellites;
+    Time time;
+    int8_t timezone;    // h
+    float temperature;  // deg celsius
+    DistanceMode distanceMode;
+    uint16_t wheelSize;  // mm
+    uint8_t magnetsPerWheel;
+    uint8_t brightness;
+    uint8_t page;
+};
+
+class SharedState;
+
+/** How a saved field is saved when it changes. */
+enum class SavePolicy : uint8_t {
+    DEBOUNCED,    // Setting, saved after STATE_DEBOUNCE_DELAY_US without other modification
+    PERIODIC,     // Measure, saved periodically and when stopping after riding
+    WITH_OTHERS,  // Only saved along with the other fields, e.g. the page changed at each swipe
+};
+
+/**
+ * Description of a saved field, given once in the registry of `SharedState`: value in the state and in the record,
+ * default value, bounds and how it's saved. The persistence and the setters are generated from the descriptions at
+ * compile time, without any lookup at runtime. The changes are notified to the subscribers of the state bus.
+ * @tparam Value Value in the state.
+ * @tparam Record Field of the record.
+ * @tparam Field Bit of the field in the snapshot (StateField), 0 if not in the snapshot.
+ */
+template <typename T, SaveableValue<T> SharedState::*Value, auto Record, uint32_t Field, T Default, T Min, T Max,
+          SavePolicy Save>
+struct SavedField {
+    using Type = T;
+    static constexpr SaveableValue<T> SharedState::*value = Value;
+    static constexpr auto record = Record;
+    static constexpr uint32_t field = Field;
+    static constexpr T defaultValue = Default;
+    static constexpr SavePolicy save = Save;
+
+    /** Value clamped to the bounds, from the type of the field or a wider one. */
+    template <typename U>
+    static constexpr T clamp(U value) {
+        using Common = std::common_type_t<T, U>;
+        return static_cast<Common>(value) < static_cast<Common>(Min)   ? Min
+               : static_cast<Common>(value) > static_cast<Common>(Max) ? Max
+                                                                       : static_cast<T>(value);
+    }
+};
+
+/** Registry of the saved fields, applying an operation to each of them (unrolled at compile time). */
+template <typename... Fields>
+struct SavedFieldList {
+    static constexpr uint32_t fields = (Fields::field | ...);  // Bits of the saved fields in the snapshot
+
+    template <typename F>
+    static void forEach(F operation) {
+        (operation(Fields{}), ...);
+    }
 };
 
 class SharedState {
-    // Distance traveled in meters in the stage. Saved. Configurable (+, -, reset).
-    SaveableValue<float> stageDistance{0.0f, "stageDistance"};
-    // Total distance traveled in meters. Saved.
-    SaveableValue<float> totalDistance{0.0f, "totalDistance"};
+    // Distance traveled in mm in the stage, exact whatever the distance (a float loses the small increments after
+    // some thousands of km). Saved. Configurable (+, -, reset).
+    SaveableValue<int64_t> stageDistance{0, "stageDistance"};
+    // Total distance traveled in mm. Saved.
+    SaveableValue<int64_t> totalDistance{0, "totalDistance"};
 
     // Direction (cap) in degrees
     uint16_t cap{0};
@@ -54,92 +152,265 @@ class SharedState {
     // Temperature in degrees celsius
     float temperature{0.0f};
 
-    // Mode for distance calculation (GPS or wheel sensor). Saved. Configurable.
+    // Mode for distance calculation (wheel sensor, GPS, fused or hybrid). Saved. Configurable.
     SaveableValue<DistanceMode> distanceMode{WHEEL_SENSOR, "distanceMode"};
     // Wheel size in mm. Saved. Configurable (+, -).
     SaveableValue<uint16_t> wheelSize{STATE_DEFAULT_WHEEL_SIZE, "wheelSize"};
+    // Number of magnets on the wheel, i.e. pulses per revolution. Saved. Configurable (+, -).
+    SaveableValue<uint8_t> magnetsPerWheel{STATE_DEFAULT_MAGNETS_PER_WHEEL, "magnets"};
 
     // Brightness level of the screen (0-100). Saved. Configurable (+, -).
     SaveableValue<uint8_t> brightness{STATE_DEFAULT_BRIGHTNESS, "brightness"};
     // Current page on main screen. Saved.
     SaveableValue<uint8_t> page{0, "page"};
 
+    // Sequence of the last journal record included in the saved distances. Saved.
+    SaveableValue<uint32_t> journalSequence{0, "journalSeq"};
+
     // Whether data has been updated and should be saved to storage
     bool isDirty{false};
+    // Whether the values have been read from their NVS entries before the state record, erased with the next save
+    bool hasLegacyEntries{false};
+    // Whether the state record failed its checks, copied to STATE_CORRUPTED_KEY by the next save before overwriting it
+    bool hasCorruptedRecord{false};
 
     // Mutex for state access
     SemaphoreHandle_t mutex;
 
-    // Observers for mode and wheel size changes
-    TaskHandle_t modeObservers[STATE_MAX_OBSERVERS]{nullptr};
-    TaskHandle_t wheelSizeObservers[STATE_MAX_OBSERVERS]{nullptr};
+    // Copy of the live values for the readers without lock, published by the writers (serialized by the mutex). The
+    // sequence is odd while the copy is written: a reader retries if it changed during its read.
+    StateSnapshot published{};
+    std::atomic<uint32_t> sequence{0};
+    // Generation of the last change of each field, published with the values
+    uint32_t fieldGenerations[STATE_FIELD_COUNT]{0};
+    // Whether the values have been loaded, the RTC memory mirror is only written after
+    bool isLoaded{false};
+
+    // Subscribers to the changes, and changes published since the mutex was taken
+    StateBus bus;
+    uint32_t pendingChanges{0};
 
     // Saving variables
     // Flag: is currently riding - moving at speed >~ 25km/h
     bool isRiding{false};
-    float lastDirtyDistance{0.0f};
-    uint64_t lastSaveTime{0ULL};
-    esp_timer_handle_t debouncedSaveTimer{nullptr};
+    // Storage process, notified of the save requests
+    TaskHandle_t storageTask{nullptr};
+
+    // Registry of the saved fields. A new saved field only needs its value above, its field in StateRecord (with a new
+    // record version) and its description here.
+    using StageDistanceField =
+        SavedField<int64_t, &SharedState::stageDistance, &StateRecord::stageDistance, STATE_FIELD_STAGE_DISTANCE, 0, 0,
+                   INT64_MAX, SavePolicy::PERIODIC>;
+    using TotalDistanceField =
+        SavedField<int64_t, &SharedState::totalDistance, &StateRecord::totalDistance, STATE_FIELD_TOTAL_DISTANCE, 0, 0,
+                   INT64_MAX, SavePolicy::PERIODIC>;
+    using MaxSpeedField = SavedField<float, &SharedState::maxSpeed, &StateRecord::maxSpeed, STATE_FIELD_MAX_SPEED,
+                                     0.0f, 0.0f, STATE_MAX_VALID_SPEED, SavePolicy::PERIODIC>;
+    using TimezoneField = SavedField<int8_t, &SharedState::timezone, &StateRecord::timezone, STATE_FIELD_TIMEZONE, 0,
+                                     -12, 14, SavePolicy::DEBOUNCED>;
+    using DistanceModeField =
+        SavedField<DistanceMode, &SharedState::distanceMode, &StateRecord::distanceMode, STATE_FIELD_DISTANCE_MODE,
+                   WHEEL_SENSOR, WHEEL_SENSOR, HYBRID, SavePolicy::DEBOUNCED>;
+    using WheelSizeField =
+        SavedField<uint16_t, &SharedState::wheelSize, &StateRecord::wheelSize, STATE_FIELD_WHEEL_SIZE,
+                   STATE_DEFAULT_WHEEL_SIZE, 0, UINT16_MAX, SavePolicy::DEBOUNCED>;
+    using MagnetsPerWheelField =
+        SavedField<uint8_t, &SharedState::magnetsPerWheel, &StateRecord::magnetsPerWheel, STATE_FIELD_MAGNETS_PER_WHEEL,
+                   STATE_DEFAULT_MAGNETS_PER_WHEEL, 1, STATE_MAX_MAGNETS_PER_WHEEL, SavePolicy::DEBOUNCED>;
+    using BrightnessField = SavedField<uint8_t, &SharedState::brightness, &StateRecord::brightness,
+                                       STATE_FIELD_BRIGHTNESS, STATE_DEFAULT_BRIGHTNESS, 0, 100, SavePolicy::DEBOUNCED>;
+    using PageField =
+        SavedField<uint8_t, &SharedState::page, &StateRecord::page, STATE_FIELD_PAGE, 0, 0, UINT8_MAX,
+                   SavePolicy::WITH_OTHERS>;
+    using JournalSequenceField = SavedField<uint32_t, &SharedState::journalSequence, &StateRecord::journalSequence, 0,
+                                            0, 0, UINT32_MAX, SavePolicy::WITH_OTHERS>;
+    using SavedFields =
+        SavedFieldList<StageDistanceField, TotalDistanceField, MaxSpeedField, TimezoneField, DistanceModeField,
+                       WheelSizeField, MagnetsPerWheelField, BrightnessField, PageField, JournalSequenceField>;
+
+    /** Copy of the saveable values, in the current record version. Must be called with the mutex taken. */
+    StateRecord toRecord() const {
+        StateRecord record{};
+        record.version = STATE_RECORD_VERSION;
+        record.size = sizeof(StateRecord);
+        SavedFields::forEach([&](auto field) {
+            using F = decltype(field);
+            using R = std::remove_reference_t<decltype(record.*F::record)>;
+            record.*F::record = static_cast<R>((this->*F::value).value);
+        });
+        record.crc = stateRecordCrc(&record, record.size);
+        return record;
+    }
+
+    /** Set the saveable values from a record, clamped to their bounds. Must be called with the mutex taken. */
+    void fromRecord(const StateRecord& record) {
+        SavedFields::forEach([&](auto field) {
+            using F = decltype(field);
+            (this->*F::value).value = F::clamp(static_cast<typename F::Type>(record.*F::record));
+        });
+    }
 
     /**
-     * Write the state to NVS (only if the value is dirty).
-     * @param nvsHandle NVS handle to write to.
+     * Read a distance from NVS. Distances saved as float meters by the previous versions are converted, and saved again
+     * in mm with the next save.
+     * @param nvsHandle NVS handle to read from.
+     * @param distance Distance to read, in mm.
+     * @return Whether the distance has been read.
      */
-    void writeToNvs(const nvs_handle_t& nvsHandle) {
-        if (stageDistance.isDirty) {
-            nvs_set_blob(nvsHandle, stageDistance.key, &stageDistance.value, sizeof(float));
-        }
-        if (totalDistance.isDirty) {
-            nvs_set_blob(nvsHandle, totalDistance.key, &totalDistance.value, sizeof(float));
+    bool readDistanceFromNvs(const nvs_handle_t& nvsHandle, SaveableValue<int64_t>& distance) {
+        size_t size{0};
+        if (nvs_get_blob(nvsHandle, distance.key, nullptr, &size) != ESP_OK) {
+            return false;
+        }
+
+        if (size == sizeof(int64_t)) {
+            return nvs_get_blob(nvsHandle, distance.key, &distance.value, &size) == ESP_OK;
+        } else if (size == sizeof(float)) {
+            float meters{0.0f};
+            if (nvs_get_blob(nvsHandle, distance.key, &meters, &size) == ESP_OK) {
+                distance.value = llroundf(meters * 1000.0f);
+                M5_LOGI("State: %s migrated from %f m", distance.key, meters);
+                return true;
+            }
         }
-        if (maxSpeed.isDirty) {
-            nvs_set_blob(nvsHandle, maxSpeed.key, &maxSpeed.value, sizeof(float));
+        return false;
+    }
+
+    /**
+     * Read the values from their NVS entries before the state record, saved again as a record with the next save.
+     * @param nvsHandle NVS handle to read from.
+     * @return Whether at least one entry has been read.
+     */
+    bool readLegacyFromNvs(const nvs_handle_t& nvsHandle) {
+        size_t floatSize = sizeof(float);
+
+        bool isFound = readDistanceFromNvs(nvsHandle, stageDistance);
+        isFound |= readDistanceFromNvs(nvsHandle, totalDistance);
+        isFound |= nvs_get_blob(nvsHandle, maxSpeed.key, &maxSpeed.value, &floatSize) == ESP_OK;
+        isFound |= nvs_get_i8(nvsHandle, timezone.key, &timezone.value) == ESP_OK;
+        // TODO: Switch mode
+        isFound |= nvs_get_u8(nvsHandle, distanceMode.key, (uint8_t*)&distanceMode.value) == ESP_OK;
+        isFound |= nvs_get_u16(nvsHandle, wheelSize.key, &wheelSize.value) == ESP_OK;
+        isFound |= nvs_get_u8(nvsHandle, magnetsPerWheel.key, &magnetsPerWheel.value) == ESP_OK;
+        isFound |= nvs_get_u8(nvsHandle, brightness.key, &brightness.value) == ESP_OK;
+        isFound |= nvs_get_u8(nvsHandle, page.key, &page.value) == ESP_OK;
+        isFound |= nvs_get_u32(nvsHandle, journalSequence.key, &journalSequence.value) == ESP_OK;
+        if (isFound) {
+            hasLegacyEntries = isDirty = true;
         }
-        if (timezone.isDirty) {
-            nvs_set_i8(nvsHandle, timezone.key, timezone.value);
+        return isFound;
+    }
+
+    /**
+     * Copy the corrupted state record to STATE_CORRUPTED_KEY, before the record is overwritten.
+     * @param nvsHandle NVS handle to write to.
+     * @return Result of the copy, ESP_OK if there is nothing to copy.
+     */
+    esp_err_t backUpCorruptedRecord(const nvs_handle_t& nvsHandle) {
+        uint8_t buffer[STATE_RECORD_MAX_SIZE];
+        size_t size = sizeof(buffer);
+        if (nvs_get_blob(nvsHandle, STATE_RECORD_KEY, buffer, &size) != ESP_OK) {
+            M5_LOGE("State: corrupted record not copied");  // Too large or already gone, the save goes on
+            return ESP_OK;
+        }
+        return nvs_set_blob(nvsHandle, STATE_CORRUPTED_KEY, buffer, size);
+    }
+
+    /** Erase the NVS entries before the state record, once the record is saved. */
+    void eraseLegacyFromNvs(const nvs_handle_t& nvsHandle) {
+        SavedFields::forEach([&](auto field) {
+            using F = decltype(field);
+            const char* key = (this->*F::value).key;
+            if (key != nullptr) {
+                nvs_erase_key(nvsHandle, key);
+            }
+        });
+    }
+
+    /**
+     * Read the state record from NVS, or the previous entries if there is no record yet. A record with a wrong CRC is
+     * ignored: the values are read from the previous entries if they are still there, and keep their defaults
+     * otherwise. The corrupted record is kept by the next save, the odometer can be recovered from it.
+     * @param nvsHandle NVS handle to read from.
+     */
+    void readFromNvs(const nvs_handle_t& nvsHandle) {
+        uint8_t buffer[STATE_RECORD_MAX_SIZE];
+        size_t size{0};
+        if (nvs_get_blob(nvsHandle, STATE_RECORD_KEY, nullptr, &size) != ESP_OK) {
+            readLegacyFromNvs(nvsHandle);
+            return;
         }
-        if (distanceMode.isDirty) {
-            nvs_set_u8(nvsHandle, distanceMode.key, distanceMode.value);
+
+        StateRecord header;
+        if (size < offsetof(StateRecord, stageDistance) || size > sizeof(buffer) ||
+            nvs_get_blob(nvsHandle, STATE_RECORD_KEY, buffer, &size) != ESP_OK) {
+            M5_LOGE("State: invalid record (%u bytes)", size);
+            hasCorruptedRecord = true;
+            readLegacyFromNvs(nvsHandle);
+            return;
         }
-        if (wheelSize.isDirty) {
-            nvs_set_u16(nvsHandle, wheelSize.key, wheelSize.value);
+        memcpy(&header, buffer, offsetof(StateRecord, stageDistance));
+        if (header.size != size || header.crc != stateRecordCrc(buffer, header.size)) {
+            M5_LOGE("State: corrupted record");
+            hasCorruptedRecord = true;
+            readLegacyFromNvs(nvsHandle);
+            return;
         }
-        if (brightness.isDirty) {
-            nvs_set_u8(nvsHandle, brightness.key, brightness.value);
+
+        // Fields unknown to the writer keep their defaults, fields unknown to this version are ignored
+        StateRecord record = toRecord();
+        memcpy(&record, buffer, size < sizeof(StateRecord) ? size : sizeof(StateRecord));
+        fromRecord(record);
+        if (header.version < STATE_RECORD_VERSION) {
+            isDirty = true;
+            M5_LOGI("State: record migrated from version %u", header.version);
         }
-        if (page.isDirty) {
-            nvs_set_u8(nvsHandle, page.key, page.value);
+    }
+
+    /**
+     * Restore the values of the RTC memory mirror, if valid. After a reset without power loss, they are exact while NVS
+     * and the journal may be behind.
+     */
+    void restoreMirror() {
+        StateRecord mirror;
+        if (!readStateMirror(mirror)) {
+            return;
         }
+
+        fromRecord(mirror);
+        isDirty = true;  // Saved by the storage process at start
+        M5_LOGI("State: restored from RTC memory");
     }
 
     /**
-     * Read the state from NVS.
-     * @param nvsHandle NVS handle to read from.
+     * Add the distance of the journal records newer than the distances read from NVS, which the next records are
+     * relative to until a new checkpoint is saved.
      */
-    void readFromNvs(const nvs_handle_t& nvsHandle) {
-        size_t floatSize = sizeof(float);
+    void replayJournal() {
+        int64_t stageDelta{0};
+        int64_t totalDelta{0};
+        uint32_t records = distanceJournal.replay(journalSequence.value, stageDelta, totalDelta);
+
+        // The next records are relative to the distances of the journal, even if the checkpoint at start fails
+        distanceJournal.setCheckpoint(journalSequence.value, stageDistance.value + stageDelta,
+                                      totalDistance.value + totalDelta);
+        if (records == 0) {
+            return;
+        }
 
-        nvs_get_blob(nvsHandle, stageDistance.key, &stageDistance.value, &floatSize);
-        nvs_get_blob(nvsHandle, totalDistance.key, &totalDistance.value, &floatSize);
-        nvs_get_blob(nvsHandle, maxSpeed.key, &maxSpeed.value, &floatSize);
-        nvs_get_i8(nvsHandle, timezone.key, &timezone.value);
-        nvs_get_u8(nvsHandle, distanceMode.key, (uint8_t*)&distanceMode.value);  // TODO: Switch mode
-        nvs_get_u16(nvsHandle, wheelSize.key, &wheelSize.value);
-        nvs_get_u8(nvsHandle, brightness.key, &brightness.value);
-        nvs_get_u8(nvsHandle, page.key, &page.value);
+        stageDistance.value = stageDistance.value + stageDelta > 0 ? stageDistance.value + stageDelta : 0;
+        totalDistance.value += totalDelta;
+        isDirty = true;  // Checkpoint saved by the storage process at start
+        M5_LOGI("State: %lu journal records replayed (+%lld mm)", records, stageDelta);
     }
 
     /**
-     * Create a debounced timer if it doesn't exist. This timer is used to save the state after a delay.
+     * Send a save request to the storage process, without waiting.
+     * @param request STORAGE_NOTIFY_SAVE_BIT or STORAGE_NOTIFY_MODIFIED_BIT.
      */
-    void createDebouncedTimerIfNotExists() {
-        if (debouncedSaveTimer == nullptr) {
-            const esp_timer_create_args_t debouncedSaveTimerArgs = {
-                .callback = [](void* arg) { static_cast<SharedState*>(arg)->saveData(STATE_DEBOUNCE_DELAY_US); },
-                .arg = this,
-                .name = "debouncedSave",
-            };
-            ESP_ERROR_CHECK(esp_timer_create(&debouncedSaveTimerArgs, &debouncedSaveTimer));
+    void requestSave(uint32_t request) {
+        if (storageTask != nullptr) {
+            xTaskNotify(storageTask, request, eSetBits);
         }
     }
 
@@ -149,14 +420,197 @@ class SharedState {
     void setSaveableStateModified() {
         isDirty = true;
 
-        createDebouncedTimerIfNotExists();
+        M5_LOGD("State: Debouncing save");
+        requestSave(STORAGE_NOTIFY_MODIFIED_BIT);
+    }
+
+    /** Give the mutex, then notify the subscribers of the changes published while it was taken. */
+    void release() {
+        uint32_t changes = pendingChanges;
+        pendingChanges = 0;
+        xSemaphoreGive(mutex);
+        bus.publish(changes);
+    }
+
+    /**
+     * Update a saved field, clamped to its bounds. If it changed, it's saved as described in the registry. Must be
+     * called with the mutex taken, and followed by `publish`.
+     * @param value New value, of the type of the field or a wider one (e.g. for additions).
+     */
+    template <typename F, typename U>
+    void update(U value) {
+        SaveableValue<typename F::Type>& saved = this->*F::value;
+        typename F::Type clamped = F::clamp(value);
+        if (clamped == saved.value) {
+            return;
+        }
+        saved.value = clamped;
 
-        if (esp_timer_is_active(debouncedSaveTimer)) {
-            esp_timer_stop(debouncedSaveTimer);
+        if constexpr (F::save == SavePolicy::DEBOUNCED) {
+            setSaveableStateModified();
+        } else if constexpr (F::save == SavePolicy::PERIODIC) {
+            isDirty = true;
         }
+    }
 
-        M5_LOGD("State: Debouncing save");
-        esp_timer_start_once(debouncedSaveTimer, STATE_DEBOUNCE_DELAY_US);
+    /** Set a saved field, taking the mutex. */
+    template <typename F, typename U>
+    void set(U value) {
+        if (xSemaphoreTake(mutex, STATE_SEMAPHORE_TIMEOUT)) {
+            update<F>(value);
+            publish();
+            release();
+        }
+    }
+
+    /** Add to an integer saved field, taking the mutex. */
+    template <typename F>
+    void add(int32_t delta) {
+        if (xSemaphoreTake(mutex, STATE_SEMAPHORE_TIMEOUT)) {
+            update<F>(static_cast<int32_t>((this->*F::value).value) + delta);
+            publish();
+            release();
+        }
+    }
+
+    /** Get a saved field, taking the mutex. Its default value if the mutex can't be taken. */
+    template <typename F>
+    typename F::Type get() {
+        typename F::Type localCopy{F::defaultValue};
+        if (xSemaphoreTake(mutex, STATE_SEMAPHORE_TIMEOUT)) {
+            localCopy = (this->*F::value).value;
+            xSemaphoreGive(mutex);
+        }
+        return localCopy;
+    }
+
+    /** Set a live value, not saved, taking the mutex. */
+    template <typename T, T SharedState::*Value>
+    void setLive(T value) {
+        if (xSemaphoreTake(mutex, STATE_SEMAPHORE_TIMEOUT)) {
+            this->*Value = value;
+            publish();
+            release();
+        }
+    }
+
+    /** Get a live value, not saved, taking the mutex. Zero if the mutex can't be taken. */
+    template <typename T, T SharedState::*Value>
+    T getLive() {
+        T localCopy{};
+        if (xSemaphoreTake(mutex, STATE_SEMAPHORE_TIMEOUT)) {
+            localCopy = this->*Value;
+            xSemaphoreGive(mutex);
+        }
+        return localCopy;
+    }
+
+    /** Bits of the fields that differ between two snapshots. */
+    static uint32_t changedFields(const StateSnapshot& a, const StateSnapshot& b) {
+        uint32_t changes{0};
+        if (a.stageDistance != b.stageDistance) {
+            changes |= STATE_FIELD_STAGE_DISTANCE;
+        }
+        if (a.totalDistance != b.totalDistance) {
+            changes |= STATE_FIELD_TOTAL_DISTANCE;
+        }
+        if (a.cap != b.cap) {
+            changes |= STATE_FIELD_CAP;
+        }
+        if (a.speed != b.speed) {
+            changes |= STATE_FIELD_SPEED;
+        }
+        if (a.maxSpeed != b.maxSpeed) {
+            changes |= STATE_FIELD_MAX_SPEED;
+        }
+        if (a.altitude != b.altitude) {
+            changes |= STATE_FIELD_ALTITUDE;
+        }
+        if (a.nbSatellites != b.nbSatellites) {
+            changes |= STATE_FIELD_NB_SATELLITES;
+        }
+        if (a.time.hour != b.time.hour || a.time.minute != b.time.minute || a.time.second != b.time.second) {
+            changes |= STATE_FIELD_TIME;
+        }
+        if (a.timezone != b.timezone) {
+            changes |= STATE_FIELD_TIMEZONE;
+        }
+        if (a.temperature != b.temperature) {
+            changes |= STATE_FIELD_TEMPERATURE;
+        }
+        if (a.distanceMode != b.distanceMode) {
+            changes |= STATE_FIELD_DISTANCE_MODE;
+        }
+        if (a.wheelSize != b.wheelSize) {
+            changes |= STATE_FIELD_WHEEL_SIZE;
+        }
+        if (a.magnetsPerWheel != b.magnetsPerWheel) {
+            changes |= STATE_FIELD_MAGNETS_PER_WHEEL;
+        }
+        if (a.brightness != b.brightness) {
+            changes |= STATE_FIELD_BRIGHTNESS;
+        }
+        if (a.page != b.page) {
+            changes |= STATE_FIELD_PAGE;
+        }
+        return changes;
+    }
+
+    /**
+     * Publish the live values to the snapshot readers. Must be called with the mutex taken, after each change, and the
+     * mutex given back with `release` to notify the subscribers. The generation is only incremented if a value
+     * actually changed, e.g. not when the same speed is set again.
+     */
+    void publish() {
+        StateSnapshot next{published.generation, stageDistance.value, totalDistance.value, cap, speed,
+                           maxSpeed.value, altitude, nbSatellites, time, timezone.value, temperature,
+                           distanceMode.value, wheelSize.value, magnetsPerWheel.value, brightness.value, page.value};
+        uint32_t changes = changedFields(next, published);
+        if (changes == 0) {
+            return;
+        }
+        next.generation++;
+        pendingChanges |= changes;
+
+        uint32_t start = sequence.load(std::memory_order_relaxed);
+        sequence.store(start + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        published = next;
+        for (size_t i = 0; i < STATE_FIELD_COUNT; i++) {
+            if (changes & (1 << i)) {
+                fieldGenerations[i] = next.generation;
+            }
+        }
+        sequence.store(start + 2, std::memory_order_release);
+
+        if (isLoaded && (changes & SavedFields::fields)) {
+            writeStateMirror(toRecord());
+        }
+    }
+
+    /**
+     * Read the published values without taking the mutex: the read is retried if a writer published during it. After
+     * STATE_SNAPSHOT_MAX_RETRIES (e.g. a writer preempted while publishing), the mutex is taken instead.
+     * @param read Function copying the published values.
+     */
+    template <typename F>
+    void readPublished(F read) {
+        for (int i = 0; i < STATE_SNAPSHOT_MAX_RETRIES; i++) {
+            uint32_t start = sequence.load(std::memory_order_acquire);
+            if (start & 1) {
+                continue;  // Being written
+            }
+            read();
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (sequence.load(std::memory_order_relaxed) == start) {
+                return;
+            }
+        }
+
+        if (xSemaphoreTake(mutex, STATE_SEMAPHORE_TIMEOUT)) {
+            read();
+            xSemaphoreGive(mutex);
+        }
     }
 
    public:
@@ -166,6 +620,7 @@ class SharedState {
             M5_LOGE("Failed to create state mutex");
             abort();
         }
+        publish();
     }
 
     ~SharedState() {
@@ -175,44 +630,70 @@ class SharedState {
     }
 
     /**
-     * Save the state to NVS if it has been updated and the interval has passed.
-     * @param ignoreDelay Minimum delay between saves in microseconds.
+     * Save the state to NVS if it has been updated. The values are copied with the lock, and written to the flash
+     * without it, so that the other tasks never wait for the flash. Only called by the storage process.
+     * @param checkpointSequence Sequence of the last journal record, included in the saved distances.
+     * @param record Saved values, the next journal records are relative to their distances.
+     * @return Whether the values have been copied and saved.
      */
-    void saveData(uint32_t ignoreDelay = STATE_MIN_SAVE_DELAY_US) {
-        uint64_t now = esp_timer_get_time();
-
-        // Ignore saving if interval too short, or if there is nothing to save
-        if (now - lastSaveTime < ignoreDelay || !isDirty) {
-            M5_LOGD("State: Too early or not dirty -> no saving");
-            return;
-        }
-
-        M5_LOGD("State: Saving");
-
+    bool saveData(uint32_t checkpointSequence, StateRecord& record) {
         // Open NVS
         nvs_handle_t nvsHandle;
         esp_err_t err = nvs_open(STORAGE_NAMESPACE, NVS_READWRITE, &nvsHandle);
         if (err != ESP_OK) {
             M5_LOGE("Error opening NVS handle: %s", esp_err_to_name(err));
-            return;
+            return false;
         }
 
-        // Save
-        if (xSemaphoreTake(mutex, STATE_SEMAPHORE_TIMEOUT) && isDirty) {
-            writeToNvs(nvsHandle);
-            xSemaphoreGive(mutex);
+        // Copy the values
+        if (!xSemaphoreTake(mutex, STATE_SEMAPHORE_TIMEOUT)) {
+            nvs_close(nvsHandle);
+            return false;
         }
+        if (journalSequence.value != checkpointSequence) {
+            journalSequence.value = checkpointSequence;
+            isDirty = true;
+        }
+        bool isModified = isDirty;
+        record = toRecord();
+        xSemaphoreGive(mutex);
 
-        // Commit to memory and close
-        nvs_commit(nvsHandle);
-        nvs_close(nvsHandle);
+        // Save, commit to memory and close
+        if (isModified) {
+            M5_LOGD("State: Saving");
+            if (hasCorruptedRecord) {
+                err = backUpCorruptedRecord(nvsHandle);
+                hasCorruptedRecord = err != ESP_OK;
+            }
+            if (err == ESP_OK) {
+                err = nvs_set_blob(nvsHandle, STATE_RECORD_KEY, &record, sizeof(StateRecord));
+            }
+            if (err == ESP_OK && hasLegacyEntries) {
+                eraseLegacyFromNvs(nvsHandle);
+                hasLegacyEntries = false;
+            }
+            if (err == ESP_OK) {
+                err = nvs_commit(nvsHandle);
+            }
 
-        isDirty = false;
-        lastSaveTime = now;
+            // Still dirty if the save failed (retried with the next request) or if the values changed meanwhile
+            if (err == ESP_OK && xSemaphoreTake(mutex, STATE_SEMAPHORE_TIMEOUT)) {
+                StateRecord current = toRecord();
+                if (memcmp(&current, &record, sizeof(StateRecord)) == 0) {
+                    isDirty = false;
+                }
+                xSemaphoreGive(mutex);
+            }
+        } else {
+            M5_LOGD("State: Not dirty -> no saving");
+        }
+        nvs_close(nvsHandle);
+        return err == ESP_OK;
     }
 
     /**
-     * Load the state from NVS.
+     * Load the state from NVS, and replay the distance journal on top of it. After a reset without power loss, the RTC
+     * memory mirror is used instead. The journal must have been begun.
      */
     void loadData() {
         // Open NVS
@@ -220,84 +701,64 @@ class SharedState {
         esp_err_t err = nvs_open(STORAGE_NAMESPACE, NVS_READONLY, &nvsHandle);
 
         if (err != ESP_OK) {
-            M5_LOGE("Error opening NVS handle: %s", esp_err_to_name(err));
-            return;
+            M5_LOGE("Error opening NVS handle: %s", esp_err_to_name(err));  // The journal is replayed anyway
         }
 
         // Load
         if (xSemaphoreTake(mutex, STATE_SEMAPHORE_TIMEOUT)) {
-            readFromNvs(nvsHandle);
+            if (err == ESP_OK) {
+                readFromNvs(nvsHandle);
+            }
+            replayJournal();
+            restoreMirror();
+            isLoaded = true;
+            publish();
 
-            xSemaphoreGive(mutex);
+            release();
         }
 
         // Close handle
-        nvs_close(nvsHandle);
-
-        M5_LOGI("State data loaded from NVS");
+        if (err == ESP_OK) {
+            nvs_close(nvsHandle);
+            M5_LOGI("State data loaded from NVS");
+        }
     }
 
-    void addToStageDistance(float distance) {
-        if (abs(distance) > STATE_DISTANCE_EPSILON && xSemaphoreTake(mutex, STATE_SEMAPHORE_TIMEOUT)) {
-            float oldStageDistance = stageDistance.value;
-            stageDistance.value += distance;
-            stageDistance.value = stageDistance.value < 0.0f ? 0.0f : stageDistance.value;
-            if (distance > STATE_DISTANCE_EPSILON) {
-                totalDistance.value += distance;
-                totalDistance.isDirty = true;
-            }
-            M5_LOGD("Set distance: %f to %f", oldStageDistance, stageDistance.value);
-            if (abs(stageDistance.value - oldStageDistance) >= STATE_DISTANCE_EPSILON) {
-                stageDistance.isDirty = isDirty = true;
+    /**
+     * Add a distance to the stage, and to the total distance if positive.
+     * @param distance Distance in mm, negative to correct the stage distance.
+     */
+    void addToStageDistance(int32_t distance) {
+        if (distance != 0 && xSemaphoreTake(mutex, STATE_SEMAPHORE_TIMEOUT)) {
+            int64_t oldStageDistance = stageDistance.value;
+            update<StageDistanceField>(stageDistance.value + distance);
+            if (distance > 0) {
+                update<TotalDistanceField>(totalDistance.value + distance);
             }
-            xSemaphoreGive(mutex);
+            M5_LOGD("Set distance: %lld to %lld", oldStageDistance, stageDistance.value);
+            publish();
+            release();
         }
     }
 
     void resetStageDistance() {
         if (xSemaphoreTake(mutex, STATE_SEMAPHORE_TIMEOUT)) {
-            if (stageDistance.value > 0.01f) {
-                stageDistance.value = 0.0f;
-                stageDistance.isDirty = true;
+            if (stageDistance.value > 0) {
+                update<StageDistanceField>(0);
                 setSaveableStateModified();
             }
-            xSemaphoreGive(mutex);
+            publish();
+            release();
         }
     }
 
-    float getStageDistance() {
-        float localCopy{0.0f};  // TODO: what to return if not available?
-        if (xSemaphoreTake(mutex, STATE_SEMAPHORE_TIMEOUT)) {
-            localCopy = stageDistance.value;
-            xSemaphoreGive(mutex);
-        }
-        return localCopy;
-    }
+    int64_t getStageDistance() { return get<StageDistanceField>(); }
 
-    float getTotalDistance() {
-        float localCopy{0.0f};
-        if (xSemaphoreTake(mutex, STATE_SEMAPHORE_TIMEOUT)) {
-            localCopy = totalDistance.value;
-            xSemaphoreGive(mutex);
-        }
-        return localCopy;
-    }
+    int64_t getTotalDistance() { return get<TotalDistanceField>(); }
 
-    void setCap(uint16_t cap) {
-        if (xSemaphoreTake(mutex, STATE_SEMAPHORE_TIMEOUT)) {
-            this->cap = cap;
-            xSemaphoreGive(mutex);
-        }
-    }
+    void setCap(uint16_t cap) { setLive<uint16_t, &SharedState::cap>(cap); }
 
-    uint16_t getCap() {
-        uint16_t localCopy{0};
-        if (xSemaphoreTake(mutex, STATE_SEMAPHORE_TIMEOUT)) {
-            localCopy = cap;
-            xSemaphoreGive(mutex);
-        }
-        return localCopy;
-    }
+    uint16_t getCap() { return getLive<uint16_t, &SharedState::cap>(); }
 
     void setSpeed(float speed) {
         if (speed < STATE_MAX_VALID_SPEED && xSemaphoreTake(mutex, STATE_SEMAPHORE_TIMEOUT)) {
@@ -306,15 +767,14 @@ class SharedState {
 
             // Set max speed
             if (speed > maxSpeed.value) {
-                maxSpeed.value = speed;
-                maxSpeed.isDirty = isDirty = true;
+                update<MaxSpeedField>(speed);
             }
 
             // Save when stopping after going over "riding" speed
             if (isRiding && speed < STATE_SPEED_EPSILON) {
                 M5_LOGD("State: Stopped after riding: %f", speed);
                 isRiding = false;
-                saveData();
+                requestSave(STORAGE_NOTIFY_SAVE_BIT);
             }
 
             // Set riding flag if going over "riding" speed
@@ -323,256 +783,107 @@ class SharedState {
                 isRiding = true;
             }
 
-            xSemaphoreGive(mutex);
+            publish();
+            release();
         }
     }
 
-    float getSpeed() {
-        float localCopy{0.0f};
-        if (xSemaphoreTake(mutex, STATE_SEMAPHORE_TIMEOUT)) {
-            localCopy = speed;
-            xSemaphoreGive(mutex);
-        }
-        return localCopy;
-    }
+    float getSpeed() { return getLive<float, &SharedState::speed>(); }
 
-    float getMaxSpeed() {
-        float localCopy{0.0f};
-        if (xSemaphoreTake(mutex, STATE_SEMAPHORE_TIMEOUT)) {
-            localCopy = maxSpeed.value;
-            xSemaphoreGive(mutex);
-        }
-        return localCopy;
-    }
+    float getMaxSpeed() { return get<MaxSpeedField>(); }
 
-    void setAltitude(float altitude) {
-        if (xSemaphoreTake(mutex, STATE_SEMAPHORE_TIMEOUT)) {
-            this->altitude = altitude;
-            xSemaphoreGive(mutex);
-        }
-    }
+    void setAltitude(float altitude) { setLive<float, &SharedState::altitude>(altitude); }
 
-    float getAltitude() {
-        float localCopy{0.0f};
-        if (xSemaphoreTake(mutex, STATE_SEMAPHORE_TIMEOUT)) {
-            localCopy = altitude;
-            xSemaphoreGive(mutex);
-        }
-        return localCopy;
-    }
+    float getAltitude() { return getLive<float, &SharedState::altitude>(); }
 
-    void setNbSatellites(uint8_t nbSatellites) {
-        if (xSemaphoreTake(mutex, STATE_SEMAPHORE_TIMEOUT)) {
-            this->nbSatellites = nbSatellites;
-            xSemaphoreGive(mutex);
-        }
-    }
+    void setNbSatellites(uint8_t nbSatellites) { setLive<uint8_t, &SharedState::nbSatellites>(nbSatellites); }
 
-    uint8_t getNbSatellites() {
-        uint8_t localCopy{0};
-        if (xSemaphoreTake(mutex, STATE_SEMAPHORE_TIMEOUT)) {
-            localCopy = nbSatellites;
-            xSemaphoreGive(mutex);
-        }
-        return localCopy;
-    }
+    uint8_t getNbSatellites() { return getLive<uint8_t, &SharedState::nbSatellites>(); }
 
     void setTime(uint8_t hour, uint8_t minute, uint8_t second) {
         if (xSemaphoreTake(mutex, STATE_SEMAPHORE_TIMEOUT)) {
             time.hour = (hour + timezone.value) % 24;
             time.minute = minute;
             time.second = second;
-            xSemaphoreGive(mutex);
+            publish();
+            release();
         }
     }
 
-    Time getTime() {
-        Time localCopy;
-        if (xSemaphoreTake(mutex, STATE_SEMAPHORE_TIMEOUT)) {
-            localCopy = time;
-            xSemaphoreGive(mutex);
-        }
-        return localCopy;
-    }
+    Time getTime() { return getLive<Time, &SharedState::time>(); }
 
-    void setTimezone(int8_t timezone) {
-        if (xSemaphoreTake(mutex, STATE_SEMAPHORE_TIMEOUT)) {
-            this->timezone.value = timezone;
-            this->timezone.isDirty = true;
-            setSaveableStateModified();
-            xSemaphoreGive(mutex);
-        }
-    }
+    void setTimezone(int8_t timezone) { set<TimezoneField>(timezone); }
 
-    void addToTimezone(int8_t hour) {
-        if (xSemaphoreTake(mutex, STATE_SEMAPHORE_TIMEOUT)) {
-            timezone.value += hour;
-            timezone.value = timezone.value < -12 ? -12 : timezone.value > 14 ? 14 : timezone.value;
-            timezone.isDirty = true;
-            setSaveableStateModified();
-            xSemaphoreGive(mutex);
-        }
-    }
+    void addToTimezone(int8_t hour) { add<TimezoneField>(hour); }
 
-    int8_t getTimezone() {
-        int8_t localCopy{0};
-        if (xSemaphoreTake(mutex, STATE_SEMAPHORE_TIMEOUT)) {
-            localCopy = timezone.value;
-            xSemaphoreGive(mutex);
-        }
-        return localCopy;
-    }
+    int8_t getTimezone() { return get<TimezoneField>(); }
 
-    void setTemperature(float temperature) {
-        if (xSemaphoreTake(mutex, STATE_SEMAPHORE_TIMEOUT)) {
-            this->temperature = temperature;
-            xSemaphoreGive(mutex);
-        }
-    }
+    void setTemperature(float temperature) { setLive<float, &SharedState::temperature>(temperature); }
 
-    float getTemperature() {
-        float localCopy{0.0f};
-        if (xSemaphoreTake(mutex, STATE_SEMAPHORE_TIMEOUT)) {
-            localCopy = temperature;
-            xSemaphoreGive(mutex);
-        }
-        return localCopy;
-    }
+    float getTemperature() { return getLive<float, &SharedState::temperature>(); }
 
-    void setDistanceMode(DistanceMode distanceMode) {
-        if (xSemaphoreTake(mutex, STATE_SEMAPHORE_TIMEOUT)) {
-            this->distanceMode.value = distanceMode;
-            this->distanceMode.isDirty = true;
-            setSaveableStateModified();
+    void setDistanceMode(DistanceMode distanceMode) { set<DistanceModeField>(distanceMode); }
 
-            // Notify all registered tasks for mode change
-            for (TaskHandle_t task : modeObservers) {
-                if (task != nullptr) {
-                    xTaskNotify(task, distanceMode, eSetValueWithOverwrite);
-                }
-            }
+    DistanceMode getDistanceMode() { return get<DistanceModeField>(); }
 
-            xSemaphoreGive(mutex);
-        }
-    }
+    void addToWheelSize(int16_t size) { add<WheelSizeField>(size); }
 
-    DistanceMode getDistanceMode() {
-        DistanceMode localCopy{WHEEL_SENSOR};
-        if (xSemaphoreTake(mutex, STATE_SEMAPHORE_TIMEOUT)) {
-            localCopy = distanceMode.value;
-            xSemaphoreGive(mutex);
-        }
-        return localCopy;
-    }
+    /** Set the wheel size in mm, e.g. from the calibration. */
+    void setWheelSize(uint16_t size) { set<WheelSizeField>(size); }
 
-    void addToWheelSize(int16_t size) {
-        if (xSemaphoreTake(mutex, STATE_SEMAPHORE_TIMEOUT)) {
-            if (wheelSize.value + size < 0) {
-                wheelSize.value = 0;
-            } else {
-                wheelSize.value += size;
-            }
-            this->wheelSize.isDirty = true;
-            setSaveableStateModified();
+    uint16_t getWheelSize() { return get<WheelSizeField>(); }
 
-            // Notify all registered tasks for wheel size change
-            for (TaskHandle_t task : wheelSizeObservers) {
-                if (task != nullptr) {
-                    xTaskNotify(task, wheelSize.value, eSetValueWithOverwrite);
-                }
-            }
+    void addToMagnetsPerWheel(int8_t magnets) { add<MagnetsPerWheelField>(magnets); }
 
-            xSemaphoreGive(mutex);
-        }
-    }
+    uint8_t getMagnetsPerWheel() { return get<MagnetsPerWheelField>(); }
 
-    uint16_t getWheelSize() {
-        uint16_t localCopy{0};
-        if (xSemaphoreTake(mutex, STATE_SEMAPHORE_TIMEOUT)) {
-            localCopy = wheelSize.value;
-            xSemaphoreGive(mutex);
-        }
-        return localCopy;
-    }
+    void setBrightness(uint8_t brightness) { set<BrightnessField>(brightness); }
 
-    void setBrightness(uint8_t brightness) {
-        if (xSemaphoreTake(mutex, STATE_SEMAPHORE_TIMEOUT)) {
-            this->brightness.value = brightness;
-            this->brightness.value = this->brightness.value > 100 ? 100 : this->brightness.value;
-            this->brightness.isDirty = true;
-            setSaveableStateModified();
-            xSemaphoreGive(mutex);
-        }
-    }
+    uint8_t getBrightness() { return get<BrightnessField>(); }
 
-    uint8_t getBrightness() {
-        uint8_t localCopy{100};
-        if (xSemaphoreTake(mutex, STATE_SEMAPHORE_TIMEOUT)) {
-            localCopy = brightness.value;
-            xSemaphoreGive(mutex);
-        }
-        return localCopy;
-    }
+    void setPage(uint8_t page) { set<PageField>(page); }
 
-    void setPage(uint8_t page) {
-        if (xSemaphoreTake(mutex, STATE_SEMAPHORE_TIMEOUT)) {
-            this->page.value = page;
-            this->page.isDirty = true;
-            xSemaphoreGive(mutex);
-        }
-    }
+    uint8_t getPage() { return get<PageField>(); }
 
-    uint8_t getPage() {
-        uint8_t localCopy{0};
-        if (xSemaphoreTake(mutex, STATE_SEMAPHORE_TIMEOUT)) {
-            localCopy = page.value;
-            xSemaphoreGive(mutex);
-        }
+    /** Get all the live values at once, consistent with each other, without taking the mutex. */
+    StateSnapshot snapshot() {
+        StateSnapshot localCopy{};
+        readPublished([&]() { localCopy = published; });
         return localCopy;
     }
 
-    // Register observer for mode changes
-    bool registerModeObserver(TaskHandle_t task) {
-        if (xSemaphoreTake(mutex, STATE_SEMAPHORE_TIMEOUT)) {
-            for (int i = 0; i < STATE_MAX_OBSERVERS; i++) {
-                if (modeObservers[i] == nullptr) {
-                    modeObservers[i] = task;
-                    xSemaphoreGive(mutex);
-                    return true;
-                }
+    /**
+     * Get the fields changed since a generation, without taking the mutex.
+     * @param generation Generation of a previous snapshot.
+     * @return Bits of the changed fields (StateField), 0 if none.
+     */
+    uint32_t changedSince(uint32_t generation) {
+        uint32_t changes{0};
+        readPublished([&]() {
+            changes = 0;
+            for (size_t i = 0; i < STATE_FIELD_COUNT; i++) {
+                changes |= fieldGenerations[i] > generation ? 1 << i : 0;
             }
-            xSemaphoreGive(mutex);
-        }
-        return false;  // Observer list is full
+        });
+        return changes;
     }
 
-    // Register observer for wheel size changes
-    bool registerWheelSizeObserver(TaskHandle_t task) {
+    /**
+     * Subscribe a task to changes of the state, notified without holding the state mutex.
+     * @param task Task to notify.
+     * @param topics Bits of the fields to be notified of (StateField).
+     * @param notifyBit Task notification bit set on changes.
+     * @return Whether the task is subscribed, false if there are already STATE_MAX_SUBSCRIBERS.
+     */
+    bool subscribe(TaskHandle_t task, uint32_t topics, uint32_t notifyBit) {
+        return bus.subscribe(task, topics, notifyBit);
+    }
+
+    // Register the storage process, which receives the save requests
+    void registerStorageTask(TaskHandle_t task) {
         if (xSemaphoreTake(mutex, STATE_SEMAPHORE_TIMEOUT)) {
-            for (int i = 0; i < STATE_MAX_OBSERVERS; i++) {
-                if (wheelSizeObservers[i] == nullptr) {
-                    wheelSizeObservers[i] = task;
-                    xSemaphoreGive(mutex);
-                    return true;
-                }
-            }
+            storageTask = task;
             xSemaphoreGive(mutex);
         }
-        return false;  // Observer list is full
     }
 } sharedState;
-
-/**
- * Process for the storage. This process saves the state to NVS at regular intervals.
- * @param arg Unused.
- */
-void storageProcess() {
-    // Create and start the periodic timer -> save every 3min
-    const esp_timer_create_args_t periodic_save_timer_args = {
-        .callback = [](void* arg) { sharedState.saveData(); },
-        .name = "periodicSave",
-    };
-    esp_timer_handle_t periodic_save_timer;
-    ESP_ERROR_CHECK(esp_timer_create(&periodic_save_timer_args, &periodic_save_timer));
-    ESP_ERROR_CHECK(esp_timer_start_periodic(periodic_save_timer, STATE_SAVE_LOOP_DELAY_US));
-}
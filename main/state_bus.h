@@ -0,0 +1,77 @@
+#pragma once
+
+#include <M5Unified.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+
+#include "constants.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+
+/** Subscriber of the state bus: task notified with a bit when one of its topics changes. */
+struct StateSubscriber {
+    TaskHandle_t task;
+    uint32_t topics;  // Bits of the fields (StateField)
+    uint32_t notifyBit;
+};
+
+/**
+ * Publish/subscribe bus of the state changes, the topics being the bits of the fields. Subscriptions are made when the
+ * processes start and never removed: the list is only appended to (under its own mutex), so that the publishers read
+ * it without any lock, after giving the state mutex. A subscriber is notified once per publication whatever the number
+ * of changed fields, and reads them with `SharedState::snapshot` or `changedSince`.
+ */
+class StateBus {
+    StateSubscriber subscribers[STATE_MAX_SUBSCRIBERS]{};
+    std::atomic<size_t> count{0};  // Subscribers visible to the publishers
+    SemaphoreHandle_t mutex;
+
+   public:
+    StateBus() {
+        mutex = xSemaphoreCreateMutex();
+        if (mutex == NULL) {
+            M5_LOGE("Failed to create state bus mutex");
+            abort();
+        }
+    }
+
+    /**
+     * Subscribe a task to topics.
+     * @param task Task to notify.
+     * @param topics Bits of the fields to be notified of.
+     * @param notifyBit Task notification bit set on changes, to distinguish them from the other notifications.
+     * @return Whether the task is subscribed, false if the list is full.
+     */
+    bool subscribe(TaskHandle_t task, uint32_t topics, uint32_t notifyBit) {
+        bool isSubscribed{false};
+        if (xSemaphoreTake(mutex, STATE_SEMAPHORE_TIMEOUT)) {
+            size_t index = count.load(std::memory_order_relaxed);
+            if (index < STATE_MAX_SUBSCRIBERS) {
+                subscribers[index] = {task, topics, notifyBit};
+                count.store(index + 1, std::memory_order_release);  // Visible once written
+                isSubscribed = true;
+            }
+            xSemaphoreGive(mutex);
+        }
+        return isSubscribed;
+    }
+
+    /**
+     * Notify the subscribers of the changed topics, without waiting.
+     * @param changes Bits of the changed fields.
+     */
+    void publish(uint32_t changes) {
+        if (changes == 0) {
+            return;
+        }
+        size_t subscribed = count.load(std::memory_order_acquire);
+        for (size_t i = 0; i < subscribed; i++) {
+            if (subscribers[i].topics & changes) {
+                xTaskNotify(subscribers[i].task, subscribers[i].notifyBit, eSetBits);
+            }
+        }
+    }
+};
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "constants.h"
+#include "esp_attr.h"
+#include "esp_system.h"
+#include "state_record.h"
+
+/** Saveable values of the state, mirrored in RTC memory. */
+struct StateMirror {
+    uint32_t magic;  // STATE_MIRROR_MAGIC once written
+    StateRecord record;
+};
+
+/**
+ * Mirror of the saveable values in the RTC memory, which is not initialized at boot: it survives a watchdog, panic or
+ * brownout reset, but not a power loss. Written at each change of the values, it gives them back exactly after a reset,
+ * without any flash write.
+ */
+RTC_NOINIT_ATTR StateMirror stateMirror;
+
+/**
+ * Write the values to the mirror.
+ * @param record Record of the values, with its CRC.
+ */
+void writeStateMirror(const StateRecord& record) {
+    stateMirror.magic = STATE_MIRROR_MAGIC;
+    stateMirror.record = record;
+}
+
+/**
+ * Read the values of the mirror, if written before the last reset by the same record version. After a power-on, the
+ * RTC memory is random.
+ * @param record Record of the mirrored values.
+ * @return Whether the mirror is valid.
+ */
+bool readStateMirror(StateRecord& record) {
+    const StateRecord& mirrored = stateMirror.record;
+    if (esp_reset_reason() == ESP_RST_POWERON || stateMirror.magic != STATE_MIRROR_MAGIC ||
+        mirrored.version != STATE_RECORD_VERSION || mirrored.size != sizeof(StateRecord) ||
+        mirrored.crc != stateRecordCrc(&mirrored, mirrored.size)) {
+        return false;
+    }
+    record = mirrored;
+    return true;
+}
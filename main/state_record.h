@@ -0,0 +1,35 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "constants.h"
+#include "esp_rom_crc.h"
+
+/**
+ * Record of the saveable values, saved to NVS as a single blob (one entry to look up and write instead of one per
+ * value) and mirrored in RTC memory. Fields are only appended, with a new STATE_RECORD_VERSION: a record of another
+ * version is read up to the fields both versions know, the others keep their defaults.
+ */
+struct StateRecord {
+    uint32_t crc;      // CRC32 of the record after this field, over `size`
+    uint16_t version;  // STATE_RECORD_VERSION of the firmware which wrote it
+    uint16_t size;     // Bytes, header included
+    // Version 1
+    int64_t stageDistance;  // mm
+    int64_t totalDistance;  // mm
+    uint32_t journalSequence;
+    float maxSpeed;      // km/h
+    uint16_t wheelSize;  // mm
+    int8_t timezone;     // h
+    uint8_t distanceMode;
+    uint8_t magnetsPerWheel;
+    uint8_t brightness;
+    uint8_t page;
+    uint8_t reserved;  // Padding, 0
+};
+
+/** CRC of a record, over its size after the CRC field. */
+uint32_t stateRecordCrc(const void* record, uint16_t size) {
+    return esp_rom_crc32_le(0, static_cast<const uint8_t*>(record) + sizeof(uint32_t), size - sizeof(uint32_t));
+}
@@ -30,6 +30,13 @@ CHANGES :
 	* Removed millis() custom implementation with standard C++ chrono
   * Added explicit fallthrough comments in switch statements
 
+2026-10-17
+
+	Parse sentences already verified by a framer
+
+	* Added encodeVerified() to parse a whole sentence whose checksum has
+	  already been verified, without computing the parity again
+
 */
 
 #include "TinyGPS++.h"
@@ -44,6 +51,7 @@ CHANGES :
 TinyGPSPlus::TinyGPSPlus()
   :  parity(0)
   ,  isChecksumTerm(false)
+  ,  isChecksumVerified(false)
   ,  curSentenceType(GPS_SENTENCE_OTHER)
   ,  curTermNumber(0)
   ,  curTermOffset(0)
@@ -93,6 +101,7 @@ bool TinyGPSPlus::encode(char c)
     parity = 0;
     curSentenceType = GPS_SENTENCE_OTHER;
     isChecksumTerm = false;
+    isChecksumVerified = false;
     sentenceHasFix = false;
     return false;
 
@@ -107,6 +116,52 @@ bool TinyGPSPlus::encode(char c)
   return false;
 }
 
+// Parse a part of a sentence whose checksum has already been verified: the
+// terms are split as in encode(), but the parity is not computed and the
+// checksum term is trusted. The characters of a term are copied at once.
+// The parts of a sentence must be given in order.
+bool TinyGPSPlus::encodeVerified(const char *data, size_t length)
+{
+  encodedCharCount += length;
+
+  bool isValidSentence = false;
+  size_t i = 0;
+  while (i < length)
+  {
+    // ordinary characters, up to the next delimiter
+    size_t start = i;
+    while (i < length && data[i] != ',' && data[i] != '*' && data[i] != '\r' && data[i] != '\n' && data[i] != '$')
+      ++i;
+    size_t count = i - start;
+    if (count > sizeof(term) - 1 - curTermOffset)
+      count = sizeof(term) - 1 - curTermOffset;
+    memcpy(term + curTermOffset, data + start, count);
+    curTermOffset += count;
+    if (i == length)
+      break;
+
+    char c = data[i++];
+    if (c == '$') // sentence begin
+    {
+      curTermNumber = curTermOffset = 0;
+      curSentenceType = GPS_SENTENCE_OTHER;
+      isChecksumTerm = false;
+      isChecksumVerified = true;
+      sentenceHasFix = false;
+      continue;
+    }
+
+    // term terminators
+    term[curTermOffset] = 0;
+    isValidSentence |= endOfTermHandler();
+    ++curTermNumber;
+    curTermOffset = 0;
+    isChecksumTerm = c == '*';
+  }
+
+  return isValidSentence;
+}
+
 //
 // internal utilities
 //
@@ -172,7 +227,7 @@ bool TinyGPSPlus::endOfTermHandler()
   if (isChecksumTerm)
   {
     byte checksum = 16 * fromHex(term[0]) + fromHex(term[1]);
-    if (checksum == parity)
+    if (isChecksumVerified || checksum == parity)
     {
       passedChecksumCount++;
       if (sentenceHasFix)
@@ -30,6 +30,12 @@ CHANGES :
 	* Removed Arduino.h include
    * Added TinyGPS++_espidf_adapter.h include
 
+2026-10-17
+
+	Parse sentences already verified by a framer
+
+	* Added encodeVerified() and stddef.h include
+
 */
 
 
@@ -38,6 +44,7 @@ CHANGES :
 #define __TinyGPSPlus_h
 
 #include <inttypes.h>
+#include <stddef.h>
 #include <limits.h>
 #include "TinyGPS++_espidf_adapter.h"
 
@@ -240,6 +247,7 @@ public:
   TinyGPSPlus();
   bool encode(char c); // process one character received from GPS
   TinyGPSPlus &operator << (char c) {encode(c); return *this;}
+  bool encodeVerified(const char *data, size_t length); // process a sentence with an already verified checksum
 
   TinyGPSLocation location;
   TinyGPSDate date;
@@ -270,6 +278,7 @@ private:
   // parsing state variables
   uint8_t parity;
   bool isChecksumTerm;
+  bool isChecksumVerified;
   char term[_GPS_MAX_FIELD_SIZE];
   uint8_t curSentenceType;
   uint8_t curTermNumber;
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <math.h>
 #include <stdint.h>
 
 #include <cstdarg>
@@ -33,3 +34,17 @@ std::string formatString(const char* format, ...) {
 
     return result;
 }
+
+/**
+ * Convert a distance in meters to whole millimeters. The rounding error is carried to the next conversion, so that no
+ * distance is lost when adding many small distances.
+ * @param distance Distance in meters.
+ * @param remainder Fraction of millimeter carried between conversions.
+ * @return Distance in millimeters.
+ */
+int32_t toMillimeters(float distance, float& remainder) {
+    float millimeters = distance * 1000.0f + remainder;
+    int32_t rounded = static_cast<int32_t>(lroundf(millimeters));
+    remainder = millimeters - rounded;
+    return rounded;
+}
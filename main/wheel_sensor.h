@@ -0,0 +1,210 @@
+#pragma once
+
+#include <M5Unified.h>
+#include <stdint.h>
+
+#include "constants.h"
+#include "driver/gpio.h"
+#include "driver/pulse_cnt.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "spsc_ring.h"
+
+/** Pulses counted by the wheel sensor, read together. */
+struct WheelPulses {
+    uint32_t count;          // Pulses since the last reset
+    uint64_t lastPulseTime;  // us, 0 if no pulse since the last reset
+};
+
+/**
+ * Hardware abstraction of the wheel sensor: counts the pulses of the magnet. The magnetic process only uses this
+ * interface, so the counting backend can be replaced (e.g. by a fake counter).
+ */
+class WheelSensor {
+   public:
+    virtual ~WheelSensor() = default;
+
+    /** Configure the hardware and start counting. */
+    virtual void begin() = 0;
+
+    /** Read the count and the time of the last pulse, consistently with each other. */
+    virtual WheelPulses read() = 0;
+
+    /** Restart the count from 0. */
+    virtual void reset() = 0;
+
+    /**
+     * Set the task notified with STATE_NOTIFY_PULSE_BIT on each pulse, if the backend has a pulse interrupt.
+     * @param task Task to notify, nullptr for none.
+     */
+    virtual void setNotifiedTask(TaskHandle_t task) {}
+
+    /** Whether the time of each pulse is available with `popPulseTime`. */
+    virtual bool hasPulseTimes() const { return false; }
+
+    /**
+     * Get the time of the oldest pulse not read yet, if the backend timestamps each pulse.
+     * @param time Set to the time of the pulse in us.
+     * @return Whether a pulse time was available.
+     */
+    virtual bool popPulseTime(uint64_t& time) { return false; }
+
+    /** Number of triggers rejected as bounces since the start, for diagnostic. */
+    virtual uint32_t rejectedBounces() const { return 0; }
+};
+
+/**
+ * Wheel sensor counting the pulses in a GPIO interrupt, with software debouncing. Each pulse costs an interrupt, but
+ * the time of each pulse is exact: it is pushed to a lock-free ring, read by the magnetic process.
+ *
+ * The debounce window follows the speed: MAGNETIC_DEBOUNCE_PERCENT of the last period between pulses, bounded by
+ * MAGNETIC_DEBOUNCE_MIN_US (max pulse rate) and MAGNETIC_DEBOUNCE_MAX_US. A second trigger of the same magnet comes
+ * much sooner than the next magnet, at any speed. The window restarts from MAGNETIC_DEBOUNCE_MIN_US at the first pulse
+ * and after a stop (MAGNETIC_SPEED_TIMEOUT_US without pulse), so that no pulse is lost on a rolling start, whatever the
+ * number of magnets. A reset of the count does not change the debouncing.
+ */
+class GpioWheelSensor : public WheelSensor {
+    volatile uint32_t count{0};
+    volatile uint64_t lastPulseTime{0};    // 0 after a reset
+    volatile uint64_t lastCountedTime{0};  // Time of the last counted pulse, kept by a reset for the debouncing
+    volatile uint32_t debounceWindow{MAGNETIC_DEBOUNCE_MIN_US};  // us, until a period is measured
+    volatile uint32_t rejectedBounceCount{0};
+    portMUX_TYPE spinlock = portMUX_INITIALIZER_UNLOCKED;
+    SpscRing<uint64_t, MAGNETIC_PULSE_RING_SIZE> pulseTimes;
+    TaskHandle_t notifiedTask{nullptr};
+
+    static void IRAM_ATTR isrHandler(void *arg) {
+        GpioWheelSensor *sensor = static_cast<GpioWheelSensor *>(arg);
+        uint64_t now = esp_timer_get_time();
+        bool isCounted{false};
+        portENTER_CRITICAL_ISR(&sensor->spinlock);
+        uint64_t period = now - sensor->lastCountedTime;
+        bool isStarting = sensor->lastCountedTime == 0 || period >= MAGNETIC_SPEED_TIMEOUT_US;
+        if (!isStarting && period < sensor->debounceWindow) {
+            sensor->rejectedBounceCount = sensor->rejectedBounceCount + 1;
+        } else {
+            if (isStarting) {
+                // No period for the first pulse or after a stop: the next pulse may come at any speed
+                sensor->debounceWindow = MAGNETIC_DEBOUNCE_MIN_US;
+            } else {
+                // 32-bit operations only, the period is bounded by the window limits first
+                uint32_t window = period < MAGNETIC_DEBOUNCE_MAX_US * 100 / MAGNETIC_DEBOUNCE_PERCENT
+                                      ? static_cast<uint32_t>(period) * MAGNETIC_DEBOUNCE_PERCENT / 100
+                                      : MAGNETIC_DEBOUNCE_MAX_US;
+                sensor->debounceWindow = window > MAGNETIC_DEBOUNCE_MIN_US ? window : MAGNETIC_DEBOUNCE_MIN_US;
+            }
+            sensor->count = sensor->count + 1;
+            sensor->lastCountedTime = now;
+            sensor->lastPulseTime = now;
+            sensor->pulseTimes.push(now);  // Dropped if the ring is full, the speed is then computed on a longer period
+            isCounted = true;
+        }
+        portEXIT_CRITICAL_ISR(&sensor->spinlock);
+
+        // Wake the magnetic process. Setting a bit already set does not wake it again, so pulses are grouped until
+        // the process handles them.
+        if (isCounted && sensor->notifiedTask != nullptr) {
+            BaseType_t higherPriorityTaskWoken{pdFALSE};
+            xTaskNotifyFromISR(sensor->notifiedTask, STATE_NOTIFY_PULSE_BIT, eSetBits, &higherPriorityTaskWoken);
+            portYIELD_FROM_ISR(higherPriorityTaskWoken);
+        }
+    }
+
+   public:
+    void begin() override {
+        // Configure GPIO for hall sensor
+        gpio_config_t io_conf = {
+            .pin_bit_mask = 1ULL << MAGNETIC_SENSOR_PIN,
+            .mode = GPIO_MODE_INPUT,
+            .pull_up_en = GPIO_PULLUP_ENABLE,  // TODO: Check if this is correct
+            .pull_down_en = GPIO_PULLDOWN_DISABLE,
+            .intr_type = GPIO_INTR_NEGEDGE,  // Trigger on rising edge TODO: Check if this is correct
+        };
+        gpio_config(&io_conf);
+
+        // Hook isr handler for specific gpio pin
+        gpio_install_isr_service(ESP_INTR_FLAG_IRAM);  // TODO: check error
+        gpio_isr_handler_add(MAGNETIC_SENSOR_PIN, isrHandler, this);
+    }
+
+    WheelPulses read() override {
+        portENTER_CRITICAL(&spinlock);
+        WheelPulses pulses{count, lastPulseTime};
+        portEXIT_CRITICAL(&spinlock);
+        return pulses;
+    }
+
+    void reset() override {
+        portENTER_CRITICAL(&spinlock);
+        count = 0;
+        lastPulseTime = 0;  // The debouncing goes on from the last counted pulse, the speed does not change
+        portEXIT_CRITICAL(&spinlock);
+        pulseTimes.clear();
+    }
+
+    uint32_t rejectedBounces() const override { return rejectedBounceCount; }
+
+    void setNotifiedTask(TaskHandle_t task) override { notifiedTask = task; }
+
+    bool hasPulseTimes() const override { return true; }
+
+    bool popPulseTime(uint64_t& time) override { return pulseTimes.pop(time); }
+};
+
+/**
+ * Wheel sensor counting the pulses with the PCNT peripheral, without CPU cost per pulse. Short glitches are removed by
+ * the hardware filter (MAGNETIC_PCNT_GLITCH_FILTER_NS, at most ~12.7us), the count is accumulated in software when
+ * the 16-bit hardware counter reaches its limit. The peripheral has no timestamp: the time of the last pulse is the
+ * time of the read where the count changed, i.e. precise to the reading period.
+ */
+class PcntWheelSensor : public WheelSensor {
+    pcnt_unit_handle_t unit{nullptr};
+    uint32_t lastCount{0};
+    uint64_t lastPulseTime{0};
+
+   public:
+    void begin() override {
+        pcnt_unit_config_t unitConfig = {
+            .low_limit = -1,  // Only counting up, must be negative
+            .high_limit = MAGNETIC_PCNT_HIGH_LIMIT,
+            .flags = {.accum_count = true},
+        };
+        ESP_ERROR_CHECK(pcnt_new_unit(&unitConfig, &unit));
+
+        pcnt_glitch_filter_config_t filterConfig = {.max_glitch_ns = MAGNETIC_PCNT_GLITCH_FILTER_NS};
+        ESP_ERROR_CHECK(pcnt_unit_set_glitch_filter(unit, &filterConfig));
+
+        // Count falling edges, like the GPIO interrupt
+        pcnt_chan_config_t channelConfig = {.edge_gpio_num = MAGNETIC_SENSOR_PIN, .level_gpio_num = -1};
+        pcnt_channel_handle_t channel{nullptr};
+        ESP_ERROR_CHECK(pcnt_new_channel(unit, &channelConfig, &channel));
+        ESP_ERROR_CHECK(
+            pcnt_channel_set_edge_action(channel, PCNT_CHANNEL_EDGE_ACTION_HOLD, PCNT_CHANNEL_EDGE_ACTION_INCREASE));
+        gpio_pullup_en(MAGNETIC_SENSOR_PIN);
+
+        // Overflow of the hardware counter, accumulated by the driver
+        ESP_ERROR_CHECK(pcnt_unit_add_watch_point(unit, MAGNETIC_PCNT_HIGH_LIMIT));
+
+        ESP_ERROR_CHECK(pcnt_unit_enable(unit));
+        ESP_ERROR_CHECK(pcnt_unit_clear_count(unit));
+        ESP_ERROR_CHECK(pcnt_unit_start(unit));
+    }
+
+    WheelPulses read() override {
+        int value{0};
+        pcnt_unit_get_count(unit, &value);
+        uint32_t count = static_cast<uint32_t>(value);
+        if (count != lastCount) {
+            lastCount = count;
+            lastPulseTime = esp_timer_get_time();
+        }
+        return {count, lastPulseTime};
+    }
+
+    void reset() override {
+        pcnt_unit_clear_count(unit);
+        lastCount = 0;
+        lastPulseTime = 0;
+    }
+};
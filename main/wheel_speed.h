@@ -0,0 +1,82 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "constants.h"
+
+/**
+ * Wheel speed from the periods between pulses instead of the number of pulses in a time window: the resolution does
+ * not depend on the window, and the speed is known from the second pulse. The median of the last
+ * MAGNETIC_SPEED_PERIODS periods removes isolated wrong periods (bounce, missed pulse). When no pulse comes, the speed
+ * decreases as the time since the last pulse grows, and drops to 0 after MAGNETIC_SPEED_TIMEOUT_US.
+ */
+class WheelSpeedEstimator {
+    uint32_t periods[MAGNETIC_SPEED_PERIODS];  // us per pulse
+    size_t periodCount{0};
+    size_t nextPeriod{0};
+    uint64_t lastPulseTime{0};  // us
+
+    /** Median of the stored periods. */
+    uint32_t medianPeriod() const {
+        uint32_t sorted[MAGNETIC_SPEED_PERIODS];
+        for (size_t i = 0; i < periodCount; i++) {
+            // Insertion sort, only a few values
+            size_t j = i;
+            while (j > 0 && sorted[j - 1] > periods[i]) {
+                sorted[j] = sorted[j - 1];
+                j--;
+            }
+            sorted[j] = periods[i];
+        }
+        return sorted[periodCount / 2];
+    }
+
+   public:
+    /** Forget all pulses, e.g. when the counter is reset. */
+    void reset() {
+        periodCount = nextPeriod = 0;
+        lastPulseTime = 0;
+    }
+
+    /**
+     * Add pulses received since the last call.
+     * @param pulses Number of pulses, 1 when each pulse is timestamped.
+     * @param time Time of the last pulse in us.
+     */
+    void addPulses(uint32_t pulses, uint64_t time) {
+        if (pulses == 0 || time <= lastPulseTime) {
+            return;
+        }
+
+        if (lastPulseTime != 0) {
+            uint64_t period = (time - lastPulseTime) / pulses;
+            if (period < MAGNETIC_SPEED_TIMEOUT_US) {
+                periods[nextPeriod] = period;
+                nextPeriod = (nextPeriod + 1) % MAGNETIC_SPEED_PERIODS;
+                periodCount = periodCount < MAGNETIC_SPEED_PERIODS ? periodCount + 1 : periodCount;
+            } else {
+                periodCount = nextPeriod = 0;  // Restart after a stop, the periods before are not relevant
+            }
+        }
+        lastPulseTime = time;
+    }
+
+    /**
+     * Current speed.
+     * @param now Current time in us.
+     * @param distancePerPulse Distance between two pulses in mm.
+     * @return Speed in km/h.
+     */
+    float getSpeed(uint64_t now, float distancePerPulse) const {
+        if (periodCount == 0 || now - lastPulseTime >= MAGNETIC_SPEED_TIMEOUT_US) {
+            return 0.0f;
+        }
+
+        // Slowing down: the next period is at least the time since the last pulse
+        uint64_t period = medianPeriod();
+        uint64_t elapsed = now > lastPulseTime ? now - lastPulseTime : 0;
+        period = elapsed > period ? elapsed : period;
+        return distancePerPulse / period * 3600.0f;
+    }
+};
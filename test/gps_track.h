@@ -0,0 +1,209 @@
+#pragma once
+
+// Synthetic GPS captures for the replay tests: a reference track integrated finely, sampled at the rate of the
+// receiver and formatted as the ATGM336H outputs it, in NMEA or CASIC.
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <random>
+#include <string>
+#include <vector>
+
+#include "casic.h"
+
+/** Part of a track at constant speed, optionally turning. */
+struct TrackLeg {
+    double duration;  // s
+    double speed;     // km/h
+    double turnRate;  // deg/s, 0 for a straight line
+};
+
+/** Fix of the receiver along a track. */
+struct TrackFix {
+    uint32_t time;     // ms since midnight
+    double latitude;   // deg
+    double longitude;  // deg
+    double altitude;   // m
+    double speed;      // km/h
+    double course;     // deg
+    bool hasFix;
+};
+
+/** Fixes of a track and its exact length. */
+struct Track {
+    std::vector<TrackFix> fixes;
+    double distance{0.0};  // m, along the reference path up to the last fix (not the chords between fixes)
+};
+
+/** Options of a synthetic track. */
+struct TrackOptions {
+    double latitude{46.5};     // deg, start
+    double longitude{6.6};     // deg, start
+    double course{30.0};       // deg, start
+    uint32_t startTime{36'000'000};  // ms since midnight (10:00:00)
+    uint32_t period{100};      // ms between fixes, 10 Hz
+    double positionNoise{0.0};  // m, standard deviation of the position error of each fix
+    double speedNoise{0.0};     // km/h, standard deviation of the speed error of each fix
+    double climbRate{0.0};      // m/s, to change the altitude at each fix
+    uint32_t seed{1};
+};
+
+constexpr double TRACK_EARTH_RADIUS = 6371009.0;  // m, sphere of GEO_EARTH_RADIUS and TinyGPS++
+
+/** Move a position along a great circle. */
+inline void trackMove(double& latitude, double& longitude, double course, double distance) {
+    double lat = latitude * M_PI / 180, lon = longitude * M_PI / 180, bearing = course * M_PI / 180;
+    double angle = distance / TRACK_EARTH_RADIUS;
+    double lat2 = asin(sin(lat) * cos(angle) + cos(lat) * sin(angle) * cos(bearing));
+    double lon2 = lon + atan2(sin(bearing) * sin(angle) * cos(lat), cos(angle) - sin(lat) * sin(lat2));
+    latitude = lat2 * 180 / M_PI;
+    longitude = remainder(lon2 * 180 / M_PI, 360.0);
+}
+
+/**
+ * Build a track: the path is integrated every millisecond, so that corners are round, and sampled every period.
+ * @param legs Parts of the track, in order.
+ */
+inline Track makeTrack(const std::vector<TrackLeg>& legs, const TrackOptions& options = {}) {
+    Track track;
+    std::mt19937 random(options.seed);
+    std::normal_distribution<double> noise(0.0, 1.0);
+
+    double latitude = options.latitude, longitude = options.longitude, course = options.course, altitude = 400.0;
+    uint32_t time = options.startTime;
+    uint32_t elapsed = 0;
+    double travelled = 0.0;
+    for (const TrackLeg& leg : legs) {
+        uint32_t legEnd = elapsed + static_cast<uint32_t>(leg.duration * 1000);
+        for (; elapsed < legEnd; elapsed++, time++) {
+            if (elapsed % options.period == 0) {
+                TrackFix fix{time, latitude, longitude, altitude, leg.speed, fmod(course + 360.0, 360.0), true};
+                if (options.positionNoise > 0.0) {
+                    trackMove(fix.latitude, fix.longitude, 360.0 * random() / random.max(),
+                              fabs(noise(random)) * options.positionNoise);
+                }
+                if (options.speedNoise > 0.0) {
+                    fix.speed = fmax(0.0, fix.speed + noise(random) * options.speedNoise);
+                }
+                track.fixes.push_back(fix);
+                track.distance = travelled;
+                altitude += options.climbRate * options.period / 1000.0;
+            }
+            double step = leg.speed / 3.6 / 1000.0;
+            trackMove(latitude, longitude, course, step);
+            travelled += step;
+            course += leg.turnRate / 1000.0;
+        }
+    }
+    return track;
+}
+
+/** Wrap a sentence body between `$` and its checksum. */
+inline std::string nmeaSentence(const std::string& body) {
+    uint8_t checksum = 0;
+    for (char c : body) {
+        checksum ^= c;
+    }
+    char end[8];
+    snprintf(end, sizeof(end), "*%02X\r\n", checksum);
+    return "$" + body + end;
+}
+
+/** Coordinate in the NMEA format (d)ddmm.mmmmm and its hemisphere. */
+inline std::string nmeaCoordinate(double degrees, int degreeDigits, char positive, char negative) {
+    double absolute = fabs(degrees);
+    int whole = static_cast<int>(absolute);
+    double minutes = (absolute - whole) * 60.0;
+    char text[32];
+    snprintf(text, sizeof(text), "%0*d%08.5f,%c", degreeDigits, whole, minutes, degrees < 0 ? negative : positive);
+    return text;
+}
+
+/** Time in the NMEA format hhmmss.ss. */
+inline std::string nmeaTime(uint32_t time) {
+    char text[16];
+    snprintf(text, sizeof(text), "%02u%02u%02u.%02u", time / 3'600'000 % 24, time / 60'000 % 60, time / 1000 % 60,
+             time / 10 % 100);
+    return text;
+}
+
+inline std::string ggaSentence(const TrackFix& fix) {
+    char text[128];
+    snprintf(text, sizeof(text), "GNGGA,%s,%s,%s,%d,12,0.8,%.1f,M,0.0,M,,", nmeaTime(fix.time).c_str(),
+             nmeaCoordinate(fix.latitude, 2, 'N', 'S').c_str(), nmeaCoordinate(fix.longitude, 3, 'E', 'W').c_str(),
+             fix.hasFix ? 1 : 0, fix.altitude);
+    return nmeaSentence(text);
+}
+
+inline std::string rmcSentence(const TrackFix& fix) {
+    char text[128];
+    snprintf(text, sizeof(text), "GNRMC,%s,%c,%s,%s,%.3f,%.2f,170426,,,A", nmeaTime(fix.time).c_str(),
+             fix.hasFix ? 'A' : 'V', nmeaCoordinate(fix.latitude, 2, 'N', 'S').c_str(),
+             nmeaCoordinate(fix.longitude, 3, 'E', 'W').c_str(), fix.speed / 1.852, fix.course);
+    return nmeaSentence(text);
+}
+
+/** Sentences of a track, GGA then RMC for each fix as output by the receiver configured at startup. */
+inline std::vector<std::string> nmeaCapture(const Track& track) {
+    std::vector<std::string> sentences;
+    for (const TrackFix& fix : track.fixes) {
+        sentences.push_back(ggaSentence(fix));
+        sentences.push_back(rmcSentence(fix));
+    }
+    return sentences;
+}
+
+/** Write a value in a little endian CASIC payload. */
+template <typename T>
+void casicWrite(std::vector<uint8_t>& payload, size_t offset, T value) {
+    memcpy(&payload[offset], &value, sizeof(T));
+}
+
+/** CASIC frame of a payload, as built by the receiver. */
+inline std::string casicFrame(uint8_t messageClass, uint8_t messageId, const std::vector<uint8_t>& payload) {
+    std::string frame(payload.size() + CASIC_FRAME_OVERHEAD, '\0');
+    CasicDecoder::encodeFrame(messageClass, messageId, payload.data(), payload.size(),
+                              reinterpret_cast<uint8_t*>(frame.data()));
+    return frame;
+}
+
+/** NAV-PV frame of a fix. */
+inline std::string navPvFrame(const TrackFix& fix, uint32_t runTime) {
+    std::vector<uint8_t> payload(CASIC_NAV_PV_SIZE, 0);
+    uint8_t valid = fix.hasFix ? 7 : 0;  // 3D fix
+    casicWrite<uint32_t>(payload, CASIC_NAV_PV_RUN_TIME, runTime);
+    casicWrite<uint8_t>(payload, CASIC_NAV_PV_POS_VALID, valid);
+    casicWrite<uint8_t>(payload, CASIC_NAV_PV_VEL_VALID, valid);
+    casicWrite<uint8_t>(payload, CASIC_NAV_PV_NUM_SV, 12);
+    casicWrite<float>(payload, CASIC_NAV_PV_PDOP, 1.2f);
+    casicWrite<double>(payload, CASIC_NAV_PV_LON, fix.longitude);
+    casicWrite<double>(payload, CASIC_NAV_PV_LAT, fix.latitude);
+    casicWrite<float>(payload, CASIC_NAV_PV_HEIGHT, fix.altitude);
+    casicWrite<float>(payload, CASIC_NAV_PV_SPEED_2D, fix.speed / 3.6);
+    casicWrite<float>(payload, CASIC_NAV_PV_HEADING, fix.course);
+    return casicFrame(CASIC_CLASS_NAV, CASIC_ID_NAV_PV, payload);
+}
+
+/** NAV-TIMEUTC frame of a fix. */
+inline std::string navTimeUtcFrame(const TrackFix& fix) {
+    std::vector<uint8_t> payload(CASIC_NAV_TIMEUTC_SIZE, 0);
+    casicWrite<uint16_t>(payload, CASIC_NAV_TIMEUTC_MS, fix.time % 1000);
+    casicWrite<uint8_t>(payload, CASIC_NAV_TIMEUTC_HOUR, fix.time / 3'600'000 % 24);
+    casicWrite<uint8_t>(payload, CASIC_NAV_TIMEUTC_MINUTE, fix.time / 60'000 % 60);
+    casicWrite<uint8_t>(payload, CASIC_NAV_TIMEUTC_SECOND, fix.time / 1000 % 60);
+    casicWrite<uint8_t>(payload, CASIC_NAV_TIMEUTC_VALID, fix.hasFix ? 1 : 0);
+    return casicFrame(CASIC_CLASS_NAV, CASIC_ID_NAV_TIMEUTC, payload);
+}
+
+/** Frames of a track, NAV-PV then NAV-TIMEUTC for each fix as output by the receiver configured in CASIC mode. */
+inline std::string casicCapture(const Track& track) {
+    std::string capture;
+    for (const TrackFix& fix : track.fixes) {
+        capture += navPvFrame(fix, fix.time - track.fixes.front().time);
+        capture += navTimeUtcFrame(fix);
+    }
+    return capture;
+}
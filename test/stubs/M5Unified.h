@@ -0,0 +1,14 @@
+#pragma once
+
+// Host stub of M5Unified: only the logging macros, errors and warnings are printed. The C library headers included
+// by M5Unified on the target are included too.
+
+#include <stdlib.h>
+#include <string.h>
+
+void hostLog(char level, const char* format, ...);
+
+#define M5_LOGE(format, ...) hostLog('E', format, ##__VA_ARGS__)
+#define M5_LOGW(format, ...) hostLog('W', format, ##__VA_ARGS__)
+#define M5_LOGI(format, ...) hostLog('I', format, ##__VA_ARGS__)
+#define M5_LOGD(format, ...) hostLog('D', format, ##__VA_ARGS__)
@@ -0,0 +1,5 @@
+#pragma once
+
+// Placement attributes have no meaning on the host
+#define IRAM_ATTR
+#define RTC_NOINIT_ATTR
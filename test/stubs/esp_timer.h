@@ -0,0 +1,6 @@
+#pragma once
+
+#include <stdint.h>
+
+/** Time since boot in us, set by the tests with `host::now`. */
+int64_t esp_timer_get_time();
@@ -0,0 +1,379 @@
+#include "host.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <mutex>
+
+#include "driver/pulse_cnt.h"
+#include "driver/uart.h"
+#include "esp_partition.h"
+#include "esp_rom_crc.h"
+#include "esp_timer.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include "nvs.h"
+
+namespace host {
+
+int64_t now{1};
+esp_reset_reason_t resetReason{ESP_RST_POWERON};
+
+Task mainTask;
+thread_local Task* currentTask{&mainTask};
+
+std::map<std::string, NvsEntry> nvs;
+bool nvsFailsWrites{false};
+uint32_t nvsCommits{0};
+std::function<void()> nvsOnCommit;
+
+std::vector<uint8_t> flash;
+bool hasJournalPartition{true};
+long flashBudget{-1};
+esp_partition_t journalPartition{ESP_PARTITION_TYPE_DATA, static_cast<esp_partition_subtype_t>(0x40), 0x190000, 0, 0,
+                                 "journal"};
+
+std::deque<uint8_t> uartReceived;
+std::string uartSent;
+
+int pcntCount{0};
+
+gpio_isr_t isrHandlers[GPIO_NUM_MAX]{};
+void* isrArgs[GPIO_NUM_MAX]{};
+
+void resetNvs() {
+    nvs.clear();
+    nvsFailsWrites = false;
+    nvsCommits = 0;
+    nvsOnCommit = nullptr;
+}
+
+void resetFlash(uint32_t size, uint32_t eraseSize) {
+    flash.assign(size, 0xFF);
+    journalPartition.size = size;
+    journalPartition.erase_size = eraseSize;
+    hasJournalPartition = true;
+    flashBudget = -1;
+}
+
+void uartReceive(const std::string& data) { uartReceived.insert(uartReceived.end(), data.begin(), data.end()); }
+
+void resetUart() {
+    uartReceived.clear();
+    uartSent.clear();
+}
+
+void gpioInterrupt(gpio_num_t pin) {
+    if (isrHandlers[pin] != nullptr) {
+        isrHandlers[pin](isrArgs[pin]);
+    }
+}
+
+/** Consume one byte of the flash budget, or cut the power. */
+void spendFlashBudget() {
+    if (flashBudget == 0) {
+        throw PowerCut();
+    }
+    if (flashBudget > 0) {
+        flashBudget--;
+    }
+}
+
+}  // namespace host
+
+// Logging
+
+void hostLog(char level, const char* format, ...) {
+    if (level != 'E' && level != 'W') {
+        return;
+    }
+    va_list args;
+    va_start(args, format);
+    fprintf(stderr, "%c: ", level);
+    vfprintf(stderr, format, args);
+    fputc('\n', stderr);
+    va_end(args);
+}
+
+const char* esp_err_to_name(esp_err_t code) { return code == ESP_OK ? "ESP_OK" : "ESP_FAIL"; }
+
+// Time and system
+
+int64_t esp_timer_get_time() { return host::now; }
+
+esp_reset_reason_t esp_reset_reason() { return host::resetReason; }
+
+uint32_t esp_rom_crc32_le(uint32_t crc, const uint8_t* buf, uint32_t len) {
+    crc = ~crc;
+    for (uint32_t i = 0; i < len; i++) {
+        crc ^= buf[i];
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc >> 1) ^ (0xEDB88320 & (0 - (crc & 1)));
+        }
+    }
+    return ~crc;
+}
+
+// FreeRTOS
+
+struct QueueDefinition {
+    std::timed_mutex mutex;
+    std::atomic<uint32_t> takes{0};
+};
+
+uint32_t host::mutexTakes(SemaphoreHandle_t mutex) { return mutex->takes; }
+
+SemaphoreHandle_t xSemaphoreCreateMutex() { return new QueueDefinition; }
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t semaphore, TickType_t ticksToWait) {
+    if (!semaphore->mutex.try_lock_for(std::chrono::milliseconds(uint64_t{ticksToWait} * portTICK_PERIOD_MS))) {
+        return pdFALSE;
+    }
+    semaphore->takes++;
+    return pdTRUE;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t semaphore) {
+    semaphore->mutex.unlock();
+    return pdTRUE;
+}
+
+void vSemaphoreDelete(SemaphoreHandle_t semaphore) { delete semaphore; }
+
+BaseType_t xQueueReceive(QueueHandle_t, void*, TickType_t) { return pdFALSE; }
+
+BaseType_t xQueueReset(QueueHandle_t) { return pdPASS; }
+
+TaskHandle_t xTaskGetCurrentTaskHandle() { return host::currentTask; }
+
+BaseType_t xTaskNotify(TaskHandle_t task, uint32_t value, eNotifyAction action) {
+    if (action == eSetBits) {
+        task->value |= value;
+    }
+    task->notifications++;
+    return pdPASS;
+}
+
+BaseType_t xTaskNotifyFromISR(TaskHandle_t task, uint32_t value, eNotifyAction action, BaseType_t*) {
+    return xTaskNotify(task, value, action);
+}
+
+BaseType_t xTaskNotifyWait(uint32_t bitsToClearOnEntry, uint32_t bitsToClearOnExit, uint32_t* notificationValue,
+                           TickType_t) {
+    host::Task* task = host::currentTask;
+    uint32_t value = task->value.fetch_and(~bitsToClearOnExit);
+    if (notificationValue != nullptr) {
+        *notificationValue = value;
+    }
+    return value != 0 ? pdPASS : pdFAIL;
+}
+
+void vTaskDelay(TickType_t) {}
+
+// NVS
+
+esp_err_t nvs_open(const char*, nvs_open_mode_t, nvs_handle_t* out_handle) {
+    *out_handle = 1;
+    return ESP_OK;
+}
+
+void nvs_close(nvs_handle_t) {}
+
+esp_err_t nvs_commit(nvs_handle_t) {
+    if (host::nvsOnCommit) {
+        host::nvsOnCommit();
+    }
+    if (host::nvsFailsWrites) {
+        return ESP_FAIL;
+    }
+    host::nvsCommits++;
+    return ESP_OK;
+}
+
+esp_err_t nvs_erase_key(nvs_handle_t, const char* key) {
+    return host::nvs.erase(key) > 0 ? ESP_OK : ESP_ERR_NVS_NOT_FOUND;
+}
+
+static esp_err_t setEntry(const char* key, char type, const void* value, size_t length) {
+    if (host::nvsFailsWrites) {
+        return ESP_FAIL;
+    }
+    const uint8_t* bytes = static_cast<const uint8_t*>(value);
+    host::nvs[key] = {type, std::vector<uint8_t>(bytes, bytes + length)};
+    return ESP_OK;
+}
+
+/** Read an entry of a fixed size type: an entry of another type is not found, like with the real NVS. */
+static esp_err_t getEntry(const char* key, char type, void* value, size_t length) {
+    auto entry = host::nvs.find(key);
+    if (entry == host::nvs.end() || entry->second.type != type) {
+        return ESP_ERR_NVS_NOT_FOUND;
+    }
+    memcpy(value, entry->second.data.data(), length);
+    return ESP_OK;
+}
+
+esp_err_t nvs_set_i8(nvs_handle_t, const char* key, int8_t value) { return setEntry(key, 'i', &value, 1); }
+esp_err_t nvs_set_u8(nvs_handle_t, const char* key, uint8_t value) { return setEntry(key, 'b', &value, 1); }
+esp_err_t nvs_set_u16(nvs_handle_t, const char* key, uint16_t value) { return setEntry(key, 'h', &value, 2); }
+esp_err_t nvs_set_u32(nvs_handle_t, const char* key, uint32_t value) { return setEntry(key, 'w', &value, 4); }
+
+esp_err_t nvs_set_blob(nvs_handle_t, const char* key, const void* value, size_t length) {
+    return setEntry(key, 'B', value, length);
+}
+
+esp_err_t nvs_get_i8(nvs_handle_t, const char* key, int8_t* out_value) { return getEntry(key, 'i', out_value, 1); }
+esp_err_t nvs_get_u8(nvs_handle_t, const char* key, uint8_t* out_value) { return getEntry(key, 'b', out_value, 1); }
+esp_err_t nvs_get_u16(nvs_handle_t, const char* key, uint16_t* out_value) { return getEntry(key, 'h', out_value, 2); }
+esp_err_t nvs_get_u32(nvs_handle_t, const char* key, uint32_t* out_value) { return getEntry(key, 'w', out_value, 4); }
+
+esp_err_t nvs_get_blob(nvs_handle_t, const char* key, void* out_value, size_t* length) {
+    auto entry = host::nvs.find(key);
+    if (entry == host::nvs.end() || entry->second.type != 'B') {
+        return ESP_ERR_NVS_NOT_FOUND;
+    }
+    const std::vector<uint8_t>& data = entry->second.data;
+    if (out_value == nullptr) {
+        *length = data.size();
+        return ESP_OK;
+    }
+    if (*length < data.size()) {
+        return ESP_ERR_NVS_INVALID_LENGTH;
+    }
+    memcpy(out_value, data.data(), data.size());
+    *length = data.size();
+    return ESP_OK;
+}
+
+// Flash partition
+
+const esp_partition_t* esp_partition_find_first(esp_partition_type_t type, esp_partition_subtype_t subtype,
+                                                 const char* label) {
+    const esp_partition_t& partition = host::journalPartition;
+    if (!host::hasJournalPartition || partition.size == 0 || type != partition.type || subtype != partition.subtype ||
+        (label != nullptr && strcmp(label, partition.label) != 0)) {
+        return nullptr;
+    }
+    return &partition;
+}
+
+esp_err_t esp_partition_read(const esp_partition_t* partition, size_t src_offset, void* dst, size_t size) {
+    if (src_offset + size > partition->size) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    memcpy(dst, &host::flash[src_offset], size);
+    return ESP_OK;
+}
+
+esp_err_t esp_partition_write(const esp_partition_t* partition, size_t dst_offset, const void* src, size_t size) {
+    if (dst_offset + size > partition->size) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    const uint8_t* bytes = static_cast<const uint8_t*>(src);
+    for (size_t i = 0; i < size; i++) {
+        host::spendFlashBudget();
+        host::flash[dst_offset + i] &= bytes[i];
+    }
+    return ESP_OK;
+}
+
+esp_err_t esp_partition_erase_range(const esp_partition_t* partition, size_t offset, size_t size) {
+    if (offset % partition->erase_size != 0 || size % partition->erase_size != 0 || offset + size > partition->size) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    for (size_t i = 0; i < size; i++) {
+        host::spendFlashBudget();
+        host::flash[offset + i] = 0xFF;
+    }
+    return ESP_OK;
+}
+
+// UART
+
+esp_err_t uart_driver_install(uart_port_t, int, int, int, QueueHandle_t* uart_queue, int) {
+    *uart_queue = nullptr;
+    return ESP_OK;
+}
+
+esp_err_t uart_param_config(uart_port_t, const uart_config_t*) { return ESP_OK; }
+
+esp_err_t uart_set_pin(uart_port_t, int, int, int, int) { return ESP_OK; }
+
+esp_err_t uart_enable_pattern_det_baud_intr(uart_port_t, char, uint8_t, int, int, int) { return ESP_OK; }
+
+esp_err_t uart_pattern_queue_reset(uart_port_t, int) { return ESP_OK; }
+
+esp_err_t uart_get_buffered_data_len(uart_port_t, size_t* size) {
+    *size = host::uartReceived.size();
+    return ESP_OK;
+}
+
+int uart_read_bytes(uart_port_t, void* buf, uint32_t length, TickType_t) {
+    uint32_t count = length < host::uartReceived.size() ? length : host::uartReceived.size();
+    std::copy_n(host::uartReceived.begin(), count, static_cast<uint8_t*>(buf));
+    host::uartReceived.erase(host::uartReceived.begin(), host::uartReceived.begin() + count);
+    return count;
+}
+
+int uart_write_bytes(uart_port_t, const void* src, size_t size) {
+    host::uartSent.append(static_cast<const char*>(src), size);
+    return size;
+}
+
+esp_err_t uart_wait_tx_done(uart_port_t, TickType_t) { return ESP_OK; }
+
+esp_err_t uart_flush_input(uart_port_t) {
+    host::uartReceived.clear();
+    return ESP_OK;
+}
+
+// GPIO and PCNT
+
+esp_err_t gpio_config(const gpio_config_t*) { return ESP_OK; }
+
+esp_err_t gpio_install_isr_service(int) { return ESP_OK; }
+
+esp_err_t gpio_isr_handler_add(gpio_num_t gpio_num, gpio_isr_t isr_handler, void* args) {
+    host::isrHandlers[gpio_num] = isr_handler;
+    host::isrArgs[gpio_num] = args;
+    return ESP_OK;
+}
+
+esp_err_t gpio_pullup_en(gpio_num_t) { return ESP_OK; }
+
+esp_err_t pcnt_new_unit(const pcnt_unit_config_t*, pcnt_unit_handle_t* ret_unit) {
+    *ret_unit = reinterpret_cast<pcnt_unit_handle_t>(&host::pcntCount);
+    return ESP_OK;
+}
+
+esp_err_t pcnt_unit_set_glitch_filter(pcnt_unit_handle_t, const pcnt_glitch_filter_config_t*) { return ESP_OK; }
+
+esp_err_t pcnt_new_channel(pcnt_unit_handle_t, const pcnt_chan_config_t*, pcnt_channel_handle_t* ret_chan) {
+    *ret_chan = nullptr;
+    return ESP_OK;
+}
+
+esp_err_t pcnt_channel_set_edge_action(pcnt_channel_handle_t, pcnt_channel_edge_action_t, pcnt_channel_edge_action_t) {
+    return ESP_OK;
+}
+
+esp_err_t pcnt_unit_add_watch_point(pcnt_unit_handle_t, int) { return ESP_OK; }
+
+esp_err_t pcnt_unit_enable(pcnt_unit_handle_t) { return ESP_OK; }
+
+esp_err_t pcnt_unit_start(pcnt_unit_handle_t) { return ESP_OK; }
+
+esp_err_t pcnt_unit_clear_count(pcnt_unit_handle_t) {
+    host::pcntCount = 0;
+    return ESP_OK;
+}
+
+esp_err_t pcnt_unit_get_count(pcnt_unit_handle_t, int* value) {
+    *value = host::pcntCount;
+    return ESP_OK;
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "driver/gpio.h"
+#include "esp_system.h"
+#include "freertos/FreeRTOS.h"
+
+/** Task notified by the stubs of FreeRTOS, to check the notifications sent by the code under test. */
+struct tskTaskControlBlock {
+    std::atomic<uint32_t> value{0};          // Pending notification bits
+    std::atomic<uint32_t> notifications{0};  // Number of notifications received
+};
+
+/** Control of the host stubs by the tests. */
+namespace host {
+
+using Task = tskTaskControlBlock;
+
+// Time returned by esp_timer_get_time, in us
+extern int64_t now;
+
+// Reason returned by esp_reset_reason
+extern esp_reset_reason_t resetReason;
+
+// Task returned by xTaskGetCurrentTaskHandle on the current thread
+extern thread_local Task* currentTask;
+
+/** Number of times a mutex has been taken. */
+uint32_t mutexTakes(SemaphoreHandle_t mutex);
+
+// NVS entries of all the namespaces, with their type
+struct NvsEntry {
+    char type;  // 'i' (i8), 'b' (u8), 'h' (u16), 'w' (u32) or 'B' (blob)
+    std::vector<uint8_t> data;
+};
+extern std::map<std::string, NvsEntry> nvs;
+extern bool nvsFailsWrites;  // nvs_set_* and nvs_commit fail
+extern uint32_t nvsCommits;
+extern std::function<void()> nvsOnCommit;  // Called by nvs_commit, to act while a save is in progress
+void resetNvs();
+
+// Flash of the journal partition. The writes AND the bits like the NOR flash, erased bytes are 0xFF.
+extern std::vector<uint8_t> flash;
+extern bool hasJournalPartition;
+extern long flashBudget;  // Bytes written or erased before a power cut, -1 for no power cut
+void resetFlash(uint32_t size = 0x10000, uint32_t eraseSize = 0x1000);
+
+/** Thrown by the partition functions when `flashBudget` is exhausted, in the middle of a write or an erase. */
+struct PowerCut {};
+
+// UART
+void uartReceive(const std::string& data);
+extern std::string uartSent;
+void resetUart();
+
+// PCNT count of the fake unit
+extern int pcntCount;
+
+/** Call the interrupt handler of a GPIO, at the current time. */
+void gpioInterrupt(gpio_num_t pin);
+
+}  // namespace host
@@ -0,0 +1,125 @@
+#include "calibration.h"
+
+#include <gtest/gtest.h>
+#include <math.h>
+
+#include <functional>
+#include <vector>
+
+namespace {
+
+/** Straight line at 36 km/h: a fix of 1 m every 100 ms, with a good HDOP. */
+class WheelCalibrationTest : public ::testing::Test {
+   protected:
+    WheelCalibration calibration;
+    GpsData fix;
+    uint64_t now{1'000'000};
+
+    void SetUp() override {
+        straight();
+        calibration.start();
+        fixes(1);  // Starts the first segment
+    }
+
+    void straight() {
+        fix.hasLocation = fix.hasSpeed = fix.hasCourse = fix.hasHdop = true;
+        fix.speed = 36.0f;
+        fix.course = 90.0f;
+        fix.hdop = 0.8f;
+    }
+
+    void fixes(int count) {
+        for (int i = 0; i < count; i++) {
+            now += 100'000;
+            calibration.updateGps(fix, 1.0f, now);
+        }
+    }
+
+    /** Ride a whole segment with a number of wheel revolutions: a sample of 200 m divided by the revolutions. */
+    void segment(uint32_t revolutions) {
+        calibration.addPulses(revolutions, 1);
+        fixes(static_cast<int>(CALIBRATION_SEGMENT_DISTANCE));
+    }
+};
+
+// Welford's running mean and variance match the two-pass computation over the same samples.
+TEST_F(WheelCalibrationTest, WelfordMeanAndConfidence) {
+    std::vector<uint32_t> revolutions{100, 98, 102, 99, 101, 100, 97};
+    std::vector<double> samples;
+    for (uint32_t count : revolutions) {
+        segment(count);
+        samples.push_back(CALIBRATION_SEGMENT_DISTANCE * 1000.0 / count);
+
+        WheelCalibrationResult result = calibration.getResult();
+        EXPECT_EQ(result.segments, samples.size());
+        EXPECT_EQ(result.hasSuggestion, samples.size() >= CALIBRATION_MIN_SEGMENTS);
+    }
+
+    double mean = 0.0;
+    for (double sample : samples) {
+        mean += sample / samples.size();
+    }
+    double variance = 0.0;
+    for (double sample : samples) {
+        variance += (sample - mean) * (sample - mean) / (samples.size() - 1);
+    }
+    WheelCalibrationResult result = calibration.getResult();
+    EXPECT_NEAR(result.circumference, mean, mean * 1e-6);
+    EXPECT_NEAR(result.confidence, CALIBRATION_CONFIDENCE_Z * sqrt(variance / samples.size()), 1e-3);
+}
+
+// Samples outside of the wheel size limits (e.g. missed or extra pulses) are rejected, the estimation is unchanged.
+TEST_F(WheelCalibrationTest, OutOfRangeSamplesRejected) {
+    segment(100);
+    segment(10);   // 20 m
+    segment(250);  // 0.8 m
+    segment(0);
+    segment(100);
+
+    WheelCalibrationResult result = calibration.getResult();
+    EXPECT_EQ(result.segments, 2);
+    EXPECT_FLOAT_EQ(result.circumference, 2000.0f);
+    EXPECT_EQ(result.confidence, 0.0f);
+}
+
+// A segment is dropped on a poor fix, a turn, a low speed or a loss of fix: the revolutions counted in it are lost, the
+// next segment gives the exact sample.
+TEST_F(WheelCalibrationTest, PoorSegmentsDropped) {
+    std::vector<std::function<void()>> disturbances{
+        [&]() { fix.hdop = 5.0f; },
+        [&]() { fix.course = 110.0f; },
+        [&]() { fix.speed = CALIBRATION_MIN_SPEED - 1.0f; },
+        [&]() { now += CALIBRATION_MAX_FIX_INTERVAL_US; },
+    };
+    for (const std::function<void()>& disturb : disturbances) {
+        calibration.start();
+        fixes(1);
+        calibration.addPulses(37, 1);
+        fixes(100);
+
+        disturb();
+        fixes(1);
+        straight();
+        fixes(1);  // A new segment starts
+        segment(100);
+
+        WheelCalibrationResult result = calibration.getResult();
+        EXPECT_EQ(result.segments, 1);
+        EXPECT_FLOAT_EQ(result.circumference, 2000.0f);
+    }
+}
+
+// Stopped calibration: the result is kept, no new sample is added.
+TEST_F(WheelCalibrationTest, StopKeepsResult) {
+    segment(100);
+    calibration.stop();
+    EXPECT_FALSE(calibration.isActive());
+    segment(50);
+
+    WheelCalibrationResult result = calibration.getResult();
+    EXPECT_FALSE(result.isActive);
+    EXPECT_EQ(result.segments, 1);
+    EXPECT_FLOAT_EQ(result.circumference, 2000.0f);
+}
+
+}  // namespace
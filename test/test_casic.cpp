@@ -0,0 +1,191 @@
+#include "casic.h"
+
+#include <gtest/gtest.h>
+
+#include <chrono>
+
+#include "gps_track.h"
+#include "host.h"
+#include "process_gps.h"
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+/** Feed bytes to a decoder. @return Number of complete frames. */
+size_t decode(CasicDecoder& decoder, const std::string& data) {
+    size_t frames = 0;
+    for (char c : data) {
+        frames += decoder.encode(c) ? 1 : 0;
+    }
+    return frames;
+}
+
+TrackFix sampleFix() {
+    return {45'296'700, -33.8688197, 151.2092955, 58.3, 87.5, 271.25, true};  // 12:34:56.700 in Sydney
+}
+
+TEST(CasicTest, NavPvRoundTrip) {
+    TrackFix fix = sampleFix();
+    CasicDecoder decoder;
+    ASSERT_EQ(decode(decoder, navPvFrame(fix, 123'456)), 1u);
+
+    ASSERT_TRUE(decoder.isNavigationUpdated());
+    EXPECT_FALSE(decoder.isNavigationUpdated());
+    EXPECT_FALSE(decoder.isTimeUpdated());
+    const CasicNavigation& nav = decoder.navigation();
+    EXPECT_EQ(nav.runTime, 123'456u);
+    EXPECT_TRUE(nav.positionValid);
+    EXPECT_TRUE(nav.velocityValid);
+    EXPECT_EQ(nav.satellites, 12);
+    EXPECT_FLOAT_EQ(nav.dop, 1.2f);
+    EXPECT_DOUBLE_EQ(nav.latitude, fix.latitude);  // Doubles in the payload: no loss
+    EXPECT_DOUBLE_EQ(nav.longitude, fix.longitude);
+    EXPECT_FLOAT_EQ(nav.altitude, fix.altitude);
+    EXPECT_FLOAT_EQ(nav.speed, fix.speed / 3.6);
+    EXPECT_FLOAT_EQ(nav.heading, fix.course);
+
+    // Without fix, the values are not valid
+    fix.hasFix = false;
+    ASSERT_EQ(decode(decoder, navPvFrame(fix, 123'556)), 1u);
+    EXPECT_FALSE(decoder.navigation().positionValid);
+    EXPECT_FALSE(decoder.navigation().velocityValid);
+}
+
+TEST(CasicTest, NavTimeUtcRoundTrip) {
+    TrackFix fix = sampleFix();
+    CasicDecoder decoder;
+    ASSERT_EQ(decode(decoder, navTimeUtcFrame(fix)), 1u);
+
+    ASSERT_TRUE(decoder.isTimeUpdated());
+    EXPECT_FALSE(decoder.isNavigationUpdated());
+    const CasicNavigation& nav = decoder.navigation();
+    EXPECT_TRUE(nav.timeValid);
+    EXPECT_EQ(nav.hour, 12);
+    EXPECT_EQ(nav.minute, 34);
+    EXPECT_EQ(nav.second, 56);
+    EXPECT_EQ(nav.millisecond, 700);
+}
+
+// The CFG-MSG frame sent to the receiver is a valid frame with the class, id and rate of the enabled message.
+TEST(CasicTest, CfgMsgRoundTrip) {
+    host::resetUart();
+    enableCasicMessage(CASIC_CLASS_NAV, CASIC_ID_NAV_PV);
+    const std::string& frame = host::uartSent;
+
+    ASSERT_EQ(frame.size(), 4u + CASIC_FRAME_OVERHEAD);
+    const uint8_t header[]{CASIC_HEADER_1, CASIC_HEADER_2, 4, 0, CASIC_CLASS_CFG, CASIC_ID_CFG_MSG,
+                           CASIC_CLASS_NAV, CASIC_ID_NAV_PV, 1, 0};
+    EXPECT_EQ(memcmp(frame.data(), header, sizeof(header)), 0);
+    uint32_t checksum;
+    memcpy(&checksum, &frame[10], sizeof(checksum));
+    EXPECT_EQ(checksum, CasicDecoder::checksum(CASIC_CLASS_CFG, CASIC_ID_CFG_MSG,
+                                               reinterpret_cast<const uint8_t*>(&frame[6]), 4));
+
+    CasicDecoder decoder;
+    EXPECT_EQ(decode(decoder, frame), 1u);
+    EXPECT_EQ(decoder.passedChecksum(), 1u);
+    EXPECT_FALSE(decoder.isNavigationUpdated());  // Not a navigation message
+}
+
+// Corrupted frames are rejected, and the decoder resynchronizes on the next header after garbage.
+TEST(CasicTest, CorruptedFramesRejected) {
+    TrackFix fix = sampleFix();
+    std::string corrupted = navPvFrame(fix, 1);
+    corrupted[CASIC_FRAME_OVERHEAD - 4 + CASIC_NAV_PV_LAT] ^= 0x10;
+    std::string tooLong = navPvFrame(fix, 2);
+    tooLong[2] = static_cast<char>(CASIC_MAX_PAYLOAD_SIZE + 4);
+
+    CasicDecoder decoder;
+    std::string garbage("\xBA\x01\xBA\xBA$GNRMC,", 11);
+    EXPECT_EQ(decode(decoder, garbage + corrupted + tooLong + garbage + navPvFrame(fix, 3)), 1u);
+    EXPECT_EQ(decoder.failedChecksum(), 1u);
+    EXPECT_EQ(decoder.navigation().runTime, 3u);
+    EXPECT_DOUBLE_EQ(decoder.navigation().latitude, fix.latitude);
+}
+
+// The frames of a track update the shared state as the NMEA sentences of the same track do.
+TEST(CasicTest, SameDistanceAsNmea) {
+    Track track = makeTrack({{60.0, 50.0, 0.0}, {20.0, 30.0, 9.0}});
+    auto replay = [&](const std::vector<std::string>& chunks, void (*read)(DistanceMode)) {
+        host::resetUart();
+        gpsOdometer.reset();
+        gpsDistanceRemainder = 0.0f;
+        sharedState.resetStageDistance();
+        for (size_t i = 0; i < chunks.size(); i++) {
+            host::now = 1'000'000 + static_cast<int64_t>(i / 2) * GPS_UPDATE_RATE_MS * 1000;
+            host::uartReceive(chunks[i]);
+            read(GPS);
+        }
+        return sharedState.getStageDistance();
+    };
+
+    std::vector<std::string> frames;
+    for (const TrackFix& fix : track.fixes) {
+        frames.push_back(navPvFrame(fix, fix.time - track.fixes.front().time));
+        frames.push_back(navTimeUtcFrame(fix));
+    }
+    int64_t casicDistance = replay(frames, readCasicFrames);
+    int64_t nmeaDistance = replay(nmeaCapture(track), readNmeaSentences);
+
+    EXPECT_NEAR(casicDistance / 1000.0, track.distance, track.distance * 0.005);
+    EXPECT_NEAR(casicDistance, nmeaDistance, nmeaDistance * 0.005);
+}
+
+// Decoding cost of the same fixes in CASIC and in NMEA (framer and TinyGPS++), per fix and in bytes on the UART.
+TEST(CasicTest, BenchmarkAgainstNmea) {
+    Track track = makeTrack({{60.0, 80.0, 2.0}}, {.positionNoise = 2.0, .climbRate = 0.5});
+    std::string binary = casicCapture(track);
+    std::string text;
+    for (const std::string& sentence : nmeaCapture(track)) {
+        text += sentence;
+    }
+    const int repeats = 20;
+
+    auto best = [&](auto parse) {
+        double seconds = 1e9;
+        for (int round = 0; round < 5; round++) {
+            Clock::time_point start = Clock::now();
+            for (int i = 0; i < repeats; i++) {
+                parse();
+            }
+            seconds = std::min(seconds, std::chrono::duration<double>(Clock::now() - start).count());
+        }
+        return seconds / repeats / track.fixes.size() * 1e9;  // ns per fix
+    };
+
+    CasicDecoder decoder;
+    size_t frames = 0;
+    double casicCost = best([&]() { frames += decode(decoder, binary); });
+
+    TinyGPSPlus parser;
+    NmeaFramer<GPS_NMEA_FRAMER_SIZE> framer;
+    double nmeaCost = best([&]() {
+        for (size_t offset = 0; offset < text.size();) {
+            size_t length;
+            char* buffer = framer.writeBuffer(length);
+            length = std::min(length, text.size() - offset);
+            memcpy(buffer, &text[offset], length);
+            framer.commit(length);
+            offset += length;
+            NmeaSentence sentence;
+            while (framer.next(sentence)) {
+                parser.encodeVerified(sentence.first, sentence.firstLength);
+                parser.encodeVerified(sentence.second, sentence.secondLength);
+            }
+        }
+    });
+
+    printf("%zu fixes:\n", track.fixes.size());
+    printf("  NMEA:  %5.1f bytes/fix, %7.1f ns/fix\n", double(text.size()) / track.fixes.size(), nmeaCost);
+    printf("  CASIC: %5.1f bytes/fix, %7.1f ns/fix (%.1fx faster)\n", double(binary.size()) / track.fixes.size(),
+           casicCost, nmeaCost / casicCost);
+    RecordProperty("nmea_ns_per_fix", std::to_string(nmeaCost));
+    RecordProperty("casic_ns_per_fix", std::to_string(casicCost));
+
+    EXPECT_EQ(frames, 2 * track.fixes.size() * repeats * 5);
+    EXPECT_EQ(decoder.failedChecksum(), 0u);
+    EXPECT_EQ(parser.passedChecksum(), 2 * track.fixes.size() * repeats * 5);
+}
+
+}  // namespace
@@ -0,0 +1,226 @@
+#include "fusion.h"
+
+#include <gtest/gtest.h>
+#include <math.h>
+
+#include <chrono>
+
+#include "host.h"
+
+namespace {
+
+/**
+ * Simulated ride for the fused mode: the magnetic process reports the wheel pulses every FUSION_LOOP_DELAY_MS, the GPS
+ * reports the distance and speed of each fix at 10 Hz.
+ */
+class FusedRide {
+    const float circumference;  // m, real
+    const float setting;        // mm, wheel size setting
+    double wheelTravel{0.0};    // m, traveled by the tire (more than the ground while spinning)
+    uint32_t countedPulses{0};
+    double lastFixDistance{0.0};
+
+   public:
+    uint64_t now{1'000'000};
+    double distance{0.0};  // m, real
+    double fused{0.0};     // m, reported
+
+    FusedRide(float circumference, float setting) : circumference(circumference), setting(setting) {
+        distanceFusion.reset();
+    }
+
+    /**
+     * Ride for a duration at a constant speed.
+     * @param spin Ratio of the wheel speed to the ground speed, above 1 while spinning.
+     */
+    void ride(double duration, float speed, bool hasGps = true, float spin = 1.0f) {
+        for (double t = 0.0; t < duration; t += FUSION_LOOP_DELAY_MS / 1000.0) {
+            now += FUSION_LOOP_DELAY_MS * 1000;
+            distance += speed / 3.6 * FUSION_LOOP_DELAY_MS / 1000.0;
+            wheelTravel += spin * speed / 3.6 * FUSION_LOOP_DELAY_MS / 1000.0;
+
+            // Pulses since the last update, and time of the last one
+            uint32_t pulses = static_cast<uint32_t>(wheelTravel / circumference) - countedPulses;
+            countedPulses += pulses;
+            double sinceLastPulse = (wheelTravel - countedPulses * circumference) / (spin * speed / 3.6);
+            fused += distanceFusion.updateWheel(pulses, now - static_cast<uint64_t>(sinceLastPulse * 1e6), setting);
+
+            if (hasGps) {
+                fused += distanceFusion.updateGps(distance - lastFixDistance, true, speed, now + 50'000);
+            }
+            lastFixDistance = distance;
+        }
+    }
+};
+
+// The wheel size setting is 5% too small: the correction is estimated from the GPS, the distance follows the GPS.
+TEST(DistanceFusionTest, EstimatesTireCircumference) {
+    FusedRide ride(2.10f, 2000.0f);
+    ride.ride(300.0, 60.0f);
+
+    EXPECT_NEAR(distanceFusion.getScale(), 1.05f, 0.005f);
+    EXPECT_NEAR(ride.fused, ride.distance, ride.distance * 0.002);
+    EXPECT_NEAR(distanceFusion.getSpeed(ride.now), 60.0f, 1.0f);
+}
+
+// GPS lost for a minute: the wheel alone with the estimated correction, then the GPS corrects the drift again.
+TEST(DistanceFusionTest, GpsDropout) {
+    FusedRide ride(2.10f, 2000.0f);
+    ride.ride(180.0, 60.0f);
+    double beforeDropout = ride.fused;
+
+    ride.ride(60.0, 45.0f, false);
+    EXPECT_NEAR(ride.fused - beforeDropout, 45.0 / 3.6 * 60.0, 45.0 / 3.6 * 60.0 * 0.01);
+    EXPECT_NEAR(distanceFusion.getSpeed(ride.now), 45.0f, 1.0f);  // From the wheel
+
+    ride.ride(60.0, 60.0f);
+    EXPECT_NEAR(ride.fused, ride.distance, ride.distance * 0.002);
+}
+
+// The wheel spins 40% faster than the ground for 10 s: the slip is detected, the GPS speed is integrated instead of the
+// wheel pulses, and the circumference correction is not corrupted.
+TEST(DistanceFusionTest, WheelSpin) {
+    FusedRide ride(2.10f, 2000.0f);
+    ride.ride(300.0, 50.0f);
+    float scale = distanceFusion.getScale();
+    double beforeSpin = ride.fused;
+
+    ride.ride(10.0, 40.0f, true, 1.4f);
+    EXPECT_GT(distanceFusion.getSlip(), FUSION_SLIP_THRESHOLD);
+    EXPECT_NEAR(distanceFusion.getSpeed(ride.now), 40.0f, 0.5f);  // From the GPS
+    EXPECT_NEAR(ride.fused - beforeSpin, 40.0 / 3.6 * 10.0, 40.0 / 3.6 * 10.0 * 0.05);
+
+    ride.ride(60.0, 50.0f);
+    EXPECT_LT(fabsf(distanceFusion.getSlip()), FUSION_SLIP_THRESHOLD);
+    EXPECT_NEAR(distanceFusion.getScale(), scale, 0.005f);
+    EXPECT_NEAR(ride.fused, ride.distance, ride.distance * 0.002);
+}
+
+// GGA fixes carry a location but no speed: they keep the last GPS speed and slip state.
+TEST(DistanceFusionTest, LocationOnlyFixKeepsSpeed) {
+    FusedRide ride(2.0f, 2000.0f);
+    ride.ride(20.0, 30.0f, true, 1.4f);
+    float slip = distanceFusion.getSlip();
+
+    distanceFusion.updateGps(0.0f, false, 0.0f, ride.now + 60'000);
+    EXPECT_EQ(distanceFusion.getSlip(), slip);
+    EXPECT_NEAR(distanceFusion.getSpeed(ride.now + 60'000), 30.0f, 0.5f);
+}
+
+// Fixed CPU budget: each update is a few floating point operations under the mutex.
+TEST(DistanceFusionTest, UpdateCost) {
+    distanceFusion.reset();
+    const int updates = 200'000;
+    uint64_t now = 1'000'000;
+    float total = 0.0f;
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < updates; i++) {
+        now += 20'000;
+        total += distanceFusion.updateWheel(1, now, 2000.0f);
+        if (i % 5 == 0) {
+            total += distanceFusion.updateGps(0.5f, true, 90.0f, now);
+        }
+    }
+    double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / updates;
+    printf("Fusion: %.1f ns per wheel update (with a GPS update every 5)\n", ns);
+    RecordProperty("ns_per_update", std::to_string(ns));
+    EXPECT_GT(total, 0.0f);
+    EXPECT_LT(ns, 5'000.0);
+}
+
+/**
+ * Simulated ride for the hybrid mode: the GPS counts the distance of its fixes at 10 Hz (and bridges gaps shorter than
+ * FUSION_GPS_TIMEOUT_US, as the GPS odometer does), the magnetic process reports the calibrated wheel distance every
+ * FUSION_LOOP_DELAY_MS in between.
+ */
+class HybridRide {
+    double lastFixDistance{0.0};
+    double lastWheelDistance{0.0};
+
+   public:
+    uint64_t now{1'000'000};
+    double distance{0.0};  // m, real
+    double total{0.0};     // m, GPS and wheel
+
+    HybridRide() { hybridOdometer.reset(); }
+
+    void ride(double duration, float speed, bool hasFix = true) {
+        for (double t = 0.0; t < duration; t += 0.1) {
+            now += 50'000;
+            distance += speed / 3.6 * 0.05;
+            total += hybridOdometer.updateWheel(distance - lastWheelDistance, now);
+            lastWheelDistance = distance;
+
+            now += 50'000;
+            distance += speed / 3.6 * 0.05;
+            if (hasFix) {
+                bool isContinued = hybridOdometer.updateGps(now);
+                total += isContinued ? distance - lastFixDistance : 0.0;  // Restarted from this fix otherwise
+                lastFixDistance = distance;
+            }
+        }
+    }
+};
+
+TEST(HybridOdometerTest, Tunnel) {
+    HybridRide ride;
+    ride.ride(60.0, 50.0f);
+    ride.ride(30.0, 50.0f, false);
+    EXPECT_FALSE(hybridOdometer.isCovered(ride.now));
+    ride.ride(60.0, 50.0f);
+
+    EXPECT_TRUE(hybridOdometer.isCovered(ride.now));
+    EXPECT_NEAR(ride.total, ride.distance, FUSION_MIN_STEP);
+}
+
+// Losses shorter than FUSION_GPS_TIMEOUT_US are bridged by the GPS, the held wheel distance is dropped.
+TEST(HybridOdometerTest, ShortLosses) {
+    HybridRide ride;
+    for (int i = 0; i < 10; i++) {
+        ride.ride(10.0, 70.0f);
+        ride.ride(1.5, 70.0f, false);
+    }
+    ride.ride(10.0, 70.0f);
+    EXPECT_NEAR(ride.total, ride.distance, FUSION_MIN_STEP);
+}
+
+// Losses just longer than FUSION_GPS_TIMEOUT_US, repeated: no gap and no double counting at each switch.
+TEST(HybridOdometerTest, RepeatedLosses) {
+    HybridRide ride;
+    for (int i = 0; i < 20; i++) {
+        ride.ride(3.0, 90.0f);
+        ride.ride(2.5, 90.0f, false);
+    }
+    ride.ride(3.0, 90.0f);
+    EXPECT_NEAR(ride.total, ride.distance, FUSION_MIN_STEP);
+}
+
+// The magnetic process reads the time, then the GPS process handles a fix before the magnetic process uses it: the
+// GPS still covers the distance, the speed is not taken from the wheel.
+TEST(HybridOdometerTest, TimeReadBeforeLastFix) {
+    HybridRide ride;
+    ride.ride(10.0, 50.0f);
+    EXPECT_TRUE(hybridOdometer.isCovered(ride.now - 1000));
+    EXPECT_EQ(hybridOdometer.updateWheel(1.0f, ride.now - 1000), 0.0f);
+}
+
+// No fix yet at startup: the wheel counts until the first fix.
+TEST(HybridOdometerTest, NoFixAtStart) {
+    HybridRide ride;
+    ride.ride(20.0, 30.0f, false);
+    ride.ride(20.0, 30.0f);
+    EXPECT_NEAR(ride.total, ride.distance, FUSION_MIN_STEP);
+}
+
+// Stopped in the tunnel: no distance while stopped, and the distance before the stop is not lost.
+TEST(HybridOdometerTest, StoppedWithoutFix) {
+    HybridRide ride;
+    ride.ride(30.0, 40.0f);
+    ride.ride(5.0, 40.0f, false);
+    ride.ride(120.0, 0.0f, false);
+    EXPECT_NEAR(ride.total, ride.distance, FUSION_MIN_STEP);
+    ride.ride(30.0, 40.0f);
+    EXPECT_NEAR(ride.total, ride.distance, FUSION_MIN_STEP);
+}
+
+}  // namespace
@@ -0,0 +1,185 @@
+#include "geo.h"
+
+#include <gtest/gtest.h>
+
+#include <chrono>
+
+#include "gps_track.h"
+#include "tinygps++/TinyGPS++.cpp"
+
+namespace {
+
+/** Position at a distance and bearing from a start, on the sphere of GEO_EARTH_RADIUS: the reference distance. */
+Position positionAt(double latitude, double longitude, double bearing, double distance) {
+    trackMove(latitude, longitude, bearing, distance);
+    return {toNanodegrees(latitude), toNanodegrees(longitude)};
+}
+
+struct Segment {
+    double latitude;   // deg, start
+    double longitude;  // deg, start
+    double bearing;    // deg
+    double distance;   // m, reference
+};
+
+/** Tolerance of a distance: relative, with an absolute floor for the rounding of the positions to nanodegrees. */
+double tolerance(double distance, double relative) { return fmax(distance * relative, 0.0003); }
+
+TEST(GeoTest, ToNanodegrees) {
+    EXPECT_EQ(toNanodegrees(46, 519'832'500, false), 46'519'832'500LL);
+    EXPECT_EQ(toNanodegrees(6, 632'273'333, true), -6'632'273'333LL);
+    EXPECT_EQ(toNanodegrees(-179.999999999), -179'999'999'999LL);
+    EXPECT_EQ(toNanodegrees(46.5198325), 46'519'832'500LL);
+}
+
+TEST(GeoTest, LongitudeDifferenceAcrossAntimeridian) {
+    EXPECT_EQ(longitudeDifference(toNanodegrees(179.9999), toNanodegrees(-179.9999)), toNanodegrees(0.0002));
+    EXPECT_EQ(longitudeDifference(toNanodegrees(-179.9999), toNanodegrees(179.9999)), toNanodegrees(-0.0002));
+    EXPECT_EQ(longitudeDifference(toNanodegrees(10.0), toNanodegrees(-20.0)), toNanodegrees(-30.0));
+}
+
+// Short segments keep their precision: a float latitude would have a resolution of about 1 m at these longitudes.
+TEST(GeoTest, DistanceBetweenShortSegments) {
+    for (double distance : {0.01, 0.1, 0.6, 1.0, 2.5, 10.0, 27.8}) {
+        for (double bearing : {0.0, 45.0, 90.0, 200.0}) {
+            Position from{toNanodegrees(46.5198325), toNanodegrees(6.6322733)};
+            Position to = positionAt(46.5198325, 6.6322733, bearing, distance);
+            EXPECT_NEAR(distanceBetween(from, to), distance, tolerance(distance, 1e-4))
+                << distance << " m at " << bearing << " deg";
+        }
+    }
+}
+
+// Latitudes up to ±70°, where a degree of longitude is a third of a degree of latitude.
+TEST(GeoTest, DistanceBetweenHighLatitudes) {
+    for (double latitude : {-70.0, -45.0, 0.0, 45.0, 70.0}) {
+        for (double distance : {1.0, 100.0, 1000.0, 50'000.0}) {
+            for (double bearing : {0.0, 90.0, 135.0}) {
+                Position from{toNanodegrees(latitude), toNanodegrees(25.0)};
+                Position to = positionAt(latitude, 25.0, bearing, distance);
+                EXPECT_NEAR(distanceBetween(from, to), distance, tolerance(distance, 1e-4))
+                    << distance << " m at " << latitude << " deg, " << bearing << " deg";
+            }
+        }
+    }
+}
+
+TEST(GeoTest, DistanceBetweenAcrossAntimeridian) {
+    for (const Segment& segment : {Segment{0.0, 179.99999, 90.0, 5.0}, Segment{-16.5, 179.9999, 80.0, 40.0},
+                                   Segment{65.0, -179.9995, 270.0, 100.0}, Segment{52.0, 179.5, 90.0, 80'000.0}}) {
+        Position from{toNanodegrees(segment.latitude), toNanodegrees(segment.longitude)};
+        Position to = positionAt(segment.latitude, segment.longitude, segment.bearing, segment.distance);
+        ASSERT_LT(from.longitude * to.longitude, 0) << "Segment must cross the antimeridian";
+        EXPECT_NEAR(distanceBetween(from, to), segment.distance, tolerance(segment.distance, 1e-4));
+    }
+}
+
+// Long distances, as after a long loss of signal, against the great-circle distances on the same sphere.
+TEST(GeoTest, DistanceBetweenLongDistances) {
+    Position paris{toNanodegrees(48.8566), toNanodegrees(2.3522)};
+    Position london{toNanodegrees(51.5074), toNanodegrees(-0.1278)};
+    EXPECT_NEAR(distanceBetween(paris, london), 343'556.0, 343'556.0 * 1e-5);
+
+    Position from{toNanodegrees(46.5), toNanodegrees(6.6)};
+    Position to = positionAt(46.5, 6.6, 30.0, 500'000.0);
+    EXPECT_NEAR(distanceBetween(from, to), 500'000.0, 500'000.0 * 1e-4);
+}
+
+// Fast path: segments up to GEO_FAST_MAX_DISTANCE, successive along a track at latitudes up to ±70°, so that the
+// latitude drifts from the cached cosine. The documented bound is 0.05%.
+TEST(GeoTest, DistanceEngineWithinDocumentedBound) {
+    for (double latitude : {-70.0, -45.0, 0.0, 30.0, 60.0, 70.0}) {
+        for (double segment : {0.1, 1.0, 2.8, 27.8, 250.0, 1000.0}) {
+            for (double bearing : {10.0, 45.0, 90.0, 170.0}) {
+                DistanceEngine engine;
+                double lat = latitude, lon = 25.0;
+                double maxError = 0.0;
+                int steps = static_cast<int>(fmin(2000.0, 5000.0 / segment));  // Up to 5 km, drift of 0.045°
+                for (int i = 0; i < steps; i++) {
+                    Position from{toNanodegrees(lat), toNanodegrees(lon)};
+                    trackMove(lat, lon, bearing, segment);
+                    Position to{toNanodegrees(lat), toNanodegrees(lon)};
+                    double error = fabs(engine.distance(from, to) - segment);
+                    maxError = fmax(maxError, error - 0.0003);  // Rounding of the positions to nanodegrees
+                }
+                EXPECT_LT(maxError, segment * 0.0005)
+                    << segment << " m at " << latitude << " deg, " << bearing << " deg";
+            }
+        }
+    }
+}
+
+TEST(GeoTest, DistanceEngineAcrossAntimeridian) {
+    DistanceEngine engine;
+    double lat = -16.5, lon = 179.9995;
+    for (int i = 0; i < 20; i++) {
+        Position from{toNanodegrees(lat), toNanodegrees(lon)};
+        trackMove(lat, lon, 80.0, 10.0);
+        Position to{toNanodegrees(lat), toNanodegrees(lon)};
+        EXPECT_NEAR(engine.distance(from, to), 10.0, 10.0 * 0.0005);
+    }
+    EXPECT_LT(lon, 0.0);
+}
+
+// Segments longer than GEO_FAST_MAX_DISTANCE, e.g. after a loss of signal, use the great-circle distance.
+TEST(GeoTest, DistanceEngineFallsBackForLongGaps) {
+    DistanceEngine engine;
+    for (double distance : {1001.0, 20'000.0, 300'000.0}) {
+        Position from{toNanodegrees(69.0), toNanodegrees(20.0)};
+        Position to = positionAt(69.0, 20.0, 60.0, distance);
+        EXPECT_EQ(engine.distance(from, to), distanceBetween(from, to));
+        EXPECT_NEAR(engine.distance(from, to), distance, distance * 1e-4);
+    }
+}
+
+// Cost per segment of the kernels on a 10 Hz track: cached-cosine projection, single precision haversine on integers
+// and the double precision formula of TinyGPS++ it replaces. On the host, double precision is in hardware: the gap is
+// larger on the ESP32, where it is emulated in software.
+TEST(GeoTest, Benchmark) {
+    Track track = makeTrack({{600.0, 90.0, 0.5}});
+    std::vector<Position> positions;
+    for (const TrackFix& fix : track.fixes) {
+        positions.push_back({toNanodegrees(fix.latitude), toNanodegrees(fix.longitude)});
+    }
+
+    auto nsPerSegment = [&](auto kernel) {
+        double best = 1e9;
+        volatile float sink = 0.0f;
+        for (int round = 0; round < 5; round++) {
+            auto start = std::chrono::steady_clock::now();
+            float total = 0.0f;
+            for (size_t i = 1; i < positions.size(); i++) {
+                total += kernel(positions[i - 1], positions[i]);
+            }
+            sink = total;
+            auto elapsed = std::chrono::steady_clock::now() - start;
+            best = fmin(best, std::chrono::duration<double, std::nano>(elapsed).count());
+        }
+        (void)sink;
+        return best / (positions.size() - 1);
+    };
+
+    DistanceEngine engine;
+    double engineCost =
+        nsPerSegment([&](const Position& from, const Position& to) { return engine.distance(from, to); });
+    double haversineCost = nsPerSegment(distanceBetween);
+    double tinyGpsCost = nsPerSegment([](const Position& from, const Position& to) {
+        return static_cast<float>(TinyGPSPlus::distanceBetween(from.latitude / 1e9, from.longitude / 1e9,
+                                                               to.latitude / 1e9, to.longitude / 1e9));
+    });
+    printf("Distance of %zu segments:\n", positions.size() - 1);
+    printf("  DistanceEngine:               %6.1f ns/segment\n", engineCost);
+    printf("  distanceBetween (float):      %6.1f ns/segment\n", haversineCost);
+    printf("  TinyGPSPlus::distanceBetween: %6.1f ns/segment\n", tinyGpsCost);
+    RecordProperty("engine_ns", std::to_string(engineCost));
+    RecordProperty("tinygps_ns", std::to_string(tinyGpsCost));
+
+    float engineTotal = 0.0f;
+    DistanceEngine check;
+    for (size_t i = 1; i < positions.size(); i++) {
+        engineTotal += check.distance(positions[i - 1], positions[i]);
+    }
+    EXPECT_NEAR(engineTotal, track.distance, track.distance * 0.0005);
+}
+
+}  // namespace
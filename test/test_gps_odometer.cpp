@@ -0,0 +1,110 @@
+// Built once per GPS_DISTANCE_METHOD: the cumulative error of each method is replayed on the same reference tracks.
+#include "gps_odometer.h"
+
+#include <gtest/gtest.h>
+
+#include "gps_track.h"
+
+namespace {
+
+const char* methodName() {
+    switch (GPS_DISTANCE_METHOD) {
+        case GPS_DISTANCE_POSITION:
+            return "position";
+        case GPS_DISTANCE_DOPPLER:
+            return "Doppler";
+        default:
+            return "blended";
+    }
+}
+
+/** Replay the fixes of a track as the GPS process does: a GGA (location only) then an RMC for each fix. */
+double replay(const Track& track) {
+    GpsOdometer odometer;
+    double distance = 0.0;
+    for (const TrackFix& fix : track.fixes) {
+        uint64_t now = 1'000'000 + static_cast<uint64_t>(fix.time - track.fixes.front().time) * 1000;
+        GpsData gga;
+        gga.hasLocation = gga.hasTimestamp = true;
+        gga.position = {toNanodegrees(fix.latitude), toNanodegrees(fix.longitude)};
+        gga.timestamp = fix.time;
+        distance += odometer.update(gga, now);
+
+        GpsData rmc = gga;
+        rmc.hasSpeed = rmc.hasCourse = true;
+        rmc.speed = fix.speed;
+        rmc.course = fix.course;
+        distance += odometer.update(rmc, now + 2000);
+    }
+    return distance;
+}
+
+/** Replay a track and report its cumulative error. @return Error relative to the reference distance, in meters. */
+double error(const char* scenario, const Track& track) {
+    double distance = replay(track);
+    printf("%-8s %-28s reference %9.1f m, measured %9.1f m, error %+8.1f m (%+.2f%%)\n", methodName(), scenario,
+           track.distance, distance, distance - track.distance,
+           track.distance > 0.0 ? (distance / track.distance - 1.0) * 100.0 : 0.0);
+    return distance - track.distance;
+}
+
+// Stopped for 5 minutes with a jittering position: no phantom distance from the speed, which is below
+// GPS_DOPPLER_MIN_SPEED. The position method adds the jitter.
+TEST(GpsOdometerTest, StoppedWithJitter) {
+    Track track = makeTrack({{300.0, 0.0, 0.0}}, {.positionNoise = 2.0, .speedNoise = 0.3});
+    double phantom = error("stopped, 2 m jitter", track);
+    if (GPS_DISTANCE_METHOD == GPS_DISTANCE_POSITION) {
+        EXPECT_GT(phantom, 100.0);
+    } else {
+        EXPECT_LT(phantom, 1.0);
+    }
+}
+
+// Walking pace with jitter: below GPS_DISTANCE_BLEND_MIN_SPEED, the blended method only uses the Doppler speed.
+TEST(GpsOdometerTest, SlowWithJitter) {
+    Track track = makeTrack({{300.0, 5.0, 0.0}}, {.positionNoise = 2.0, .speedNoise = 0.3});
+    double relative = error("5 km/h, 2 m jitter", track) / track.distance;
+    if (GPS_DISTANCE_METHOD == GPS_DISTANCE_POSITION) {
+        EXPECT_GT(relative, 0.2);
+    } else {
+        EXPECT_NEAR(relative, 0.0, 0.01);
+    }
+}
+
+// Hairpins at 1 Hz (default rate of the receiver): the chords between fixes cut the corners, the Doppler speed
+// follows the path.
+TEST(GpsOdometerTest, TightCornersAt1Hz) {
+    Track track = makeTrack({{10.0, 30.0, 0.0}, {4.0, 30.0, 45.0}, {10.0, 30.0, 0.0}, {4.0, 30.0, -45.0},
+                             {4.0, 30.0, 0.0}},
+                            {.period = 1000});
+    double relative = error("30 km/h hairpins at 1 Hz", track) / track.distance;
+    switch (GPS_DISTANCE_METHOD) {
+        case GPS_DISTANCE_POSITION:
+            EXPECT_LT(relative, -0.005);
+            break;
+        case GPS_DISTANCE_DOPPLER:
+            EXPECT_NEAR(relative, 0.0, 0.002);
+            break;
+        default:  // A fifth of the corner cutting
+            EXPECT_NEAR(relative, 0.0, 0.005);
+    }
+}
+
+// Winding road at 10 Hz with a realistic noise: the jitter still adds up with the position method.
+TEST(GpsOdometerTest, WindingRoadAt10Hz) {
+    Track track = makeTrack({{60.0, 70.0, 0.0}, {20.0, 50.0, 8.0}, {60.0, 90.0, -2.0}, {20.0, 40.0, 0.0}},
+                            {.positionNoise = 0.3, .speedNoise = 0.2});
+    double relative = error("winding road at 10 Hz", track) / track.distance;
+    EXPECT_NEAR(relative, 0.0, GPS_DISTANCE_METHOD == GPS_DISTANCE_POSITION ? 0.02 : 0.003);
+}
+
+// Fixes missing for longer than GPS_DOPPLER_MAX_INTERVAL_MS: the gap is bridged with the distance between positions.
+TEST(GpsOdometerTest, GapBridgedWithPositions) {
+    Track track = makeTrack({{60.0, 50.0, 0.0}});
+    Track gapped = track;
+    gapped.fixes.erase(gapped.fixes.begin() + 200, gapped.fixes.begin() + 300);  // 10 s
+    double relative = error("10 s gap on a straight line", gapped) / track.distance;
+    EXPECT_NEAR(relative, 0.0, 0.002);
+}
+
+}  // namespace
@@ -0,0 +1,230 @@
+#include <gtest/gtest.h>
+
+#include <random>
+
+#include "host.h"
+#include "process_storage.h"
+
+namespace {
+
+const uint32_t SECTOR_SIZE = 0x1000;
+const uint32_t RECORDS_PER_SECTOR = SECTOR_SIZE / sizeof(JournalRecord);
+
+/** Journal over a fake partition of 4 sectors, with the NVS checkpoint kept by the test. */
+class JournalTest : public ::testing::Test {
+   protected:
+    DistanceJournal journal;
+    uint32_t checkpointSequence{0};
+    int64_t checkpointStage{0};
+    int64_t checkpointTotal{0};
+    int64_t stage{0};  // mm, distances of the last complete append
+    int64_t total{0};
+
+    void SetUp() override {
+        host::resetFlash(4 * SECTOR_SIZE, SECTOR_SIZE);
+        journal = DistanceJournal();
+        journal.begin();
+        journal.setCheckpoint(0, 0, 0);
+        checkpointSequence = 0;
+        stage = total = checkpointStage = checkpointTotal = 0;
+    }
+
+    /** Save the NVS checkpoint, as the storage process does when the journal needs it. */
+    void checkpoint() {
+        checkpointSequence = journal.getSequence();
+        checkpointStage = stage;
+        checkpointTotal = total;
+        journal.setCheckpoint(checkpointSequence, stage, total);
+    }
+
+    /** Append a distance, checkpointed when needed. */
+    void append(int32_t distance) {
+        journal.append(stage + distance, total + distance);
+        stage += distance;
+        total += distance;
+        if (journal.needsCheckpoint()) {
+            checkpoint();
+        }
+    }
+
+    /** Append a distance, with a power cut after some bytes written or erased. */
+    void appendWithPowerCut(int32_t distance, long budget) {
+        host::flashBudget = budget;
+        EXPECT_THROW(journal.append(stage + distance, total + distance), host::PowerCut);
+        host::flashBudget = -1;
+    }
+
+    /** Boot again: a new journal, replayed on top of the checkpoint. @return Stage distance restored. */
+    int64_t reboot() {
+        journal = DistanceJournal();
+        journal.begin();
+        int64_t stageDelta, totalDelta;
+        journal.replay(checkpointSequence, stageDelta, totalDelta);
+        journal.setCheckpoint(checkpointSequence, checkpointStage + stageDelta, checkpointTotal + totalDelta);
+        EXPECT_EQ(checkpointTotal + totalDelta - (checkpointStage + stageDelta), total - stage);
+        return checkpointStage + stageDelta;
+    }
+};
+
+TEST_F(JournalTest, ReplayAfterCheckpoint) {
+    for (int i = 0; i < 50; i++) {
+        append(1000 + i);
+    }
+    checkpoint();
+    for (int i = 0; i < 20; i++) {
+        append(700);
+    }
+    EXPECT_EQ(reboot(), stage);
+    EXPECT_EQ(journal.getSequence(), 70u);
+}
+
+// Power cut at each byte of a record: the torn record is rejected by its CRC, its slot is skipped, and the next
+// records are written after it.
+TEST_F(JournalTest, TornRecordSkipped) {
+    for (long budget = 0; budget < static_cast<long>(sizeof(JournalRecord)); budget++) {
+        SetUp();
+        for (int i = 0; i < 10; i++) {
+            append(1000);
+        }
+        appendWithPowerCut(1000, budget);
+        EXPECT_EQ(reboot(), 10'000) << "cut after " << budget << " bytes";
+
+        append(500);
+        EXPECT_EQ(reboot(), 10'500) << "cut after " << budget << " bytes";
+        EXPECT_EQ(journal.getSequence(), 11u);
+    }
+}
+
+// The ring wraps around the sectors many times, with the checkpoints requested by the journal: the distance is exact
+// after a reboot at any point.
+TEST_F(JournalTest, SectorWrap) {
+    std::mt19937 random(3);
+    std::uniform_int_distribution<int32_t> distance(0, 30'000);
+    for (uint32_t i = 0; i < 5 * 4 * RECORDS_PER_SECTOR; i++) {
+        append(distance(random));
+        if (i % 997 == 0) {
+            ASSERT_EQ(reboot(), stage) << "after " << i << " records";
+        }
+    }
+    EXPECT_EQ(reboot(), stage);
+    EXPECT_GT(checkpointSequence, 4 * RECORDS_PER_SECTOR);
+}
+
+// Power cut while erasing the next sector of the ring: its old records, half erased, are all older than the checkpoint.
+TEST_F(JournalTest, PowerCutWhileErasing) {
+    for (long budget : {0L, 1L, 100L, static_cast<long>(SECTOR_SIZE) / 2, static_cast<long>(SECTOR_SIZE) - 1}) {
+        SetUp();
+        while (journal.getSequence() % RECORDS_PER_SECTOR != 0 || journal.getSequence() < 5 * RECORDS_PER_SECTOR) {
+            append(1500);
+        }
+        appendWithPowerCut(1500, budget);
+        EXPECT_EQ(reboot(), stage) << "cut after " << budget << " bytes erased";
+
+        append(800);
+        EXPECT_EQ(reboot(), stage) << "cut after " << budget << " bytes erased";
+    }
+}
+
+// A record with a flipped bit fails its CRC: it is not replayed, the other records are.
+TEST_F(JournalTest, CorruptedRecordRejected) {
+    for (int i = 0; i < 10; i++) {
+        append(1000 + i);
+    }
+    host::flash[4 * sizeof(JournalRecord) + offsetof(JournalRecord, stageDelta)] &= 0x7F;  // Record 5, 1004 mm
+
+    int64_t stageDelta, totalDelta;
+    DistanceJournal rebooted;
+    rebooted.begin();
+    EXPECT_EQ(rebooted.replay(0, stageDelta, totalDelta), 9u);
+    EXPECT_EQ(stageDelta, stage - 1004);
+    EXPECT_EQ(totalDelta, total - 1004);
+}
+
+// The whole state: a checkpoint in NVS, 500 records, and a power cut in the middle of the next record. The state
+// loaded at the next boot has the exact stage distance of the last complete record.
+TEST(StorageTest, CheckpointAppendsAndReplay) {
+    host::resetNvs();
+    host::resetFlash(4 * SECTOR_SIZE, SECTOR_SIZE);
+    host::resetReason = ESP_RST_POWERON;
+    distanceJournal = DistanceJournal();
+    distanceJournal.begin();
+    sharedState.loadData();
+
+    StateRecord saved;
+    uint32_t sequence = distanceJournal.getSequence();
+    ASSERT_TRUE(sharedState.saveData(sequence, saved));
+    distanceJournal.setCheckpoint(sequence, saved.stageDistance, saved.totalDistance);
+
+    std::mt19937 random(5);
+    std::uniform_int_distribution<int32_t> distance(600, 2000);
+    for (int i = 0; i < 500; i++) {
+        sharedState.addToStageDistance(distance(random));
+        StateSnapshot state = sharedState.snapshot();
+        distanceJournal.append(state.stageDistance, state.totalDistance);
+    }
+    StateSnapshot journaled = sharedState.snapshot();
+
+    sharedState.addToStageDistance(1234);
+    host::flashBudget = 9;
+    StateSnapshot state = sharedState.snapshot();
+    EXPECT_THROW(distanceJournal.append(state.stageDistance, state.totalDistance), host::PowerCut);
+    host::flashBudget = -1;
+
+    distanceJournal = DistanceJournal();
+    distanceJournal.begin();
+    SharedState restored;
+    restored.loadData();
+    EXPECT_EQ(restored.getStageDistance(), journaled.stageDistance);
+    EXPECT_EQ(restored.getTotalDistance(), journaled.totalDistance);
+}
+
+// The checkpoint at start fails to save: the next records are still relative to the distances loaded, the next boot
+// does not add the whole odometer again.
+TEST(StorageTest, FailedCheckpointAtStart) {
+    host::resetNvs();
+    host::resetFlash(4 * SECTOR_SIZE, SECTOR_SIZE);
+    host::resetReason = ESP_RST_POWERON;
+    distanceJournal = DistanceJournal();
+    distanceJournal.begin();
+    SharedState state;
+    state.loadData();
+    state.addToStageDistance(5'000'000);
+    StateRecord saved;
+    uint32_t sequence = distanceJournal.getSequence();
+    ASSERT_TRUE(state.saveData(sequence, saved));
+    distanceJournal.setCheckpoint(sequence, saved.stageDistance, saved.totalDistance);
+    state.addToStageDistance(2000);
+    distanceJournal.append(state.getStageDistance(), state.getTotalDistance());
+
+    // Replayed at boot: the checkpoint at start is needed, and fails
+    distanceJournal = DistanceJournal();
+    distanceJournal.begin();
+    SharedState booted;
+    booted.loadData();
+    host::nvsFailsWrites = true;
+    EXPECT_FALSE(booted.saveData(distanceJournal.getSequence(), saved));
+    for (int i = 0; i < 10; i++) {
+        booted.addToStageDistance(1000);
+        StateSnapshot state = booted.snapshot();
+        distanceJournal.append(state.stageDistance, state.totalDistance);
+    }
+    host::nvsFailsWrites = false;
+
+    distanceJournal = DistanceJournal();
+    distanceJournal.begin();
+    SharedState restored;
+    restored.loadData();
+    EXPECT_EQ(restored.getStageDistance(), 5'012'000);
+    EXPECT_EQ(restored.getTotalDistance(), booted.getTotalDistance());
+}
+
+// The storage process never waits 0 ticks for a time in the future, which would make it spin.
+TEST(StorageTest, WaitRoundedUpToATick) {
+    EXPECT_EQ(ticksUntil(1000, 1000), 0u);
+    EXPECT_EQ(ticksUntil(1000, 2000), 0u);
+    EXPECT_EQ(ticksUntil(1001, 1000), 1u);
+    EXPECT_EQ(ticksUntil(1000 + portTICK_PERIOD_MS * 1000 - 1, 1000), 1u);
+    EXPECT_EQ(ticksUntil(1000 + 5 * portTICK_PERIOD_MS * 1000, 1000), 5u);
+}
+
+}  // namespace
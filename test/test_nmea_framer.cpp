@@ -0,0 +1,161 @@
+#include "nmea_framer.h"
+
+#include <gtest/gtest.h>
+#include <string.h>
+
+#include <chrono>
+
+#include "gps_track.h"
+#include "tinygps++/TinyGPS++.cpp"
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+/** Write data to the framer, as the UART reads do, and pass each complete sentence to a function. */
+template <size_t N, typename F>
+void frame(NmeaFramer<N>& framer, const std::string& data, F onSentence) {
+    size_t offset = 0;
+    while (offset < data.size()) {
+        size_t length;
+        char* buffer = framer.writeBuffer(length);
+        length = std::min(length, std::min<size_t>(data.size() - offset, GPS_UART_READ_SIZE));
+        memcpy(buffer, data.data() + offset, length);
+        framer.commit(length);
+        offset += length;
+
+        NmeaSentence sentence;
+        while (framer.next(sentence)) {
+            onSentence(sentence);
+        }
+    }
+}
+
+std::string captureOf(const Track& track) {
+    std::string capture;
+    for (const std::string& sentence : nmeaCapture(track)) {
+        capture += sentence;
+    }
+    return capture;
+}
+
+/** Bytes per second of a parsing function over a capture, best of several rounds to reduce the noise of the host. */
+template <typename F>
+double throughput(const std::string& capture, int repeats, F parse) {
+    double best = 0.0;
+    for (int round = 0; round < 5; round++) {
+        Clock::time_point start = Clock::now();
+        for (int i = 0; i < repeats; i++) {
+            parse();
+        }
+        double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+        best = std::max(best, capture.size() * repeats / seconds);
+    }
+    return best;
+}
+
+// Sentences passed whole, with the checksum verified by the framer, give the same values as the parsing char by char.
+TEST(NmeaFramerTest, EncodeVerifiedMatchesEncode) {
+    Track track = makeTrack({{20.0, 50.0, 3.0}}, {.positionNoise = 2.0, .climbRate = 0.5});
+    TinyGPSPlus reference, verified;
+    NmeaFramer<GPS_NMEA_FRAMER_SIZE> framer;  // Smaller than the capture: sentences wrap around its end
+
+    size_t sentences = 0;
+    std::string capture = captureOf(track);
+    for (char c : capture) {
+        reference.encode(c);
+    }
+    frame(framer, capture, [&](const NmeaSentence& sentence) {
+        verified.encodeVerified(sentence.first, sentence.firstLength);
+        verified.encodeVerified(sentence.second, sentence.secondLength);
+        sentences++;
+    });
+
+    EXPECT_EQ(sentences, 2 * track.fixes.size());
+    EXPECT_EQ(verified.passedChecksum(), reference.passedChecksum());
+    EXPECT_EQ(verified.failedChecksum(), 0u);
+    EXPECT_EQ(verified.sentencesWithFix(), reference.sentencesWithFix());
+    EXPECT_EQ(verified.charsProcessed(), reference.charsProcessed());
+    EXPECT_DOUBLE_EQ(verified.location.lat(), reference.location.lat());
+    EXPECT_DOUBLE_EQ(verified.location.lng(), reference.location.lng());
+    EXPECT_DOUBLE_EQ(verified.altitude.meters(), reference.altitude.meters());
+    EXPECT_DOUBLE_EQ(verified.speed.kmph(), reference.speed.kmph());
+    EXPECT_DOUBLE_EQ(verified.course.deg(), reference.course.deg());
+    EXPECT_EQ(verified.time.value(), reference.time.value());
+}
+
+// A sentence with a bad checksum is dropped by the framer, the parser never sees it.
+TEST(NmeaFramerTest, BadChecksumDroppedBeforeParsing) {
+    Track track = makeTrack({{1.0, 50.0, 0.0}});
+    std::string good = rmcSentence(track.fixes[0]);
+    std::string bad = good;
+    bad[bad.find(',') + 1] ^= 1;  // Corrupt the time, keeping the checksum
+
+    TinyGPSPlus parser;
+    NmeaFramer<GPS_NMEA_FRAMER_SIZE> framer;
+    frame(framer, bad + good, [&](const NmeaSentence& sentence) {
+        parser.encodeVerified(sentence.first, sentence.firstLength);
+        parser.encodeVerified(sentence.second, sentence.secondLength);
+    });
+
+    EXPECT_EQ(framer.failedChecksum(), 1u);
+    EXPECT_EQ(parser.passedChecksum(), 1u);
+}
+
+// Throughput of the parsing of a 10 Hz capture. Before: framer then `encode`, which computes the checksum again. After:
+// framer then `encodeVerified`. The sentences are also framed beforehand, to compare the parsers alone.
+TEST(NmeaFramerTest, Benchmark) {
+    Track track = makeTrack({{60.0, 80.0, 2.0}}, {.positionNoise = 2.0, .climbRate = 0.5});
+    std::string capture = captureOf(track);
+    const int repeats = 20;
+
+    auto encode = [](TinyGPSPlus& parser, const NmeaSentence& sentence) {
+        for (size_t i = 0; i < sentence.firstLength; i++) {
+            parser.encode(sentence.first[i]);
+        }
+        for (size_t i = 0; i < sentence.secondLength; i++) {
+            parser.encode(sentence.second[i]);
+        }
+    };
+    auto encodeVerified = [](TinyGPSPlus& parser, const NmeaSentence& sentence) {
+        parser.encodeVerified(sentence.first, sentence.firstLength);
+        parser.encodeVerified(sentence.second, sentence.secondLength);
+    };
+
+    TinyGPSPlus before, after;
+    NmeaFramer<GPS_NMEA_FRAMER_SIZE> framer;
+    double beforeRate = throughput(capture, repeats, [&]() {
+        frame(framer, capture, [&](const NmeaSentence& sentence) { encode(before, sentence); });
+    });
+    double afterRate = throughput(capture, repeats, [&]() {
+        frame(framer, capture, [&](const NmeaSentence& sentence) { encodeVerified(after, sentence); });
+    });
+
+    std::vector<NmeaSentence> sentences;
+    std::vector<std::string> capturedSentences = nmeaCapture(track);
+    for (const std::string& sentence : capturedSentences) {
+        sentences.push_back({sentence.data(), sentence.size(), nullptr, 0});
+    }
+    TinyGPSPlus parserBefore, parserAfter;
+    double parserBeforeRate = throughput(capture, repeats, [&]() {
+        for (const NmeaSentence& sentence : sentences) encode(parserBefore, sentence);
+    });
+    double parserAfterRate = throughput(capture, repeats, [&]() {
+        for (const NmeaSentence& sentence : sentences) encodeVerified(parserAfter, sentence);
+    });
+
+    printf("NMEA parsing of %zu bytes:\n", capture.size());
+    printf("  framer + encode:         %7.1f MB/s\n", beforeRate / 1e6);
+    printf("  framer + encodeVerified: %7.1f MB/s (%+.0f%%)\n", afterRate / 1e6,
+           (afterRate / beforeRate - 1.0) * 100.0);
+    printf("  encode alone:            %7.1f MB/s\n", parserBeforeRate / 1e6);
+    printf("  encodeVerified alone:    %7.1f MB/s (%+.0f%%)\n", parserAfterRate / 1e6,
+           (parserAfterRate / parserBeforeRate - 1.0) * 100.0);
+    RecordProperty("before_bytes_per_s", std::to_string(beforeRate));
+    RecordProperty("after_bytes_per_s", std::to_string(afterRate));
+
+    EXPECT_EQ(after.passedChecksum(), before.passedChecksum());
+    EXPECT_EQ(parserAfter.passedChecksum(), parserBefore.passedChecksum());
+}
+
+}  // namespace
@@ -0,0 +1,156 @@
+#include "process_gps.h"
+
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <chrono>
+
+#include "gps_track.h"
+#include "host.h"
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+class ProcessGpsTest : public ::testing::Test {
+   protected:
+    void SetUp() override {
+        host::resetUart();
+        gpsOdometer.reset();
+        distanceFusion.reset();
+        hybridOdometer.reset();
+        gpsDistanceRemainder = 0.0f;
+        sharedState.resetStageDistance();
+    }
+
+    /** Set the host time to the time of a fix, in us since the start of the track. */
+    static void setTime(const Track& track, const TrackFix& fix) {
+        host::now = 1'000'000 + static_cast<int64_t>(fix.time - track.fixes.front().time) * 1000;
+    }
+};
+
+// Each sentence is parsed as soon as its pattern event is handled: the latency from the arrival of the line feed to
+// the update of the state is the processing time only, instead of up to the 500 ms of the former polling loop.
+TEST_F(ProcessGpsTest, ReplayedSentencesUpdateStateOnArrival) {
+    Track track = makeTrack({{60.0, 36.0, 15.0}}, {.climbRate = 1.0});  // Cap in whole degrees, 1.5° per fix
+    std::vector<Clock::duration> latencies;
+    uint32_t updates = 0;
+    for (const TrackFix& fix : track.fixes) {
+        setTime(track, fix);
+        for (const std::string& sentence : {ggaSentence(fix), rmcSentence(fix)}) {
+            uint32_t generation = sharedState.snapshot().generation;
+            host::uartReceive(sentence);  // Pattern event raised on the line feed
+
+            Clock::time_point arrival = Clock::now();
+            readNmeaSentences(GPS);
+            latencies.push_back(Clock::now() - arrival);
+
+            updates += sharedState.snapshot().generation != generation ? 1 : 0;
+        }
+    }
+
+    // GGA changes the altitude and RMC the cap: every sentence updates the state
+    EXPECT_EQ(updates, latencies.size());
+    std::sort(latencies.begin(), latencies.end());
+    auto us = [](Clock::duration duration) {
+        return std::chrono::duration_cast<std::chrono::duration<double, std::micro>>(duration).count();
+    };
+    double p50 = us(latencies[latencies.size() / 2]);
+    double p99 = us(latencies[latencies.size() * 99 / 100]);
+    double max = us(latencies.back());
+    printf("Sentence to state latency over %zu sentences: median %.1f us, p99 %.1f us, max %.1f us\n",
+           latencies.size(), p50, p99, max);
+    RecordProperty("latency_median_us", std::to_string(p50));
+    RecordProperty("latency_max_us", std::to_string(max));
+    EXPECT_LT(max, 50'000.0);  // Far below the 500 ms polling period, even on a loaded host
+}
+
+// Sentences split across UART reads, or several in one read, are all parsed when their line feed arrives.
+TEST_F(ProcessGpsTest, SentencesSplitAcrossReads) {
+    Track track = makeTrack({{10.0, 36.0, 0.0}});
+    std::string capture;
+    for (const std::string& sentence : nmeaCapture(track)) {
+        capture += sentence;
+    }
+
+    int64_t start = sharedState.getStageDistance();
+    uint32_t passed = gps.passedChecksum();
+    int64_t duration = static_cast<int64_t>(track.fixes.size()) * GPS_UPDATE_RATE_MS * 1000;
+    for (size_t offset = 0; offset < capture.size(); offset += 37) {
+        host::now = 1'000'000 + duration * offset / capture.size();
+        host::uartReceive(capture.substr(offset, 37));
+        readNmeaSentences(GPS);
+    }
+
+    EXPECT_EQ(gps.passedChecksum() - passed, 2 * track.fixes.size());
+    EXPECT_GT(sharedState.getStageDistance() - start, 0);
+}
+
+// At startup, the receiver is set to only output GGA and RMC, at 10 Hz.
+TEST_F(ProcessGpsTest, ReceiverConfiguredAtStartup) {
+    configureGpsReceiver();
+    EXPECT_EQ(host::uartSent, nmeaSentence(GPS_RECEIVER_OUTPUT_COMMAND) + nmeaSentence("PCAS02,100"));
+}
+
+// A 10 Hz capture replayed as the task reads it: after each sentence (pattern event), or in bursts filling the UART
+// buffer when the task is late. No sentence is lost.
+TEST_F(ProcessGpsTest, NoSentenceLostAt10Hz) {
+    Track track = makeTrack({{120.0, 60.0, 0.0}, {30.0, 40.0, 6.0}, {150.0, 90.0, -1.0}},
+                            {.climbRate = 0.2});
+    std::vector<std::string> sentences = nmeaCapture(track);
+    uint32_t passed = gps.passedChecksum();
+    uint32_t failed = nmeaFramer.failedChecksum();
+    uint32_t dropped = nmeaFramer.droppedSentences();
+    int64_t start = sharedState.getStageDistance();
+
+    size_t buffered = 0;
+    for (size_t i = 0; i < sentences.size(); i++) {
+        setTime(track, track.fixes[i / 2]);
+        host::uartReceive(sentences[i]);
+        buffered += sentences[i].size();
+        // Late by up to one UART buffer every 10 s, otherwise read on each pattern event
+        bool isLate = i % 200 < 20 && buffered + GPS_NMEA_MAX_SENTENCE_LENGTH < GPS_UART_BUFFER_SIZE * 2;
+        if (!isLate) {
+            readNmeaSentences(GPS);
+            buffered = 0;
+        }
+    }
+    readNmeaSentences(GPS);
+
+    EXPECT_EQ(gps.passedChecksum() - passed, sentences.size());
+    EXPECT_EQ(nmeaFramer.failedChecksum(), failed);
+    EXPECT_EQ(nmeaFramer.droppedSentences(), dropped);
+    double distance = (sharedState.getStageDistance() - start) / 1000.0;
+    EXPECT_NEAR(distance, track.distance, track.distance * 0.01);
+}
+
+// In fused mode, the wheel distance is corrected by the GPS: the distance of the location-only sentences (GGA) goes
+// through the fusion like the others, it is never added raw on top of the wheel distance.
+TEST_F(ProcessGpsTest, FusedModeCountsEachFixOnce) {
+    Track track = makeTrack({{120.0, 50.0, 0.0}, {30.0, 30.0, 6.0}, {60.0, 70.0, 0.0}}, {.climbRate = 0.2});
+    const float pulseDistance = 2000.0f;  // mm, one magnet
+    double wheelDistance = 0.0;
+    uint32_t countedPulses = 0;
+    float wheelRemainder = 0.0f;
+    for (size_t i = 0; i < track.fixes.size(); i++) {
+        const TrackFix& fix = track.fixes[i];
+        setTime(track, fix);
+
+        // Wheel pulses since the previous fix, as the magnetic process reports them
+        wheelDistance += fix.speed / 3.6 * GPS_UPDATE_RATE_MS / 1000.0;
+        uint32_t pulses = static_cast<uint32_t>(wheelDistance * 1000.0 / pulseDistance) - countedPulses;
+        countedPulses += pulses;
+        float distance = distanceFusion.updateWheel(pulses, host::now, pulseDistance);
+        if (distance > 0.0f) {
+            sharedState.addToStageDistance(toMillimeters(distance, wheelRemainder));
+        }
+
+        host::uartReceive(ggaSentence(fix) + rmcSentence(fix));
+        readNmeaSentences(FUSED);
+    }
+
+    double distance = sharedState.getStageDistance() / 1000.0;
+    EXPECT_NEAR(distance, track.distance, track.distance * 0.002);
+}
+
+}  // namespace
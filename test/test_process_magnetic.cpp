@@ -0,0 +1,251 @@
+#include "process_magnetic.h"
+
+#include <gtest/gtest.h>
+
+#include <vector>
+
+#include "host.h"
+
+namespace {
+
+std::vector<uint64_t> latencies;  // us, reported to magneticLatencyHandler
+
+void recordLatency(uint64_t latency) { latencies.push_back(latency); }
+
+/** Fake counter of the wheel sensor, without the time of each pulse like the PCNT backend. */
+class FakeWheelSensor : public WheelSensor {
+   public:
+    WheelPulses pulses{0, 0};
+
+    void begin() override {}
+    WheelPulses read() override { return pulses; }
+    void reset() override { pulses = {0, 0}; }
+
+    /** Count a pulse at the current time. */
+    void pulse() {
+        pulses.count++;
+        pulses.lastPulseTime = host::now;
+    }
+};
+
+class ProcessMagneticTest : public ::testing::Test {
+   protected:
+    FakeWheelSensor sensor;
+    double travel{0.0};  // mm since the last pulse
+
+    void SetUp() override {
+        host::now = 1'000'000;
+        wheelSensor = &sensor;
+        lastPulseCount = lastSpeedCheckPulseCount = 0;
+        lastPulseCheckTime = host::now;
+        rejectedPulseCount = 0;
+        pendingDistance = 0;
+        speedEstimator.reset();
+        sharedState.resetStageDistance();
+    }
+
+    void TearDown() override {
+        wheelSensor = &defaultWheelSensor;
+        magneticLatencyHandler = nullptr;
+    }
+
+    /**
+     * Ride at a constant speed, with the pulses of the fake counter, and update the state as the magnetic process in
+     * wheel sensor mode does every `poll` us.
+     * @param distancePerPulse Distance between two pulses in mm.
+     */
+    void ride(double duration, float speed, float distancePerPulse, uint16_t wheel_size, uint8_t magnets,
+              uint64_t poll = MAGNETIC_LOOP_DELAY_MS * 1000) {
+        for (uint64_t t = 0; t < duration * 1e6; t += 1000) {
+            host::now += 1000;
+            travel += speed / 3.6;  // mm per ms
+            if (travel >= distancePerPulse) {
+                travel -= distancePerPulse;
+                sensor.pulse();
+            }
+            if (t % poll == 0) {
+                updateDistance(wheel_size, magnets);
+                sharedState.setSpeed(calculateSpeed(wheel_size, magnets));
+            }
+        }
+    }
+};
+
+// The fake counter drives the distance and the speed: the distance is exactly the pulses times the wheel size.
+TEST_F(ProcessMagneticTest, DistanceAndSpeedFromFakeCounter) {
+    ride(60.0, 36.0f, 2000.0f, 2000, 1);
+    updateDistance(2000, 1);
+
+    EXPECT_EQ(sensor.pulses.count, 300u);
+    EXPECT_EQ(sharedState.getStageDistance(), 300 * 2000);
+    EXPECT_NEAR(sharedState.getSpeed(), 36.0f, 0.5f);
+    EXPECT_EQ(rejectedPulseCount, 0u);
+}
+
+// Stopped: the speed drops to 0 after MAGNETIC_SPEED_TIMEOUT_US, the distance does not change.
+TEST_F(ProcessMagneticTest, StopFromFakeCounter) {
+    ride(10.0, 20.0f, 2000.0f, 2000, 1);
+    int64_t distance = sharedState.getStageDistance();
+
+    ride(MAGNETIC_SPEED_TIMEOUT_US / 1e6 + 1.0, 0.0f, 2000.0f, 2000, 1);
+    EXPECT_EQ(sharedState.getSpeed(), 0.0f);
+    EXPECT_EQ(sharedState.getStageDistance(), distance);
+}
+
+// Task starved for 5 s at 120 km/h: the burst of pulses is plausible for the elapsed time, it is counted and the
+// following updates go on.
+TEST_F(ProcessMagneticTest, TaskStarvation) {
+    ride(10.0, 120.0f, 2000.0f, 2000, 1);
+    ride(5.0, 120.0f, 2000.0f, 2000, 1, 5'000'000);
+    ride(10.0, 120.0f, 2000.0f, 2000, 1);
+    updateDistance(2000, 1);
+
+    EXPECT_EQ(rejectedPulseCount, 0u);
+    EXPECT_EQ(sharedState.getStageDistance(), static_cast<int64_t>(sensor.pulses.count) * 2000);
+    EXPECT_NEAR(sharedState.getStageDistance(), 25.0 * 120'000 / 3.6, 2000);
+}
+
+// Impossible burst (electrical noise): the pulses are counted as rejected and skipped, the odometer does not freeze.
+TEST_F(ProcessMagneticTest, ImplausibleBurstRejected) {
+    ride(5.0, 30.0f, 2000.0f, 2000, 1);
+    int64_t distance = sharedState.getStageDistance();
+
+    host::now += MAGNETIC_LOOP_DELAY_MS * 1000;
+    sensor.pulses.count += 500;  // 18000 km/h
+    updateDistance(2000, 1);
+    EXPECT_EQ(rejectedPulseCount, 500u);
+    EXPECT_EQ(sharedState.getStageDistance(), distance);
+
+    ride(5.0, 30.0f, 2000.0f, 2000, 1);
+    EXPECT_NEAR(sharedState.getStageDistance() - distance, 5.0 * 30'000 / 3.6, 2000);
+    EXPECT_EQ(rejectedPulseCount, 500u);
+}
+
+// The counter wraps around after 2^32 pulses: the difference is still the number of new pulses.
+TEST_F(ProcessMagneticTest, CounterWraparound) {
+    sensor.pulses.count = lastPulseCount = lastSpeedCheckPulseCount = UINT32_MAX - 3;
+    ride(5.0, 36.0f, 2000.0f, 2000, 1);
+    updateDistance(2000, 1);
+
+    EXPECT_LT(sensor.pulses.count, 100u);
+    EXPECT_EQ(rejectedPulseCount, 0u);
+    EXPECT_EQ(sharedState.getStageDistance(), 25 * 2000);
+    EXPECT_NEAR(sharedState.getSpeed(), 36.0f, 0.5f);
+}
+
+// GPS mode: the wheel turns for a minute before the calibration starts. The pulses counted before the start are not
+// given to the calibration, whose first segment is exact.
+TEST_F(ProcessMagneticTest, CalibrationStartsFromCurrentCount) {
+    GpsData fix;
+    fix.hasLocation = fix.hasSpeed = fix.hasCourse = fix.hasHdop = true;
+    fix.speed = 36.0f;
+    fix.course = 90.0f;
+    fix.hdop = 0.8f;
+    auto ride = [&](double duration) {
+        for (int ms = 1; ms <= duration * 1000; ms++) {
+            host::now += 1000;
+            if (ms % 200 == 0) {
+                sensor.pulse();
+                updateCalibration(2000, 1);  // Woken by the pulse
+            }
+            if (ms % 100 == 50) {
+                wheelCalibration.updateGps(fix, 1.0f, host::now);  // 1 m per fix
+            }
+        }
+    };
+
+    ride(60.0);
+    wheelCalibration.start();
+    ride(CALIBRATION_SEGMENT_DISTANCE * 5 / 10.0 + 1.0);
+    wheelCalibration.stop();
+
+    WheelCalibrationResult result = wheelCalibration.getResult();
+    EXPECT_EQ(result.segments, 5);
+    EXPECT_FLOAT_EQ(result.circumference, 2000.0f);
+    EXPECT_EQ(rejectedPulseCount, 0u);
+}
+
+// The ring of pulse times overflows while the process is starved: the newest times are dropped, the count is exact,
+// and the speed comes back with the next pulses.
+TEST_F(ProcessMagneticTest, PulseRingOverflow) {
+    GpioWheelSensor gpio;
+    gpio.begin();
+    wheelSensor = &gpio;
+    const uint64_t period = 160'000;  // 45 km/h with 2000 mm per pulse
+    auto pulse = [&]() {
+        host::now += period;
+        host::gpioInterrupt(MAGNETIC_SENSOR_PIN);
+    };
+
+    for (int i = 0; i < MAGNETIC_PULSE_RING_SIZE + 8; i++) {
+        pulse();
+    }
+    EXPECT_EQ(gpio.read().count, MAGNETIC_PULSE_RING_SIZE + 8u);
+    EXPECT_LT(calculateSpeed(2000, 1), 45.0f);  // Slowing down since the last time in the ring
+    uint64_t time;
+    EXPECT_FALSE(gpio.popPulseTime(time));  // Drained
+
+    for (int i = 0; i < 3; i++) {
+        pulse();
+        EXPECT_NEAR(calculateSpeed(2000, 1), 45.0f, 0.01f);  // The long period is rejected by the median
+    }
+    EXPECT_EQ(gpio.read().count, MAGNETIC_PULSE_RING_SIZE + 11u);
+}
+
+// Each pulse notifies the magnetic process, which updates the stage distance at once: the latency of the readout is the
+// processing time, instead of up to MAGNETIC_LOOP_DELAY_MS.
+TEST_F(ProcessMagneticTest, LatencyFromPulseToState) {
+    GpioWheelSensor gpio;
+    gpio.setNotifiedTask(xTaskGetCurrentTaskHandle());
+    gpio.begin();
+    wheelSensor = &gpio;
+    magneticLatencyHandler = recordLatency;
+    latencies.clear();
+    xTaskNotifyWait(0, UINT32_MAX, nullptr, 0);
+
+    for (int i = 1; i <= 20; i++) {
+        host::now += 250'000;  // 28.8 km/h
+        host::gpioInterrupt(MAGNETIC_SENSOR_PIN);
+        uint32_t notification{0};
+        xTaskNotifyWait(0, UINT32_MAX, &notification, 0);
+        ASSERT_TRUE(notification & STATE_NOTIFY_PULSE_BIT);
+
+        host::now += 3'000;  // Processing time
+        updateFromPulses(WHEEL_SENSOR, 2000, 1, true);
+        EXPECT_EQ(sharedState.getStageDistance(), i * 2000);
+    }
+
+    // Periodic update without pulse: no latency
+    host::now += MAGNETIC_LOOP_DELAY_MS * 1000;
+    updateFromPulses(WHEEL_SENSOR, 2000, 1, false);
+
+    ASSERT_EQ(latencies.size(), 20u);
+    for (uint64_t latency : latencies) {
+        EXPECT_EQ(latency, 3'000u);
+    }
+}
+
+// PCNT backend over the fake unit: the time of the last pulse is the time of the read where the count changed.
+TEST(PcntWheelSensorTest, ReadsHardwareCount) {
+    PcntWheelSensor sensor;
+    host::pcntCount = 42;
+    sensor.begin();
+    EXPECT_EQ(sensor.read().count, 0u);  // Cleared when started
+    EXPECT_EQ(sensor.read().lastPulseTime, 0u);
+
+    host::now = 5'000'000;
+    host::pcntCount = 3;
+    WheelPulses pulses = sensor.read();
+    EXPECT_EQ(pulses.count, 3u);
+    EXPECT_EQ(pulses.lastPulseTime, 5'000'000u);
+
+    host::now = 6'000'000;
+    EXPECT_EQ(sensor.read().lastPulseTime, 5'000'000u);  // No new pulse
+
+    sensor.reset();
+    EXPECT_EQ(host::pcntCount, 0);
+    EXPECT_EQ(sensor.read().count, 0u);
+    EXPECT_FALSE(sensor.hasPulseTimes());
+}
+
+}  // namespace
@@ -0,0 +1,503 @@
+#include <gtest/gtest.h>
+#include <math.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#include "host.h"
+
+// The tests set the private values and force the state of the sequence lock: the members are made public
+#define class struct
+#include "state.h"
+#undef class
+
+namespace {
+
+// A writer adds to the distances while a reader takes snapshots: the generation and the 64-bit stage and total
+// distances, which cross 2^32 during the test, are always read from the same publication. Each write changes all of
+// them by 1.
+TEST(SharedStateTest, SnapshotNeverTorn) {
+    const int64_t start = (int64_t{1} << 32) - 100'000;
+    const int64_t offset = 123'456'789;
+    if (xSemaphoreTake(sharedState.mutex, STATE_SEMAPHORE_TIMEOUT)) {
+        sharedState.stageDistance.value = start;
+        sharedState.totalDistance.value = start + offset;
+        sharedState.publish();
+        sharedState.release();
+    }
+    const int64_t generation = sharedState.snapshot().generation;
+    uint32_t mutexTakes = host::mutexTakes(sharedState.mutex);
+
+    const int writes = 500'000;
+    std::atomic<bool> isWriting{true};
+    std::thread writer([&]() {
+        for (int i = 0; i < writes; i++) {
+            sharedState.addToStageDistance(1);
+        }
+        isWriting = false;
+    });
+
+    uint32_t reads = 0;
+    uint32_t lastGeneration = 0;
+    int64_t lastStageDistance = start;
+    while (isWriting || reads == 0) {
+        StateSnapshot snapshot = sharedState.snapshot();
+        ASSERT_EQ(snapshot.totalDistance - snapshot.stageDistance, offset) << "after " << reads << " reads";
+        ASSERT_EQ(snapshot.stageDistance - snapshot.generation, start - generation) << "after " << reads << " reads";
+        ASSERT_GE(snapshot.generation, lastGeneration);
+        ASSERT_GE(snapshot.stageDistance, lastStageDistance);
+        lastGeneration = snapshot.generation;
+        lastStageDistance = snapshot.stageDistance;
+        reads++;
+    }
+    writer.join();
+
+    EXPECT_EQ(sharedState.snapshot().stageDistance, start + writes);
+    // The readers only take the mutex after STATE_SNAPSHOT_MAX_RETRIES, the writer takes it once per write
+    uint32_t readerTakes = host::mutexTakes(sharedState.mutex) - mutexTakes - writes;
+    printf("%u snapshots during %d writes, %u with the mutex\n", reads, writes, readerTakes);
+    EXPECT_LT(readerTakes, reads / 10 + 1);
+}
+
+// A writer preempted while publishing leaves the sequence odd: after STATE_SNAPSHOT_MAX_RETRIES, the reader takes the
+// mutex and still gets consistent values.
+TEST(SharedStateTest, SnapshotFallsBackToMutex) {
+    sharedState.addToStageDistance(1000);
+    StateSnapshot expected = sharedState.snapshot();
+    uint32_t changes = sharedState.changedSince(0);
+
+    uint32_t mutexTakes = host::mutexTakes(sharedState.mutex);
+    sharedState.sequence.fetch_add(1);  // Being written
+    StateSnapshot snapshot = sharedState.snapshot();
+    EXPECT_EQ(host::mutexTakes(sharedState.mutex), mutexTakes + 1);
+    EXPECT_EQ(snapshot.generation, expected.generation);
+    EXPECT_EQ(snapshot.stageDistance, expected.stageDistance);
+    EXPECT_EQ(snapshot.totalDistance, expected.totalDistance);
+    EXPECT_EQ(sharedState.changedSince(0), changes);
+    EXPECT_EQ(host::mutexTakes(sharedState.mutex), mutexTakes + 2);
+    sharedState.sequence.fetch_add(1);
+
+    // Published again: lock-free
+    sharedState.snapshot();
+    EXPECT_EQ(host::mutexTakes(sharedState.mutex), mutexTakes + 2);
+}
+
+// Cost of the values of a display frame: one snapshot against the 15 getters, each one taking the mutex.
+TEST(SharedStateTest, SnapshotCost) {
+    const int frames = 200'000;
+    uint64_t sink = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < frames; i++) {
+        StateSnapshot snapshot = sharedState.snapshot();
+        sink += snapshot.stageDistance + snapshot.cap + snapshot.nbSatellites + snapshot.page;
+    }
+    double snapshotNs = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() /
+                        frames;
+
+    start = std::chrono::steady_clock::now();
+    for (int i = 0; i < frames; i++) {
+        sink += sharedState.getStageDistance() + sharedState.getTotalDistance() + sharedState.getCap() +
+                static_cast<uint64_t>(sharedState.getSpeed() + sharedState.getMaxSpeed() + sharedState.getAltitude()) +
+                sharedState.getNbSatellites() + sharedState.getTime().hour + sharedState.getTimezone() +
+                static_cast<uint64_t>(sharedState.getTemperature()) +
+                static_cast<uint64_t>(sharedState.getDistanceMode()) + sharedState.getWheelSize() +
+                sharedState.getMagnetsPerWheel() + sharedState.getBrightness() + sharedState.getPage();
+    }
+    double gettersNs = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() /
+                       frames;
+
+    printf("State: %.1f ns per frame with a snapshot, %.1f ns with the getters (%llu)\n", snapshotNs, gettersNs,
+           static_cast<unsigned long long>(sink % 10));
+    RecordProperty("ns_per_snapshot", std::to_string(snapshotNs));
+    RecordProperty("ns_per_getters_frame", std::to_string(gettersNs));
+    EXPECT_LT(snapshotNs, gettersNs);
+}
+
+// Millions of small increments on top of 20,000 km: the integer millimeters stay exact, where a float in meters would
+// round each increment away.
+TEST(SharedStateTest, DistanceExactAfterMillionsOfIncrements) {
+    sharedState.resetStageDistance();
+    int64_t total = sharedState.getTotalDistance();
+    const int64_t start = 20'000LL * 1000 * 1000;  // mm
+    for (int64_t distance = start; distance > 0; distance -= INT32_MAX) {
+        sharedState.addToStageDistance(static_cast<int32_t>(std::min<int64_t>(distance, INT32_MAX)));
+    }
+
+    const int increments = 3'000'000;
+    for (int i = 0; i < increments; i++) {
+        sharedState.addToStageDistance(600 + i % 1400);  // 0.6 to 2 m
+    }
+    int64_t added = 0;
+    for (int i = 0; i < increments; i++) {
+        added += 600 + i % 1400;
+    }
+    EXPECT_EQ(sharedState.getStageDistance(), start + added);
+    EXPECT_EQ(sharedState.getTotalDistance(), total + start + added);
+
+    float meters = start / 1000.0f;
+    meters += 1.0f;
+    EXPECT_EQ(meters, start / 1000.0f);  // The former float accumulator
+}
+
+// The generation only changes when a value actually changes, once per publication.
+TEST(SharedStateTest, GenerationOnlyOnChange) {
+    sharedState.setAltitude(100.0f);
+    uint32_t generation = sharedState.snapshot().generation;
+
+    sharedState.setAltitude(100.0f);
+    EXPECT_EQ(sharedState.snapshot().generation, generation);
+    EXPECT_EQ(sharedState.changedSince(generation), 0u);
+
+    sharedState.setAltitude(101.0f);
+    EXPECT_EQ(sharedState.snapshot().generation, generation + 1);
+
+    // Both distances in one publication
+    sharedState.addToStageDistance(500);
+    EXPECT_EQ(sharedState.snapshot().generation, generation + 2);
+    EXPECT_EQ(sharedState.changedSince(generation + 1), STATE_FIELD_STAGE_DISTANCE | STATE_FIELD_TOTAL_DISTANCE);
+}
+
+// The fields changed since a generation are reported until the consumer catches up, whatever the number of changes.
+TEST(SharedStateTest, ChangedSinceGeneration) {
+    uint32_t frame = sharedState.snapshot().generation;
+    EXPECT_EQ(sharedState.changedSince(frame), 0u);
+
+    sharedState.setCap(sharedState.getCap() + 1);
+    uint32_t afterCap = sharedState.snapshot().generation;
+    for (int i = 0; i < 10; i++) {
+        sharedState.setTemperature(20.0f + i);
+    }
+    sharedState.setNbSatellites(sharedState.getNbSatellites() + 1);
+
+    EXPECT_EQ(sharedState.changedSince(frame), STATE_FIELD_CAP | STATE_FIELD_TEMPERATURE | STATE_FIELD_NB_SATELLITES);
+    EXPECT_EQ(sharedState.changedSince(afterCap), STATE_FIELD_TEMPERATURE | STATE_FIELD_NB_SATELLITES);
+    EXPECT_EQ(sharedState.changedSince(sharedState.snapshot().generation), 0u);
+
+    // Saved fields too, with their bounds: a clamped value that does not change is not a change
+    sharedState.setBrightness(100);
+    uint32_t generation = sharedState.snapshot().generation;
+    sharedState.setBrightness(150);
+    EXPECT_EQ(sharedState.changedSince(generation), 0u);
+    sharedState.setBrightness(50);
+    EXPECT_EQ(sharedState.changedSince(generation), STATE_FIELD_BRIGHTNESS);
+}
+
+// A failed save leaves the state dirty: the next save writes it.
+TEST(SharedStateTest, FailedSaveRetried) {
+    StateRecord record;
+    sharedState.saveData(sharedState.journalSequence.value, record);
+    host::resetNvs();
+    sharedState.setBrightness(sharedState.getBrightness() == 40 ? 60 : 40);
+
+    host::nvsFailsWrites = true;
+    EXPECT_FALSE(sharedState.saveData(sharedState.journalSequence.value, record));
+    EXPECT_EQ(host::nvs.count(STATE_RECORD_KEY), 0u);
+
+    host::nvsFailsWrites = false;
+    uint32_t commits = host::nvsCommits;
+    EXPECT_TRUE(sharedState.saveData(sharedState.journalSequence.value, record));
+    EXPECT_EQ(host::nvsCommits, commits + 1);
+    ASSERT_EQ(host::nvs.count(STATE_RECORD_KEY), 1u);
+    StateRecord saved;
+    memcpy(&saved, host::nvs[STATE_RECORD_KEY].data.data(), sizeof(saved));
+    EXPECT_EQ(saved.brightness, sharedState.getBrightness());
+
+    // Saved: not written again
+    EXPECT_TRUE(sharedState.saveData(sharedState.journalSequence.value, record));
+    EXPECT_EQ(host::nvsCommits, commits + 1);
+}
+
+// Latency of a producer changing a setting: while the storage process is saving, the setter and the save request
+// neither wait for the flash nor for the mutex, compared with the former save inline in the setter.
+TEST(SharedStateTest, ProducerLatencyDuringSave) {
+    host::Task storage;
+    sharedState.registerStorageTask(&storage);
+    StateRecord record;
+    const int changes = 20'000;
+
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < changes; i++) {
+        sharedState.setBrightness(i % 2 == 0 ? 40 : 60);
+        sharedState.saveData(sharedState.journalSequence.value, record);
+    }
+    double inlineNs = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() /
+                      changes;
+
+    // The changes are made in the middle of a save, after the copy of the values and before the commit
+    double duringSaveNs = 0;
+    host::nvsOnCommit = [&]() {
+        host::nvsOnCommit = nullptr;
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < changes; i++) {
+            sharedState.setBrightness(i % 2 == 0 ? 60 : 40);
+            sharedState.requestSave(STORAGE_NOTIFY_SAVE_BIT);
+        }
+        duringSaveNs = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() /
+                       changes;
+    };
+    sharedState.setBrightness(50);
+    uint32_t notifications = storage.notifications;
+    EXPECT_TRUE(sharedState.saveData(sharedState.journalSequence.value, record));
+    sharedState.registerStorageTask(nullptr);
+
+    printf("State: %.1f ns per change during a save, %.1f ns with an inline save\n", duringSaveNs, inlineNs);
+    RecordProperty("ns_per_change_during_save", std::to_string(duringSaveNs));
+    RecordProperty("ns_per_change_inline_save", std::to_string(inlineNs));
+    EXPECT_EQ(storage.notifications - notifications, changes * 2u);
+    EXPECT_TRUE(sharedState.isDirty);  // Changed during the save: saved again by the next request
+    EXPECT_LT(duringSaveNs, inlineNs);
+}
+
+// The bounds are applied at compile time, from the type of the field or a wider one without wrapping around
+static_assert(SharedState::BrightnessField::clamp(200) == 100);
+static_assert(SharedState::BrightnessField::clamp(-5) == 0);
+static_assert(SharedState::MagnetsPerWheelField::clamp(uint8_t{0}) == 1);
+static_assert(SharedState::MagnetsPerWheelField::clamp(int8_t{-1}) == 1);
+static_assert(SharedState::MagnetsPerWheelField::clamp(uint8_t{3}) == 3);
+static_assert(SharedState::TimezoneField::clamp(200) == 14);
+static_assert(SharedState::TimezoneField::clamp(int8_t{-128}) == -12);
+static_assert(SharedState::StageDistanceField::clamp(int64_t{-1}) == 0);
+static_assert(SharedState::WheelSizeField::clamp(70'000) == UINT16_MAX);
+static_assert(SharedState::MaxSpeedField::clamp(500.0f) == STATE_MAX_VALID_SPEED);
+static_assert(SharedState::DistanceModeField::clamp(static_cast<DistanceMode>(7)) == HYBRID);
+
+// Each saved field goes to its own field of the record and back, with the header and the CRC of the record.
+TEST(SavedFieldTest, RecordRoundTrip) {
+    SharedState state;
+    state.setTimezone(-5);
+    state.setDistanceMode(FUSED);
+    state.setWheelSize(2150);
+    state.addToMagnetsPerWheel(2);
+    state.setBrightness(40);
+    state.setPage(2);
+    state.addToStageDistance(1'500'000'000);
+    state.addToStageDistance(1'500'000'000);  // Beyond 2^31
+    state.setSpeed(64.0f);
+
+    StateRecord record = state.toRecord();
+    EXPECT_EQ(record.version, STATE_RECORD_VERSION);
+    EXPECT_EQ(record.size, sizeof(StateRecord));
+    EXPECT_EQ(record.crc, stateRecordCrc(&record, record.size));
+    EXPECT_EQ(record.stageDistance, 3'000'000'000);
+    EXPECT_EQ(record.totalDistance, 3'000'000'000);
+    EXPECT_EQ(record.maxSpeed, 64.0f);
+    EXPECT_EQ(record.timezone, -5);
+    EXPECT_EQ(record.distanceMode, FUSED);
+    EXPECT_EQ(record.wheelSize, 2150);
+    EXPECT_EQ(record.magnetsPerWheel, STATE_DEFAULT_MAGNETS_PER_WHEEL + 2);
+    EXPECT_EQ(record.brightness, 40);
+    EXPECT_EQ(record.page, 2);
+    EXPECT_EQ(record.reserved, 0);
+
+    SharedState restored;
+    restored.fromRecord(record);
+    restored.publish();
+    StateRecord again = restored.toRecord();
+    EXPECT_EQ(memcmp(&again, &record, sizeof(StateRecord)), 0);
+    EXPECT_EQ(restored.snapshot().wheelSize, 2150);
+}
+
+// A record with values out of their bounds (e.g. written by a buggy version, with a valid CRC) gives clamped values.
+TEST(SavedFieldTest, OutOfRangeRecordClamped) {
+    SharedState state;
+    StateRecord record = state.toRecord();
+    record.stageDistance = -1000;
+    record.maxSpeed = -3.0f;
+    record.timezone = 100;
+    record.distanceMode = 200;
+    record.magnetsPerWheel = 0;
+    record.brightness = 200;
+    state.fromRecord(record);
+    state.publish();
+
+    EXPECT_EQ(state.getStageDistance(), 0);
+    EXPECT_EQ(state.getMaxSpeed(), 0.0f);
+    EXPECT_EQ(state.getTimezone(), 14);
+    EXPECT_EQ(state.getDistanceMode(), HYBRID);
+    EXPECT_EQ(state.getMagnetsPerWheel(), 1);
+    EXPECT_EQ(state.getBrightness(), 100);
+
+    record.magnetsPerWheel = STATE_MAX_MAGNETS_PER_WHEEL + 1;
+    record.maxSpeed = 1000.0f;
+    record.timezone = -100;
+    state.fromRecord(record);
+    EXPECT_EQ(state.getMagnetsPerWheel(), STATE_MAX_MAGNETS_PER_WHEEL);
+    EXPECT_EQ(state.getMaxSpeed(), STATE_MAX_VALID_SPEED);
+    EXPECT_EQ(state.getTimezone(), -12);
+}
+
+/** Boot of a new state over the NVS entries written by a test, with an empty journal. */
+class StateNvsTest : public ::testing::Test {
+   protected:
+    nvs_handle_t nvsHandle{0};
+
+    void SetUp() override {
+        host::resetNvs();
+        host::resetFlash();
+        host::resetReason = ESP_RST_POWERON;
+        distanceJournal = DistanceJournal();
+        distanceJournal.begin();
+    }
+
+    /** Record of the current version, with its CRC over `size` bytes. */
+    static StateRecord record(uint16_t version = STATE_RECORD_VERSION, uint16_t size = sizeof(StateRecord)) {
+        StateRecord record{};
+        record.version = version;
+        record.size = size;
+        record.stageDistance = 12'345'678;
+        record.totalDistance = 987'654'321;
+        record.journalSequence = 0;
+        record.maxSpeed = 87.5f;
+        record.wheelSize = 2100;
+        record.timezone = 2;
+        record.distanceMode = GPS;
+        record.magnetsPerWheel = 2;
+        record.brightness = 60;
+        record.page = 3;
+        record.crc = stateRecordCrc(&record, size);
+        return record;
+    }
+};
+
+// The entries of the previous versions, one per value with the distances in float meters, are read and saved again as
+// a single record: the legacy entries are erased with it.
+TEST_F(StateNvsTest, LegacyEntriesMigrated) {
+    float stageMeters = 1234.5f;
+    int64_t totalMillimeters = 987'654'321;  // Already in mm, as saved by the first integer version
+    float maxSpeed = 87.5f;
+    nvs_set_blob(nvsHandle, "stageDistance", &stageMeters, sizeof(stageMeters));
+    nvs_set_blob(nvsHandle, "totalDistance", &totalMillimeters, sizeof(totalMillimeters));
+    nvs_set_blob(nvsHandle, "maxSpeed", &maxSpeed, sizeof(maxSpeed));
+    nvs_set_i8(nvsHandle, "timezone", -3);
+    nvs_set_u8(nvsHandle, "distanceMode", GPS);
+    nvs_set_u16(nvsHandle, "wheelSize", 2100);
+    nvs_set_u8(nvsHandle, "magnets", 2);
+    nvs_set_u8(nvsHandle, "brightness", 60);
+    nvs_set_u8(nvsHandle, "page", 3);
+
+    SharedState state;
+    state.loadData();
+    EXPECT_EQ(state.getStageDistance(), 1'234'500);
+    EXPECT_EQ(state.getTotalDistance(), 987'654'321);
+    EXPECT_EQ(state.getMaxSpeed(), 87.5f);
+    EXPECT_EQ(state.getTimezone(), -3);
+    EXPECT_EQ(state.getDistanceMode(), GPS);
+    EXPECT_EQ(state.getWheelSize(), 2100);
+    EXPECT_EQ(state.getMagnetsPerWheel(), 2);
+    EXPECT_EQ(state.getBrightness(), 60);
+    EXPECT_EQ(state.getPage(), 3);
+    EXPECT_TRUE(state.isDirty);
+
+    StateRecord saved;
+    EXPECT_TRUE(state.saveData(distanceJournal.getSequence(), saved));
+    EXPECT_EQ(host::nvsCommits, 1u);
+    ASSERT_EQ(host::nvs.size(), 1u);
+    ASSERT_EQ(host::nvs.count(STATE_RECORD_KEY), 1u);
+    EXPECT_EQ(saved.stageDistance, 1'234'500);
+    EXPECT_EQ(saved.timezone, -3);
+
+    // Next boot: from the record
+    SharedState rebooted;
+    rebooted.loadData();
+    EXPECT_EQ(rebooted.getStageDistance(), 1'234'500);
+    EXPECT_EQ(rebooted.getWheelSize(), 2100);
+    EXPECT_FALSE(rebooted.isDirty);
+}
+
+// A shorter record of an older version: the fields it knows are read, the appended ones keep their defaults, and the
+// record is saved again in the current version.
+TEST_F(StateNvsTest, OlderRecordVersionMigrated) {
+    StateRecord older = record(STATE_RECORD_VERSION - 1, offsetof(StateRecord, wheelSize));
+    nvs_set_blob(nvsHandle, STATE_RECORD_KEY, &older, older.size);
+
+    SharedState state;
+    state.loadData();
+    EXPECT_EQ(state.getStageDistance(), 12'345'678);
+    EXPECT_EQ(state.getTotalDistance(), 987'654'321);
+    EXPECT_EQ(state.getMaxSpeed(), 87.5f);
+    EXPECT_EQ(state.getWheelSize(), STATE_DEFAULT_WHEEL_SIZE);
+    EXPECT_EQ(state.getMagnetsPerWheel(), STATE_DEFAULT_MAGNETS_PER_WHEEL);
+    EXPECT_EQ(state.getBrightness(), STATE_DEFAULT_BRIGHTNESS);
+    EXPECT_TRUE(state.isDirty);
+
+    StateRecord saved;
+    EXPECT_TRUE(state.saveData(distanceJournal.getSequence(), saved));
+    EXPECT_EQ(host::nvs[STATE_RECORD_KEY].data.size(), sizeof(StateRecord));
+    EXPECT_EQ(saved.version, STATE_RECORD_VERSION);
+    EXPECT_EQ(saved.stageDistance, 12'345'678);
+    EXPECT_EQ(saved.wheelSize, STATE_DEFAULT_WHEEL_SIZE);
+}
+
+// A longer record of a newer version: the known fields are read, the unknown ones are ignored and kept in NVS.
+TEST_F(StateNvsTest, NewerRecordVersionRead) {
+    uint8_t newer[sizeof(StateRecord) + 8];
+    memset(newer, 0xA5, sizeof(newer));
+    StateRecord known = record(STATE_RECORD_VERSION + 1, sizeof(newer));
+    memcpy(newer, &known, sizeof(StateRecord));
+    reinterpret_cast<StateRecord*>(newer)->crc = stateRecordCrc(newer, sizeof(newer));
+    nvs_set_blob(nvsHandle, STATE_RECORD_KEY, newer, sizeof(newer));
+
+    SharedState state;
+    state.loadData();
+    EXPECT_EQ(state.getStageDistance(), 12'345'678);
+    EXPECT_EQ(state.getWheelSize(), 2100);
+    EXPECT_EQ(state.getPage(), 3);
+    EXPECT_FALSE(state.isDirty);
+}
+
+// Empty NVS, e.g. the first boot: no legacy entry is found, nothing to migrate nor to save.
+TEST_F(StateNvsTest, EmptyNvsNotMigrated) {
+    SharedState state;
+    state.loadData();
+    EXPECT_EQ(state.getWheelSize(), STATE_DEFAULT_WHEEL_SIZE);
+    EXPECT_FALSE(state.isDirty);
+    EXPECT_FALSE(state.hasLegacyEntries);
+
+    StateRecord saved;
+    EXPECT_TRUE(state.saveData(distanceJournal.getSequence(), saved));
+    EXPECT_EQ(host::nvsCommits, 0u);
+}
+
+// A record with a wrong CRC, a wrong size or shorter than its header is ignored: the values are read from the legacy
+// entries still there, the others keep their defaults. The next save keeps a copy of the corrupted record.
+TEST_F(StateNvsTest, CorruptedRecordKept) {
+    std::vector<std::function<void(std::vector<uint8_t>&)>> corruptions{
+        [](std::vector<uint8_t>& blob) { blob[offsetof(StateRecord, wheelSize)] ^= 0x10; },
+        [](std::vector<uint8_t>& blob) { blob.resize(blob.size() - 4); },
+        [](std::vector<uint8_t>& blob) { blob.resize(offsetof(StateRecord, stageDistance) - 1); },
+    };
+    for (size_t i = 0; i < corruptions.size(); i++) {
+        SetUp();
+        StateRecord current = record();
+        nvs_set_blob(nvsHandle, STATE_RECORD_KEY, &current, sizeof(current));
+        nvs_set_u16(nvsHandle, "wheelSize", 1900);
+        corruptions[i](host::nvs[STATE_RECORD_KEY].data);
+        std::vector<uint8_t> corrupted = host::nvs[STATE_RECORD_KEY].data;
+
+        SharedState state;
+        state.loadData();
+        EXPECT_EQ(state.getStageDistance(), 0) << "corruption " << i;
+        EXPECT_EQ(state.getTotalDistance(), 0) << "corruption " << i;
+        EXPECT_EQ(state.getWheelSize(), 1900) << "corruption " << i;
+        EXPECT_EQ(state.getBrightness(), STATE_DEFAULT_BRIGHTNESS) << "corruption " << i;
+
+        StateRecord saved;
+        EXPECT_TRUE(state.saveData(distanceJournal.getSequence(), saved));
+        ASSERT_EQ(host::nvs.count(STATE_CORRUPTED_KEY), 1u) << "corruption " << i;
+        EXPECT_EQ(host::nvs[STATE_CORRUPTED_KEY].data, corrupted) << "corruption " << i;
+        EXPECT_EQ(host::nvs[STATE_RECORD_KEY].data.size(), sizeof(StateRecord)) << "corruption " << i;
+        EXPECT_EQ(host::nvs.count("wheelSize"), 0u) << "corruption " << i;
+
+        // The copy is not overwritten by the next saves
+        state.setBrightness(70);
+        EXPECT_TRUE(state.saveData(distanceJournal.getSequence(), saved));
+        EXPECT_EQ(host::nvs[STATE_CORRUPTED_KEY].data, corrupted) << "corruption " << i;
+    }
+}
+
+}  // namespace
@@ -0,0 +1,92 @@
+#include "state_bus.h"
+
+#include <gtest/gtest.h>
+
+#include <chrono>
+
+#include "host.h"
+#include "state.h"
+
+namespace {
+
+const uint32_t BUS_BIT = 1 << 4;  // Notification bit of the subscribers, beside the other notifications
+
+// A subscriber is only notified of its topics, once per publication whatever the number of changed fields.
+TEST(StateBusTest, TopicFiltering) {
+    StateBus bus;
+    host::Task display, storage, logger;
+    ASSERT_TRUE(bus.subscribe(&display, STATE_FIELD_SPEED | STATE_FIELD_STAGE_DISTANCE, BUS_BIT));
+    ASSERT_TRUE(bus.subscribe(&storage, STATE_FIELD_WHEEL_SIZE, BUS_BIT << 1));
+    ASSERT_TRUE(bus.subscribe(&logger, UINT32_MAX, BUS_BIT));
+
+    bus.publish(STATE_FIELD_SPEED | STATE_FIELD_STAGE_DISTANCE | STATE_FIELD_TOTAL_DISTANCE);
+    EXPECT_EQ(display.notifications, 1u);
+    EXPECT_EQ(display.value, BUS_BIT);
+    EXPECT_EQ(storage.notifications, 0u);
+    EXPECT_EQ(storage.value, 0u);
+    EXPECT_EQ(logger.notifications, 1u);
+
+    bus.publish(STATE_FIELD_WHEEL_SIZE);
+    EXPECT_EQ(display.notifications, 1u);
+    EXPECT_EQ(storage.notifications, 1u);
+    EXPECT_EQ(storage.value, BUS_BIT << 1);
+    EXPECT_EQ(logger.notifications, 2u);
+
+    bus.publish(0);  // Nothing changed
+    EXPECT_EQ(logger.notifications, 2u);
+}
+
+// Up to STATE_MAX_SUBSCRIBERS subscribers, all notified: the next subscription fails without changing the others.
+TEST(StateBusTest, ManySubscribers) {
+    StateBus bus;
+    host::Task tasks[STATE_MAX_SUBSCRIBERS + 1];
+    for (size_t i = 0; i < STATE_MAX_SUBSCRIBERS; i++) {
+        EXPECT_TRUE(bus.subscribe(&tasks[i], STATE_FIELD_CAP << (i % 2), BUS_BIT)) << "subscriber " << i;
+    }
+    EXPECT_FALSE(bus.subscribe(&tasks[STATE_MAX_SUBSCRIBERS], STATE_FIELD_CAP, BUS_BIT));
+
+    bus.publish(STATE_FIELD_CAP);
+    for (size_t i = 0; i <= STATE_MAX_SUBSCRIBERS; i++) {
+        EXPECT_EQ(tasks[i].notifications, i < STATE_MAX_SUBSCRIBERS && i % 2 == 0 ? 1u : 0u) << "subscriber " << i;
+    }
+}
+
+// The state notifies its subscribers when a value actually changes, once for all the fields changed together.
+TEST(StateBusTest, NotifiedByState) {
+    SharedState state;
+    host::Task display;
+    ASSERT_TRUE(state.subscribe(&display, STATE_FIELD_SPEED | STATE_FIELD_MAX_SPEED, BUS_BIT));
+
+    state.setSpeed(42.0f);  // Speed and max speed
+    EXPECT_EQ(display.notifications, 1u);
+    state.setSpeed(42.0f);
+    EXPECT_EQ(display.notifications, 1u);
+    state.setAltitude(120.0f);
+    EXPECT_EQ(display.notifications, 1u);
+    state.setSpeed(30.0f);
+    EXPECT_EQ(display.notifications, 2u);
+}
+
+// Fixed CPU budget: a publication is a loop over the subscribers, without lock, taken by each writer of the state.
+TEST(StateBusTest, PublishCost) {
+    StateBus bus;
+    host::Task tasks[STATE_MAX_SUBSCRIBERS];
+    for (size_t i = 0; i < STATE_MAX_SUBSCRIBERS; i++) {
+        bus.subscribe(&tasks[i], i % 2 == 0 ? STATE_FIELD_SPEED : STATE_FIELD_ALTITUDE, BUS_BIT);
+    }
+
+    const int publications = 1'000'000;
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < publications; i++) {
+        bus.publish(i % 4 == 0 ? STATE_FIELD_ALTITUDE : STATE_FIELD_SPEED);
+    }
+    double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() /
+                publications;
+    printf("State bus: %.1f ns per publication to %d subscribers\n", ns, STATE_MAX_SUBSCRIBERS);
+    RecordProperty("ns_per_publication", std::to_string(ns));
+    EXPECT_EQ(tasks[0].notifications, publications * 3u / 4);
+    EXPECT_EQ(tasks[1].notifications, publications / 4u);
+    EXPECT_LT(ns, 2'000.0);
+}
+
+}  // namespace
@@ -0,0 +1,121 @@
+#include "state_mirror.h"
+
+#include <gtest/gtest.h>
+
+#include <functional>
+#include <vector>
+
+#include "host.h"
+#include "state.h"
+
+namespace {
+
+/** Boots of the state over empty NVS and journal, with the RTC memory kept from one boot to the next. */
+class StateMirrorTest : public ::testing::Test {
+   protected:
+    void SetUp() override {
+        host::resetNvs();
+        host::resetFlash();
+        host::resetReason = ESP_RST_POWERON;
+        distanceJournal = DistanceJournal();
+        distanceJournal.begin();
+        stateMirror = StateMirror{};
+    }
+
+    void TearDown() override { host::resetReason = ESP_RST_POWERON; }
+
+    /** Ride the first boot without saving: the values only are in the mirror. */
+    void rideWithoutSaving() {
+        SharedState state;
+        state.loadData();
+        state.setWheelSize(2100);
+        state.addToStageDistance(12'345);
+    }
+};
+
+// Reset without power loss: the values of the mirror are restored, and saved at the start of the storage process.
+TEST_F(StateMirrorTest, RestoredAfterReset) {
+    for (esp_reset_reason_t reason : {ESP_RST_SW, ESP_RST_PANIC, ESP_RST_TASK_WDT, ESP_RST_BROWNOUT}) {
+        SetUp();
+        rideWithoutSaving();
+
+        host::resetReason = reason;
+        SharedState state;
+        state.loadData();
+        EXPECT_EQ(state.getWheelSize(), 2100) << "reset " << reason;
+        EXPECT_EQ(state.getStageDistance(), 12'345) << "reset " << reason;
+        EXPECT_EQ(state.getTotalDistance(), 12'345) << "reset " << reason;
+
+        StateRecord record;
+        EXPECT_TRUE(state.saveData(0, record));
+        EXPECT_EQ(host::nvsCommits, 1u) << "reset " << reason;
+        EXPECT_EQ(record.wheelSize, 2100) << "reset " << reason;
+    }
+}
+
+// Power-on: the RTC memory is random, the mirror is ignored even if it looks valid.
+TEST_F(StateMirrorTest, IgnoredAfterPowerOn) {
+    rideWithoutSaving();
+    StateRecord record;
+    host::resetReason = ESP_RST_SW;
+    EXPECT_TRUE(readStateMirror(record));
+
+    host::resetReason = ESP_RST_POWERON;
+    EXPECT_FALSE(readStateMirror(record));
+    SharedState state;
+    state.loadData();
+    EXPECT_EQ(state.getWheelSize(), STATE_DEFAULT_WHEEL_SIZE);
+    EXPECT_EQ(state.getStageDistance(), 0);
+}
+
+// A mirror without the magic, of another record version or size, or with a wrong CRC is ignored after a reset: the
+// values keep their defaults.
+TEST_F(StateMirrorTest, InvalidMirrorIgnored) {
+    std::vector<std::function<void()>> corruptions{
+        [&]() { stateMirror.magic = ~STATE_MIRROR_MAGIC; },
+        [&]() {
+            stateMirror.record.version = STATE_RECORD_VERSION + 1;
+            stateMirror.record.crc = stateRecordCrc(&stateMirror.record, stateMirror.record.size);
+        },
+        [&]() {
+            stateMirror.record.size = sizeof(StateRecord) - 8;
+            stateMirror.record.crc = stateRecordCrc(&stateMirror.record, stateMirror.record.size);
+        },
+        [&]() { stateMirror.record.wheelSize ^= 1; },
+    };
+    for (size_t i = 0; i < corruptions.size(); i++) {
+        SetUp();
+        rideWithoutSaving();
+        corruptions[i]();
+
+        host::resetReason = ESP_RST_PANIC;
+        StateRecord record;
+        EXPECT_FALSE(readStateMirror(record)) << "corruption " << i;
+        SharedState state;
+        state.loadData();
+        EXPECT_EQ(state.getWheelSize(), STATE_DEFAULT_WHEEL_SIZE) << "corruption " << i;
+        EXPECT_EQ(state.getStageDistance(), 0) << "corruption " << i;
+    }
+}
+
+// The mirror is only written once the values are loaded, and only when a saved field changes.
+TEST_F(StateMirrorTest, WrittenOnSavedFieldChanges) {
+    SharedState state;
+    state.setWheelSize(2100);
+    EXPECT_NE(stateMirror.magic, STATE_MIRROR_MAGIC);  // Not loaded: the mirror of the last boot is kept
+
+    state.loadData();
+    state.setAltitude(250.0f);
+    EXPECT_NE(stateMirror.magic, STATE_MIRROR_MAGIC);
+
+    state.setWheelSize(2200);
+    EXPECT_EQ(stateMirror.magic, STATE_MIRROR_MAGIC);
+    EXPECT_EQ(stateMirror.record.wheelSize, 2200);
+    EXPECT_EQ(stateMirror.record.crc, stateRecordCrc(&stateMirror.record, sizeof(StateRecord)));
+
+    state.addToStageDistance(500);
+    EXPECT_EQ(stateMirror.record.stageDistance, 500);
+    EXPECT_EQ(stateMirror.record.wheelSize, 2200);
+}
+
+}  // namespace
@@ -0,0 +1,117 @@
+#include "wheel_sensor.h"
+
+#include <gtest/gtest.h>
+#include <math.h>
+
+#include <random>
+
+#include "host.h"
+
+namespace {
+
+/** Pulse train of the magnet on the GPIO interrupt, with the double triggers of a wobbly magnet. */
+class PulseTrain {
+    std::mt19937 random{7};
+
+   public:
+    GpioWheelSensor sensor;
+    uint32_t pulses{0};
+    uint32_t bounces{0};
+
+    PulseTrain() {
+        host::now = 1'000'000;
+        sensor.begin();
+    }
+
+    /**
+     * Pulses at a speed, each one followed by a bounce with a probability.
+     * @param distancePerPulse Distance between two pulses in mm.
+     * @param bounceRatio Probability of a bounce after a pulse.
+     */
+    void ride(int count, float speed, float distancePerPulse, float bounceRatio = 0.0f) {
+        std::uniform_real_distribution<float> uniform(0.0f, 1.0f);
+        uint64_t period = static_cast<uint64_t>(distancePerPulse / speed * 3600.0f);
+        for (int i = 0; i < count; i++) {
+            host::now += period;
+            host::gpioInterrupt(MAGNETIC_SENSOR_PIN);
+            pulses++;
+
+            // Bounce shortly after the pulse: after 0.5 ms to 30% of the period, at most 100 ms
+            if (uniform(random) < bounceRatio) {
+                uint64_t delay = 500 + static_cast<uint64_t>(uniform(random) * fminf(0.3f * period, 100'000.0f));
+                host::now += delay;
+                host::gpioInterrupt(MAGNETIC_SENSOR_PIN);
+                host::now -= delay;
+                bounces++;
+            }
+        }
+    }
+};
+
+// Counting starts at 150 km/h with 4 magnets (12 ms between pulses): no pulse is lost to the initial window.
+TEST(GpioWheelSensorTest, HighSpeedFromStart) {
+    PulseTrain train;
+    train.ride(500, 150.0f, 500.0f);
+    EXPECT_EQ(train.sensor.read().count, train.pulses);
+    EXPECT_EQ(train.sensor.rejectedBounces(), 0u);
+}
+
+// Reset at speed, e.g. on a mode change: the window of the current speed is kept, no pulse is lost after the reset.
+TEST(GpioWheelSensorTest, ResetAtSpeed) {
+    PulseTrain train;
+    train.ride(100, 150.0f, 500.0f, 0.5f);
+    train.sensor.reset();
+    EXPECT_EQ(train.sensor.read().count, 0u);
+
+    uint32_t rejected = train.sensor.rejectedBounces();
+    train.pulses = train.bounces = 0;
+    train.ride(100, 150.0f, 500.0f, 0.5f);
+    EXPECT_EQ(train.sensor.read().count, train.pulses);
+    EXPECT_EQ(train.sensor.rejectedBounces() - rejected, train.bounces);
+}
+
+// Walking pace (1.4 s between pulses): the double triggers of the magnet, up to 100 ms later, are rejected. Only the
+// bounce of the first pulse passes, before a period is measured.
+TEST(GpioWheelSensorTest, LowSpeedBounces) {
+    PulseTrain train;
+    train.ride(1, 5.0f, 2000.0f, 1.0f);
+    EXPECT_EQ(train.sensor.read().count, 2u);
+
+    train.ride(100, 5.0f, 2000.0f, 1.0f);
+    EXPECT_EQ(train.sensor.read().count, train.pulses + 1);
+    EXPECT_EQ(train.sensor.rejectedBounces(), train.bounces - 1);
+}
+
+// Slow stop, then a rolling start at 20 km/h with 4 magnets (90 ms between pulses): the window of the slow pulses
+// before the stop is dropped, with or without a reset during the stop, no pulse is lost on the restart.
+TEST(GpioWheelSensorTest, RollingStartAfterStop) {
+    for (bool isReset : {false, true}) {
+        PulseTrain train;
+        train.ride(10, 2.0f, 500.0f);
+        host::now += 10'000'000;
+        if (isReset) train.sensor.reset();
+
+        uint32_t count = train.sensor.read().count;
+        train.pulses = 0;
+        train.ride(100, 20.0f, 500.0f, 0.3f);
+        EXPECT_EQ(train.sensor.read().count - count, train.pulses) << "reset: " << isReset;
+    }
+}
+
+// Noisy ride from walking pace to 160 km/h and back, with bounces after a third of the pulses: the count is exact
+// across the speed range, each bounce is reported.
+TEST(GpioWheelSensorTest, NoisyPulseTrain) {
+    PulseTrain train;
+    train.ride(1, 5.0f, 2000.0f);
+    for (float speed = 5.0f; speed < 160.0f; speed *= 1.05f) {
+        train.ride(10, speed, 2000.0f, 0.3f);
+    }
+    for (float speed = 160.0f; speed > 5.0f; speed /= 1.05f) {
+        train.ride(10, speed, 2000.0f, 0.3f);
+    }
+    EXPECT_EQ(train.sensor.read().count, train.pulses);
+    EXPECT_EQ(train.sensor.rejectedBounces(), train.bounces);
+    EXPECT_GT(train.bounces, 100u);
+}
+
+}  // namespace
@@ -0,0 +1,147 @@
+#include "wheel_speed.h"
+
+#include <gtest/gtest.h>
+
+#include <thread>
+
+#include "spsc_ring.h"
+
+namespace {
+
+TEST(SpscRingTest, FirstInFirstOut) {
+    SpscRing<uint64_t, 4> ring;
+    uint64_t item;
+    EXPECT_FALSE(ring.pop(item));
+
+    // Many times the size: the free running indexes wrap around the buffer
+    for (uint64_t i = 0; i < 100; i++) {
+        ASSERT_TRUE(ring.push(i));
+        ASSERT_TRUE(ring.push(i + 1000));
+        ASSERT_TRUE(ring.pop(item));
+        EXPECT_EQ(item, i);
+        ASSERT_TRUE(ring.pop(item));
+        EXPECT_EQ(item, i + 1000);
+    }
+    EXPECT_FALSE(ring.pop(item));
+}
+
+// Full ring: the new items are dropped, the oldest ones are kept.
+TEST(SpscRingTest, Overflow) {
+    SpscRing<uint64_t, 4> ring;
+    for (uint64_t i = 0; i < 4; i++) {
+        ASSERT_TRUE(ring.push(i));
+    }
+    EXPECT_FALSE(ring.push(4));
+
+    uint64_t item;
+    ASSERT_TRUE(ring.pop(item));
+    EXPECT_EQ(item, 0u);
+    EXPECT_TRUE(ring.push(5));
+    for (uint64_t expected : {1, 2, 3, 5}) {
+        ASSERT_TRUE(ring.pop(item));
+        EXPECT_EQ(item, expected);
+    }
+
+    ring.push(6);
+    ring.clear();
+    EXPECT_FALSE(ring.pop(item));
+}
+
+// A producer and a consumer thread: every item pushed is popped once, in order.
+TEST(SpscRingTest, ConcurrentProducerAndConsumer) {
+    SpscRing<uint64_t, 32> ring;
+    const uint64_t items = 200'000;
+    std::thread producer([&]() {
+        for (uint64_t i = 1; i <= items;) {
+            if (ring.push(i)) {
+                i++;
+            } else {
+                std::this_thread::yield();  // Full: let the consumer run, even on a single core
+            }
+        }
+    });
+
+    uint64_t expected = 1, item;
+    while (expected <= items) {
+        if (ring.pop(item)) {
+            ASSERT_EQ(item, expected);
+            expected++;
+        } else {
+            std::this_thread::yield();
+        }
+    }
+    producer.join();
+    EXPECT_FALSE(ring.pop(item));
+}
+
+class WheelSpeedTest : public ::testing::Test {
+   protected:
+    WheelSpeedEstimator estimator;
+    uint64_t time{1'000'000};  // us
+
+    /** Add timestamped pulses at a speed, with a distance of 2000 mm per pulse. */
+    void pulses(int count, float speed) {
+        for (int i = 0; i < count; i++) {
+            time += static_cast<uint64_t>(2000.0f / speed * 3600.0f);
+            estimator.addPulses(1, time);
+        }
+    }
+};
+
+// A few tenths of km/h, where a count over a 1 s window would be quantized by 7.2 km/h.
+TEST_F(WheelSpeedTest, ResolutionFromPeriods) {
+    for (float speed : {3.6f, 12.3f, 47.9f, 48.2f, 160.0f}) {
+        estimator.reset();
+        pulses(MAGNETIC_SPEED_PERIODS + 1, speed);
+        EXPECT_NEAR(estimator.getSpeed(time, 2000.0f), speed, speed * 0.001f);
+    }
+}
+
+// The speed is known from the second pulse.
+TEST_F(WheelSpeedTest, SpeedFromSecondPulse) {
+    pulses(1, 30.0f);
+    EXPECT_EQ(estimator.getSpeed(time, 2000.0f), 0.0f);
+    pulses(1, 30.0f);
+    EXPECT_NEAR(estimator.getSpeed(time, 2000.0f), 30.0f, 0.03f);
+}
+
+// Median of the periods: a bounce (short period) and a missed pulse (double period) do not change the speed.
+TEST_F(WheelSpeedTest, MedianRejectsIsolatedPeriods) {
+    pulses(MAGNETIC_SPEED_PERIODS, 40.0f);
+    time += 5000;
+    estimator.addPulses(1, time);  // Bounce
+    EXPECT_NEAR(estimator.getSpeed(time, 2000.0f), 40.0f, 0.05f);
+
+    pulses(MAGNETIC_SPEED_PERIODS, 40.0f);
+    time += 2 * static_cast<uint64_t>(2000.0f / 40.0f * 3600.0f);
+    estimator.addPulses(1, time);  // Missed pulse
+    EXPECT_NEAR(estimator.getSpeed(time, 2000.0f), 40.0f, 0.05f);
+}
+
+// Pulses grouped by the reader (no time for each pulse): the period is averaged over the group.
+TEST_F(WheelSpeedTest, GroupedPulses) {
+    estimator.addPulses(1, time);
+    for (int i = 0; i < 10; i++) {
+        time += 3 * 200'000;
+        estimator.addPulses(3, time);
+    }
+    EXPECT_NEAR(estimator.getSpeed(time, 2000.0f), 36.0f, 0.01f);
+}
+
+// Slowing down to a stop: the speed decreases with the time since the last pulse, then drops to 0.
+TEST_F(WheelSpeedTest, TimeoutToZero) {
+    pulses(MAGNETIC_SPEED_PERIODS, 36.0f);
+    EXPECT_NEAR(estimator.getSpeed(time + 100'000, 2000.0f), 36.0f, 0.01f);  // Within the period
+    EXPECT_NEAR(estimator.getSpeed(time + 400'000, 2000.0f), 18.0f, 0.01f);
+    EXPECT_GT(estimator.getSpeed(time + MAGNETIC_SPEED_TIMEOUT_US - 1, 2000.0f), 0.0f);
+    EXPECT_EQ(estimator.getSpeed(time + MAGNETIC_SPEED_TIMEOUT_US, 2000.0f), 0.0f);
+
+    // Restart: the period of the stop is not used
+    time += 10'000'000;
+    estimator.addPulses(1, time);
+    EXPECT_EQ(estimator.getSpeed(time, 2000.0f), 0.0f);
+    pulses(1, 20.0f);
+    EXPECT_NEAR(estimator.getSpeed(time, 2000.0f), 20.0f, 0.02f);
+}
+
+}  // namespace